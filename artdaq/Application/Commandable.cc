@@ -200,7 +200,7 @@ std::vector<std::string> artdaq::Commandable::legal_commands() const
     return { "pause", "stop" };
   }
   if (currentState == "Paused") {
-    return { "resume", "stop" };
+    return { "resume", "soft_init", "stop" };
   }
 
   // Booted and Error
@@ -4,10 +4,28 @@
 #include "fhiclcpp/fwd.h"
 #include "artdaq/Application/CommandableFragmentGenerator.hh"
 #include "artdaq-core/Data/Fragments.hh"
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 namespace artdaq {
-  // CompositeDriver handles a set of lower-level generators
+  // CompositeDriver handles a set of lower-level generators.
+  //
+  // By default getNext_() polls the children one after another, so a
+  // slow child holds up the others. With parallel_child_polling set,
+  // each child instead runs on a thread of its own, started from the
+  // first getNext_() after start or resume (so inheriting the placement
+  // and priority of the readout thread), and feeds a shared queue of at
+  // most max_queued_fragments Fragments; getNext_() takes whatever is
+  // there. A call may then return the Fragments of some children and
+  // not others, and the children may run ahead of one another in
+  // sequence ID, so the BoardReader's skip_seqId_test is best set.
+  //
+  // In either mode, a child that fails (its getNext() reports an
+  // exception, or anything escapes it) ends the readout: getNext_()
+  // throws once the other children have been stopped polling.
   class CompositeDriver : public CommandableFragmentGenerator {
     public:
       explicit CompositeDriver(fhicl::ParameterSet const &);
@@ -24,9 +42,38 @@ namespace artdaq {
 
       bool makeChildGenerator_(fhicl::ParameterSet const &);
 
+      // getNext_() with a thread per child.
+      bool getNextParallel_(artdaq::FragmentPtrs & output);
+
+      // The thread for child idx: read it out into the shared queue until
+      // it returns false, keeping what went wrong, if anything, in
+      // child_errors_.
+      void pollChild_(size_t idx);
+
+      // Throw if the child at idx, which has returned false from
+      // getNext(), did so because of an exception.
+      void checkChild_(size_t idx);
+
+      // Wait for the child threads to finish; with abandon, first tell
+      // any waiting for room in the queue to give up.
+      void joinChildThreads_(bool abandon);
+
       std::vector<std::unique_ptr<CommandableFragmentGenerator>> generator_list_;
       std::vector<bool> generator_active_list_;
 
+      bool parallel_child_polling_;
+      size_t max_queued_fragments_;
+      bool launch_child_threads_; // Set by start() and resume().
+      std::vector<std::thread> child_threads_;
+      // The rest is guarded by queue_mutex_.
+      std::mutex queue_mutex_;
+      std::condition_variable queue_cond_;
+      artdaq::FragmentPtrs queued_fragments_;
+      size_t polling_child_count_;
+      bool abandon_children_;
+      std::vector<std::exception_ptr> child_errors_; // By child index.
+      bool child_failed_;
+
   };
 }
 #endif /* artdaq_Application_CompositeDriver_hh */
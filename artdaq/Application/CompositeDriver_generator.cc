@@ -6,11 +6,36 @@
 #include "cetlib/exception.h"
 #include "messagefacility/MessageLogger/MessageLogger.h"
 
+#include <algorithm>
+#include <chrono>
+
 using fhicl::ParameterSet;
 
+namespace {
+  // The longest getNext_() waits for the child threads while holding
+  // our mutex, which StopCmd() and PauseCmd() also need.
+  const std::chrono::milliseconds CHILD_WAIT(10);
+  // How long a child thread waits before asking a child that had nothing
+  // for it again: from the first, doubling up to the second while the
+  // child stays idle.
+  const std::chrono::microseconds IDLE_CHILD_WAIT_MIN(10);
+  const std::chrono::microseconds IDLE_CHILD_WAIT_MAX(1000);
+}
+
 artdaq::CompositeDriver::CompositeDriver(ParameterSet const & ps):
-  CommandableFragmentGenerator(ps)
+  CommandableFragmentGenerator(ps),
+  parallel_child_polling_(ps.get<bool>("parallel_child_polling", false)),
+  max_queued_fragments_(ps.get<size_t>("max_queued_fragments", 1000)),
+  launch_child_threads_(false),
+  polling_child_count_(0),
+  abandon_children_(false),
+  child_errors_(),
+  child_failed_(false)
 {
+  if (max_queued_fragments_ == 0) {
+    throw art::Exception(art::errors::Configuration, "CompositeDriver: ")
+      << "max_queued_fragments must be at least 1.\n";
+  }
   std::vector<ParameterSet> psetList =
     ps.get<std::vector<ParameterSet>>("generator_config_list");
   for (auto pset : psetList) {
@@ -24,6 +49,14 @@ artdaq::CompositeDriver::CompositeDriver(ParameterSet const & ps):
 
 artdaq::CompositeDriver::~CompositeDriver() noexcept
 {
+  try {
+    joinChildThreads_(true);
+  }
+  catch (...) {
+    mf::LogError("CompositeDriver")
+      << "Unknown exception when stopping the child generator threads";
+  }
+
   // 15-Feb-2014, KAB - explicitly destruct the generators so that
   // we can control the order in which they are destructed
   size_t listSize = generator_list_.size();
@@ -42,6 +75,8 @@ artdaq::CompositeDriver::~CompositeDriver() noexcept
 
 void artdaq::CompositeDriver::start()
 {
+  joinChildThreads_(true); // From a run that was not read out to the end.
+  launch_child_threads_ = parallel_child_polling_;
   for (size_t idx = 0; idx < generator_active_list_.size(); ++idx) {
     generator_active_list_[idx] = true;
   }
@@ -68,6 +103,8 @@ void artdaq::CompositeDriver::pause()
 
 void artdaq::CompositeDriver::resume()
 {
+  joinChildThreads_(true);
+  launch_child_threads_ = parallel_child_polling_;
   for (size_t idx = 0; idx < generator_active_list_.size(); ++idx) {
     generator_active_list_[idx] = true;
   }
@@ -89,17 +126,132 @@ std::vector<artdaq::Fragment::fragment_id_t> artdaq::CompositeDriver::fragmentID
 
 bool artdaq::CompositeDriver::getNext_(artdaq::FragmentPtrs& frags)
 {
+  if (parallel_child_polling_) {return getNextParallel_(frags);}
+
   bool anyGeneratorIsActive = false;
   for (size_t idx = 0; idx < generator_list_.size(); ++idx) {
     if (generator_active_list_[idx]) {
       bool status = generator_list_[idx]->getNext(frags);
       generator_active_list_[idx] = status;
       if (status) {anyGeneratorIsActive = true;}
+      else {checkChild_(idx);}
     }
   }
   return anyGeneratorIsActive;
 }
 
+bool artdaq::CompositeDriver::getNextParallel_(artdaq::FragmentPtrs& frags)
+{
+  if (launch_child_threads_) {
+    launch_child_threads_ = false;
+    abandon_children_ = false;
+    polling_child_count_ = generator_list_.size();
+    child_errors_.assign(generator_list_.size(), std::exception_ptr());
+    child_failed_ = false;
+    for (size_t idx = 0; idx < generator_list_.size(); ++idx) {
+      child_threads_.emplace_back(&CompositeDriver::pollChild_, this, idx);
+    }
+  }
+
+  std::unique_lock<std::mutex> lk(queue_mutex_);
+  queue_cond_.wait_for(lk, CHILD_WAIT, [this] () {
+      return ! queued_fragments_.empty() || polling_child_count_ == 0 ||
+        child_failed_;
+    });
+  if (child_failed_) {
+    // Stop the others at their next Fragments, and pass on the first
+    // error; what is queued goes with them.
+    lk.unlock();
+    joinChildThreads_(true);
+    for (auto const & error : child_errors_) {
+      if (error) {std::rethrow_exception(error);}
+    }
+  }
+  bool anyGeneratorIsActive = polling_child_count_ > 0;
+  bool gotFragments = ! queued_fragments_.empty();
+  frags.splice(frags.end(), queued_fragments_);
+  lk.unlock();
+  queue_cond_.notify_all(); // There is room in the queue again.
+
+  // Returning no Fragments is fine while the children are still running.
+  if (anyGeneratorIsActive || gotFragments) {return true;}
+  joinChildThreads_(false);
+  return false;
+}
+
+void artdaq::CompositeDriver::pollChild_(size_t idx)
+{
+  // Nothing may escape the thread, or the process is terminated.
+  std::exception_ptr error;
+  try {
+    bool active = true;
+    auto idle_wait = IDLE_CHILD_WAIT_MIN;
+    while (active) {
+      artdaq::FragmentPtrs childFrags;
+      active = generator_list_[idx]->getNext(childFrags);
+      if (! active) {checkChild_(idx);}
+      if (childFrags.empty()) {
+        if (! active) {break;}
+        // A child with nothing to give still stops when told to.
+        std::unique_lock<std::mutex> lk(queue_mutex_);
+        if (queue_cond_.wait_for(lk, idle_wait, [this] () {return abandon_children_;})) {
+          break;
+        }
+        idle_wait = std::min(idle_wait * 2, IDLE_CHILD_WAIT_MAX);
+        continue;
+      }
+      idle_wait = IDLE_CHILD_WAIT_MIN;
+
+      std::unique_lock<std::mutex> lk(queue_mutex_);
+      queue_cond_.wait(lk, [this] () {
+          return queued_fragments_.size() < max_queued_fragments_ || abandon_children_;
+        });
+      if (abandon_children_) {break;}
+      queued_fragments_.splice(queued_fragments_.end(), childFrags);
+      lk.unlock();
+      queue_cond_.notify_all();
+    }
+  }
+  catch (...) {
+    error = std::current_exception();
+  }
+
+  std::unique_lock<std::mutex> lk(queue_mutex_);
+  --polling_child_count_;
+  if (error) {
+    child_errors_[idx] = error;
+    child_failed_ = true;
+  }
+  lk.unlock();
+  queue_cond_.notify_all();
+}
+
+void artdaq::CompositeDriver::checkChild_(size_t idx)
+{
+  // getNext() catches what getNext_() throws, and says so only here.
+  if (generator_list_[idx]->ReportCmd() == "exception") {
+    throw cet::exception("CompositeDriver")
+      << "The child generator at index " << idx
+      << " stopped with an exception.";
+  }
+}
+
+void artdaq::CompositeDriver::joinChildThreads_(bool abandon)
+{
+  if (abandon) {
+    std::unique_lock<std::mutex> lk(queue_mutex_);
+    abandon_children_ = true;
+    lk.unlock();
+    queue_cond_.notify_all();
+  }
+  for (auto& thread : child_threads_) {
+    thread.join();
+  }
+  child_threads_.clear();
+  std::unique_lock<std::mutex> lk(queue_mutex_);
+  queued_fragments_.clear();
+}
+
 bool artdaq::CompositeDriver::makeChildGenerator_(fhicl::ParameterSet const &pset)
 {
   // pull out the relevant parts of the ParameterSet
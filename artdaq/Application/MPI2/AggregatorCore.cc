@@ -30,7 +30,8 @@ const std::string artdaq::AggregatorCore::FILE_CHECK_TIME_STAT_KEY("AggregatorCo
 artdaq::AggregatorCore::AggregatorCore(int mpi_rank, MPI_Comm local_group_comm, std::string name) :
   mpi_rank_(mpi_rank), local_group_comm_(local_group_comm), name_(name),
   art_initialized_(false),
-  data_sender_count_(0), event_queue_(artdaq::getGlobalQueue(10)),
+  data_sender_count_(0), numa_memory_report_(),
+  event_queue_(artdaq::getGlobalQueue(10)),
   stop_requested_(false), local_pause_requested_(false),
   processing_fragments_(false),
   system_pause_requested_(false), previous_run_duration_(-1.0),
@@ -226,6 +227,12 @@ bool artdaq::AggregatorCore::initialize(fhicl::ParameterSet const& pset)
   double event_queue_wait_time = agg_pset.get<double>("event_queue_wait_time", 5.0);
   size_t event_queue_check_count = agg_pset.get<size_t>("event_queue_check_count", 5000);
   print_event_store_stats_ = agg_pset.get<bool>("print_event_store_stats", false);
+  // Where to run the receive and art threads, and which NUMA node the
+  // buffers come from (see NumaPlacement.hh).
+  fhicl::ParameterSet numa_pset =
+    agg_pset.get<fhicl::ParameterSet>("numa", fhicl::ParameterSet());
+  numa_placement_ = artdaq::NumaPlacement(numa_pset);
+  numa_memory_report_ = artdaq::NumaMemoryReport(numa_pset);
 
   inrun_recv_timeout_usec_=agg_pset.get<size_t>("inrun_recv_timeout_usec",    100000);
   endrun_recv_timeout_usec_=agg_pset.get<size_t>("endrun_recv_timeout_usec",20000000);
@@ -242,6 +249,8 @@ bool artdaq::AggregatorCore::initialize(fhicl::ParameterSet const& pset)
     if (is_online_monitor_) {
       desired_events_per_bunch = 1;
     }
+    // The art thread is started here, and takes our placement.
+    artdaq::ScopedThreadPlacement art_placement(numa_placement_, "art");
     event_store_ptr_.reset(new artdaq::EventStore(desired_events_per_bunch, 1,
                                                   mpi_rank_, init_string_,
                                                   reader, event_queue_depth, 
@@ -270,6 +279,7 @@ bool artdaq::AggregatorCore::initialize(fhicl::ParameterSet const& pset)
     EVENT_STORE_WAIT_METRIC_NAME_ = "Data Logger Avg art Queue Wait Time";
     SHM_COPY_TIME_METRIC_NAME_ = "Data Logger Avg Shared Memory Copy Time";
     FILE_CHECK_TIME_METRIC_NAME_ = "Data Logger Average File Check Time";
+    NUMA_MEMORY_METRIC_NAME_ = "Data Logger Memory on NUMA Node ";
   }
   else {
     EVENT_RATE_METRIC_NAME_ = "Online Monitor Event Rate";
@@ -279,6 +289,7 @@ bool artdaq::AggregatorCore::initialize(fhicl::ParameterSet const& pset)
     EVENT_STORE_WAIT_METRIC_NAME_ = "Online Monitor Avg art Queue Wait Time";
     SHM_COPY_TIME_METRIC_NAME_ = "Online Monitor Avg Shared Memory Copy Time";
     FILE_CHECK_TIME_METRIC_NAME_ = "Online Monitor Average File Check Time";
+    NUMA_MEMORY_METRIC_NAME_ = "Online Monitor Memory on NUMA Node ";
   }
 
   return true;
@@ -390,6 +401,8 @@ size_t artdaq::AggregatorCore::process_fragments()
   bool eodWasCopied = false;
   bool esrWasCopied = false;
 
+  // Before creating the receiver, so that its buffers are placed too.
+  numa_placement_.apply("receive");
   if (is_data_logger_) {
     receiver_ptr_.reset(new artdaq::RHandles(mpi_buffer_count_,
                                              max_fragment_size_words_,
@@ -1030,6 +1043,15 @@ void artdaq::AggregatorCore::sendMetrics_()
                           (mqPtr->recentValueSum() / eventCount),
                           "seconds/event", 4);
   }
+
+  if (numa_memory_report_.due()) {
+    std::vector<size_t> bytes = artdaq::memoryPerNumaNode();
+    for (size_t node = 0; node < bytes.size(); ++node) {
+      metricMan_.sendMetric(NUMA_MEMORY_METRIC_NAME_ +
+                            boost::lexical_cast<std::string>(node),
+                            bytes[node] / 1024.0 / 1024.0, "MB", 3);
+    }
+  }
 }
 
 void artdaq::AggregatorCore::attachToSharedMemory_(bool initialize)
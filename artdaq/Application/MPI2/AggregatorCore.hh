@@ -12,6 +12,7 @@
 #include "artdaq/DAQrate/RHandles.hh"
 #include "artdaq-core/Core/GlobalQueue.hh"
 #include "artdaq/DAQrate/EventStore.hh"
+#include "artdaq/DAQrate/NumaPlacement.hh"
 #include "artdaq/Application/MPI2/StatisticsHelper.hh"
 #include "artdaq/DAQrate/MetricManager.hh"
 
@@ -63,6 +64,8 @@ private:
   size_t data_sender_count_;
   size_t expected_events_per_bunch_;
   bool print_event_store_stats_;
+  artdaq::NumaPlacement numa_placement_;
+  artdaq::NumaMemoryReport numa_memory_report_;
   size_t inrun_recv_timeout_usec_;
   size_t endrun_recv_timeout_usec_;
   size_t pause_recv_timeout_usec_;
@@ -106,6 +109,7 @@ private:
   std::string EVENT_STORE_WAIT_METRIC_NAME_;
   std::string SHM_COPY_TIME_METRIC_NAME_;
   std::string FILE_CHECK_TIME_METRIC_NAME_;
+  std::string NUMA_MEMORY_METRIC_NAME_;
 
   // *** Shared memory declarations ***
   struct ShmStruct {
@@ -5,9 +5,13 @@
 #include "art/Utilities/Exception.h"
 #include "cetlib/exception.h"
 #include "messagefacility/MessageLogger/MessageLogger.h"
+#include "boost/lexical_cast.hpp"
 #include <pthread.h>
 #include <sched.h>
 #include <algorithm>
+#include <chrono>
+#include <future>
+#include <thread>
 #include "tracelib.h"
 
 const std::string artdaq::BoardReaderCore::
@@ -18,12 +22,14 @@ const std::string artdaq::BoardReaderCore::
   OUTPUT_WAIT_STAT_KEY("BoardReaderCoreOutputWaitTime");
 const std::string artdaq::BoardReaderCore::
   FRAGMENTS_PER_READ_STAT_KEY("BoardReaderCoreFragmentsPerRead");
+const size_t artdaq::BoardReaderCore::SEND_QUEUE_WAIT_USEC = 100000;
 
 /**
  * Default constructor.
  */
 artdaq::BoardReaderCore::BoardReaderCore(MPI_Comm local_group_comm, std::string name) :
   local_group_comm_(local_group_comm), generator_ptr_(nullptr), name_(name),
+  numa_memory_report_(), send_queue_depth_(0), send_failed_(false),
   stop_requested_(false), pause_requested_(false)
 {
   mf::LogDebug(name_) << "Constructor";
@@ -128,6 +134,12 @@ bool artdaq::BoardReaderCore::initialize(fhicl::ParameterSet const& pset, uint64
     generator_ptr_->metricsReportingInstanceName() + " Avg Output Wait Time";
   FRAGMENTS_PER_READ_METRIC_NAME_ =
     generator_ptr_->metricsReportingInstanceName() + " Avg Frags Per Read";
+  SEND_SLOT_WAIT_METRIC_NAME_ =
+    generator_ptr_->metricsReportingInstanceName() + " Send Slot Wait Time to Rank ";
+  NUMA_MEMORY_METRIC_NAME_ =
+    generator_ptr_->metricsReportingInstanceName() + " Memory on NUMA Node ";
+  SEND_QUEUE_DEPTH_METRIC_NAME_ =
+    generator_ptr_->metricsReportingInstanceName() + " Send Queue Depth";
 
   // determine the data sending parameters
   try {
@@ -140,6 +152,23 @@ bool artdaq::BoardReaderCore::initialize(fhicl::ParameterSet const& pset, uint64
       << daq_pset.to_string() << "\".";
     return false;
   }
+  // Fragments between a BoardReader and an EventBuilder on the same node
+  // go through shared memory instead of MPI; the same setting must be
+  // given to both.
+  shared_memory_transport_ = daq_pset.get<bool>("shared_memory_transport", false);
+  // The others are put straight into the EventBuilder's memory with
+  // one-sided MPI rather than sent as messages; again set for both.
+  one_sided_transport_ = daq_pset.get<bool>("one_sided_transport", false);
+  // Stamp Fragments with their send time, and measure the BoardReaders'
+  // clock offsets with this many MPI pings at the start of each run, so
+  // the EventBuilders can report how long each took from its send to
+  // being in the EventStore; set for both.
+  clock_sync_rounds_ = daq_pset.get<bool>("measure_latency", false) ?
+    daq_pset.get<size_t>("clock_sync_rounds", 10) : 0;
+  // Send over two-sided MPI only with credit granted by the EventBuilder
+  // (see RHandles::useCredits), which holds the BoardReaders back as soon
+  // as it falls behind; set for both.
+  credit_flow_control_ = daq_pset.get<bool>("credit_flow_control", false);
   try {mpi_buffer_count_ = fr_pset.get<size_t>("mpi_buffer_count");}
   catch (...) {
     mf::LogError(name_)
@@ -165,7 +194,51 @@ bool artdaq::BoardReaderCore::initialize(fhicl::ParameterSet const& pset, uint64
     return false;
   }
   rt_priority_ = fr_pset.get<int>("rt_priority", 0);
+  // Where to run the readout and send threads, and which NUMA node their
+  // Fragments and send buffers come from (see NumaPlacement.hh).
+  fhicl::ParameterSet numa_pset =
+    fr_pset.get<fhicl::ParameterSet>("numa", fhicl::ParameterSet());
+  numa_placement_ = artdaq::NumaPlacement(numa_pset);
+  numa_memory_report_ = artdaq::NumaMemoryReport(numa_pset);
   synchronous_sends_ = fr_pset.get<bool>("synchronous_sends", true);
+  batch_sends_ = fr_pset.get<bool>("batch_sends", false);
+  routing_pset_ = fr_pset.get<fhicl::ParameterSet>("routing_policy",
+                                                   fhicl::ParameterSet());
+  send_slot_spin_rounds_ = fr_pset.get<size_t>("send_slot_spin_rounds", 0);
+  // Send with persistent requests (see SHandles.hh); best for small
+  // Fragments of steady size.
+  persistent_requests_ = fr_pset.get<bool>("persistent_requests", false);
+  // Send from a thread of its own, fed by a queue of at most this many
+  // Fragments, so that reading out the hardware overlaps the transfers
+  // instead of waiting for them; 0 sends from the readout thread.
+  send_queue_depth_ = fr_pset.get<size_t>("send_queue_depth", 0);
+  // "host:port" of each EventBuilder, in rank order, to send over TCP
+  // instead of MPI; the EventBuilders must then have a tcp_port.
+  tcp_destinations_ = fr_pset.get<std::vector<std::string>>("tcp_destinations",
+                                                            std::vector<std::string>());
+  if (! tcp_destinations_.empty() && tcp_destinations_.size() != evb_count_) {
+    mf::LogError(name_)
+      << "The tcp_destinations parameter lists " << tcp_destinations_.size()
+      << " endpoints but there are " << evb_count_ << " EventBuilders.";
+    return false;
+  }
+
+  // check the routing policy configuration now, rather than at the start
+  // of data taking. With the token policy this is collective over all
+  // the BoardReaders, which must all use it with the same table_size;
+  // the one of rank 0 among them is the routing master, which the others
+  // wait for when they are more than a lease ahead of it (see
+  // RoutingPolicy.hh).
+  try {
+    artdaq::makeRoutingPolicy(routing_pset_, evb_count_, first_evb_rank_,
+                              local_group_comm_);
+  }
+  catch (cet::exception& excpt) {
+    mf::LogError(name_)
+      << "Invalid routing_policy parameters \"" << routing_pset_.to_string()
+      << "\", exception = " << excpt;
+    return false;
+  }
 
   // fetch the monitoring parameters and create the MonitoredQuantity instances
   statsHelper_.createCollectors(fr_pset, 100, 30.0, 60.0, FRAGMENTS_PROCESSED_STAT_KEY);
@@ -275,73 +348,117 @@ size_t artdaq::BoardReaderCore::process_fragments()
 #pragma GCC diagnostic pop
   }
 
-  sender_ptr_.reset(new artdaq::SHandles(mpi_buffer_count_,
-                                         max_fragment_size_words_,
-                                         evb_count_,
-                                         first_evb_rank_,
-                                         false,
-                                         synchronous_sends_));
-
-  MPI_Barrier(local_group_comm_);
+  numa_placement_.apply("readout");
+  fragment_send_error_ = nullptr;
+  std::thread sender_thread;
+  if (send_queue_depth_ > 0) {
+    // Readout carries on while the sender thread, which does all the MPI
+    // work from here on, waits for the network.
+    send_queue_.reset(new artdaq::detail::SPSCQueue<artdaq::FragmentPtr>(send_queue_depth_));
+    send_failed_.store(false);
+    std::promise<void> sender_ready;
+    std::future<void> ready = sender_ready.get_future();
+    sender_thread = std::thread([this, &sender_ready] () { sendQueued_(sender_ready); });
+    ready.wait();
+    if (send_failed_.load()) {
+      sender_thread.join();
+      send_queue_.reset();
+      std::rethrow_exception(fragment_send_error_);
+    }
+  }
+  else {
+    createSender_();
+  }
 
   mf::LogDebug(name_) << "Waiting for first fragment.";
   artdaq::MonitoredQuantity::TIME_POINT_T startTime;
   double delta_time;
   artdaq::FragmentPtrs frags;
   bool active = true;
-  while (active) {
-    startTime = artdaq::MonitoredQuantity::getCurrentTime();
-
-    active = generator_ptr_->getNext(frags);
-
-    delta_time=artdaq::MonitoredQuantity::getCurrentTime() - startTime;
-    statsHelper_.addSample(INPUT_WAIT_STAT_KEY,delta_time);
-    metricMan_.sendMetric(INPUT_WAIT_STAT_KEY,delta_time,"seconds",5);
-    
-    TRACE( 16, "%s::process_fragments INPUT_WAIT=%f", name_.c_str(), delta_time );
-
-    if (! active) {break;}
-    statsHelper_.addSample(FRAGMENTS_PER_READ_STAT_KEY, frags.size());
-
-    startTime = artdaq::MonitoredQuantity::getCurrentTime();
-    for (auto & fragPtr : frags) {
-      artdaq::Fragment::sequence_id_t sequence_id = fragPtr->sequenceID();
-      statsHelper_.addSample(FRAGMENTS_PROCESSED_STAT_KEY, fragPtr->size());
-
-      if ((fragment_count_ % 250) == 0) {
-        mf::LogDebug(name_)
-          << "Sending fragment " << fragment_count_
-          << " with sequence id " << sequence_id << ".";
-      }
-
-      // check for continous sequence IDs
-      if (! skip_seqId_test_ && abs(sequence_id-prev_seq_id_) > 1) {
-        mf::LogWarning(name_)
-          << "Missing sequence IDs: current sequence ID = "
-          << sequence_id << ", previous sequence ID = "
-          << prev_seq_id_ << ".";
-      }
-      prev_seq_id_ = sequence_id;
-
-      TRACE( 17, "%s::process_fragments seq=%lu sendFragment start", name_.c_str(), sequence_id );
-      sender_ptr_->sendFragment(std::move(*fragPtr));
-      TRACE( 17, "%s::process_fragments seq=%lu sendFragment done", name_.c_str(), sequence_id );
-      ++fragment_count_;
-      bool readyToReport = statsHelper_.readyToReport(fragment_count_);
-      if (readyToReport) {
-        std::string statString = buildStatisticsString_();
-        mf::LogDebug(name_) << statString;
+  try {
+    while (active) {
+      startTime = artdaq::MonitoredQuantity::getCurrentTime();
+
+      active = generator_ptr_->getNext(frags);
+
+      delta_time=artdaq::MonitoredQuantity::getCurrentTime() - startTime;
+      statsHelper_.addSample(INPUT_WAIT_STAT_KEY,delta_time);
+      // MetricManager is not thread-safe: with a send thread, that sends
+      // all the metrics, this wait among them as an average.
+      if (! send_queue_) {metricMan_.sendMetric(INPUT_WAIT_STAT_KEY,delta_time,"seconds",5);}
+
+      TRACE( 16, "%s::process_fragments INPUT_WAIT=%f", name_.c_str(), delta_time );
+
+      if (! active) {break;}
+      statsHelper_.addSample(FRAGMENTS_PER_READ_STAT_KEY, frags.size());
+
+      startTime = artdaq::MonitoredQuantity::getCurrentTime();
+      for (auto & fragPtr : frags) {
+        artdaq::Fragment::sequence_id_t sequence_id = fragPtr->sequenceID();
+        statsHelper_.addSample(FRAGMENTS_PROCESSED_STAT_KEY, fragPtr->size());
+
+        if ((fragment_count_ % 250) == 0) {
+          mf::LogDebug(name_)
+            << "Sending fragment " << fragment_count_
+            << " with sequence id " << sequence_id << ".";
+        }
+        // check for continous sequence IDs
+        if (! skip_seqId_test_ && abs(sequence_id-prev_seq_id_) > 1) {
+          mf::LogWarning(name_)
+            << "Missing sequence IDs: current sequence ID = "
+            << sequence_id << ", previous sequence ID = "
+            << prev_seq_id_ << ".";
+        }
+        prev_seq_id_ = sequence_id;
+        if (send_queue_) {
+          if (! queueForSend_(std::move(fragPtr))) {
+            active = false; // The sender thread has failed.
+            break;
+          }
+        }
+        else if (! batch_sends_) {
+          TRACE( 17, "%s::process_fragments seq=%lu sendFragment start", name_.c_str(), sequence_id );
+          sender_ptr_->sendFragment(std::move(*fragPtr));
+          TRACE( 17, "%s::process_fragments seq=%lu sendFragment done", name_.c_str(), sequence_id );
+        }
+        ++fragment_count_;
+        bool readyToReport = statsHelper_.readyToReport(fragment_count_);
+        if (readyToReport) {
+          std::string statString = buildStatisticsString_();
+          mf::LogDebug(name_) << statString;
+        }
+        if (fragment_count_ == 1 || readyToReport) {
+          mf::LogDebug(name_)
+            << "Sending fragment " << fragment_count_
+            << " with sequence id " << sequence_id << ".";
+        }
       }
-      if (fragment_count_ == 1 || readyToReport) {
-        mf::LogDebug(name_)
-          << "Sending fragment " << fragment_count_
-          << " with sequence id " << sequence_id << ".";
+      if (batch_sends_ && ! send_queue_) {
+        TRACE( 17, "%s::process_fragments sendFragments start nFrags=%lu", name_.c_str(), frags.size() );
+        sender_ptr_->sendFragments(std::move(frags));
+        TRACE( 17, "%s::process_fragments sendFragments done", name_.c_str() );
       }
+      // With a sender thread, that reports the metrics instead.
+      if (! send_queue_ && statsHelper_.statsRollingWindowHasMoved()) {sendMetrics_();}
+      statsHelper_.addSample(OUTPUT_WAIT_STAT_KEY,
+                             artdaq::MonitoredQuantity::getCurrentTime() - startTime);
+      frags.clear();
     }
-    if (statsHelper_.statsRollingWindowHasMoved()) {sendMetrics_();}
-    statsHelper_.addSample(OUTPUT_WAIT_STAT_KEY,
-                           artdaq::MonitoredQuantity::getCurrentTime() - startTime);
-    frags.clear();
+  }
+  catch (...) {
+    if (sender_thread.joinable()) {
+      queueForSend_(artdaq::FragmentPtr()); // Let the sender finish.
+      sender_thread.join();
+    }
+    throw;
+  }
+  if (sender_thread.joinable()) {
+    // An empty pointer tells the sender thread that the readout is over;
+    // it sends what is queued ahead of it and the EOD Fragments.
+    queueForSend_(artdaq::FragmentPtr());
+    sender_thread.join();
+    send_queue_.reset();
+    if (fragment_send_error_) {std::rethrow_exception(fragment_send_error_);}
   }
 
   // 07-Feb-2013, KAB
@@ -358,6 +475,115 @@ size_t artdaq::BoardReaderCore::process_fragments()
   return fragment_count_;
 }
 
+void artdaq::BoardReaderCore::createSender_()
+{
+  sender_ptr_.reset(new artdaq::SHandles(mpi_buffer_count_,
+                                         max_fragment_size_words_,
+                                         evb_count_,
+                                         first_evb_rank_,
+                                         false,
+                                         synchronous_sends_,
+                                         shared_memory_transport_,
+                                         persistent_requests_));
+  sender_ptr_->setRoutingPolicy(artdaq::makeRoutingPolicy(routing_pset_,
+                                                         evb_count_,
+                                                         first_evb_rank_,
+                                                         local_group_comm_));
+  // The EventBuilders taking part until the next pause or stop; the
+  // others' share of events goes to these.
+  std::vector<bool> active_evbs = artdaq::receiveMembership(evb_count_, first_evb_rank_);
+  size_t active_evb_count = std::count(active_evbs.begin(), active_evbs.end(), true);
+  if (active_evb_count != evb_count_) {
+    mf::LogInfo(name_)
+      << "Sending to " << active_evb_count << " of " << evb_count_
+      << " EventBuilders.";
+  }
+  sender_ptr_->setActiveDestinations(active_evbs);
+  sender_ptr_->setSpinRounds(send_slot_spin_rounds_);
+  if (one_sided_transport_) {
+    sender_ptr_->useOneSided(local_group_comm_);
+  }
+  if (! tcp_destinations_.empty()) {
+    // The EventBuilders know their sources by world rank.
+    int world_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    sender_ptr_->useTCP(world_rank, tcp_destinations_);
+  }
+  if (clock_sync_rounds_ > 0) {
+    sender_ptr_->enableLatencyStamps(clock_sync_rounds_);
+  }
+  if (credit_flow_control_) {
+    sender_ptr_->useCredits();
+  }
+  reported_slot_wait_.assign(evb_count_, 0.0);
+
+  MPI_Barrier(local_group_comm_);
+}
+
+bool artdaq::BoardReaderCore::queueForSend_(artdaq::FragmentPtr && frag)
+{
+  // The sender may have fallen behind: wait for it to make room, looking
+  // up now and then in case it has failed instead.
+  while (! send_queue_->push(std::move(frag),
+                             std::chrono::microseconds(SEND_QUEUE_WAIT_USEC))) {
+    if (send_failed_.load()) {return false;}
+  }
+  return true;
+}
+
+void artdaq::BoardReaderCore::sendQueued_(std::promise<void> & ready)
+{
+  try {
+    numa_placement_.apply("send");
+    createSender_();
+  }
+  catch (...) {
+    fragment_send_error_ = std::current_exception();
+    send_failed_.store(true);
+    ready.set_value();
+    return;
+  }
+  ready.set_value();
+
+  try {
+    artdaq::FragmentPtr frag;
+    artdaq::FragmentPtrs batch;
+    bool more = true;
+    while (more) {
+      // The readout always ends the queue with an empty pointer, so
+      // there is nothing else to look out for while waiting.
+      if (! send_queue_->pop(frag, std::chrono::microseconds(SEND_QUEUE_WAIT_USEC))) {
+        continue;
+      }
+      if (! frag) {break;} // The readout is over.
+      if (batch_sends_) {
+        // Everything waiting goes in one batch.
+        batch.push_back(std::move(frag));
+        while (send_queue_->pop(frag)) {
+          if (! frag) {
+            more = false;
+            break;
+          }
+          batch.push_back(std::move(frag));
+        }
+        TRACE( 17, "%s::sendQueued_ sendFragments start nFrags=%lu", name_.c_str(), batch.size() );
+        sender_ptr_->sendFragments(std::move(batch));
+        batch.clear();
+      }
+      else {
+        TRACE( 17, "%s::sendQueued_ seq=%lu sendFragment start", name_.c_str(), frag->sequenceID() );
+        sender_ptr_->sendFragment(std::move(*frag));
+      }
+      if (statsHelper_.statsRollingWindowHasMoved()) {sendMetrics_();}
+    }
+    sender_ptr_.reset(nullptr); // Sends the EOD Fragments.
+  }
+  catch (...) {
+    fragment_send_error_ = std::current_exception();
+    send_failed_.store(true);
+  }
+}
+
 std::string artdaq::BoardReaderCore::report(std::string const&) const
 {
   return generator_ptr_->ReportCmd();
@@ -477,4 +703,33 @@ void artdaq::BoardReaderCore::sendMetrics_()
     metricMan_.sendMetric(FRAGMENTS_PER_READ_METRIC_NAME_,
                           mqPtr->recentValueAverage(), "fragments/read", 4);
   }
+
+  // Time spent waiting for a free send slot since the last report, per
+  // EventBuilder, to show which EventBuilder is applying back-pressure.
+  if (sender_ptr_.get() != 0) {
+    for (size_t idx = 0; idx < evb_count_; ++idx) {
+      size_t rank = first_evb_rank_ + idx;
+      double total = sender_ptr_->slotWaitTime(rank);
+      metricMan_.sendMetric(SEND_SLOT_WAIT_METRIC_NAME_ +
+                            boost::lexical_cast<std::string>(rank),
+                            total - reported_slot_wait_[idx], "seconds", 3);
+      reported_slot_wait_[idx] = total;
+    }
+  }
+
+  // Fragments read out but not yet sent; a queue that stays full means
+  // the network, not the hardware, is setting the pace.
+  if (send_queue_.get() != 0) {
+    metricMan_.sendMetric(SEND_QUEUE_DEPTH_METRIC_NAME_,
+                          send_queue_->size(), "fragments", 3);
+  }
+
+  if (numa_memory_report_.due()) {
+    std::vector<size_t> bytes = artdaq::memoryPerNumaNode();
+    for (size_t node = 0; node < bytes.size(); ++node) {
+      metricMan_.sendMetric(NUMA_MEMORY_METRIC_NAME_ +
+                            boost::lexical_cast<std::string>(node),
+                            bytes[node] / 1024.0 / 1024.0, "MB", 3);
+    }
+  }
 }
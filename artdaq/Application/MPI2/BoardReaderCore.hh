@@ -1,6 +1,8 @@
 #ifndef artdaq_Application_MPI2_BoardReaderCore_hh
 #define artdaq_Application_MPI2_BoardReaderCore_hh
 
+#include <exception>
+#include <future>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -10,6 +12,8 @@
 #include "art/Persistency/Provenance/RunID.h"
 #include "artdaq/DAQrate/quiet_mpi.hh"
 #include "artdaq/DAQrate/SHandles.hh"
+#include "artdaq/DAQrate/NumaPlacement.hh"
+#include "artdaq/DAQrate/detail/SPSCQueue.hh"
 #include "artdaq/Application/MPI2/StatisticsHelper.hh"
 #include "artdaq/DAQrate/MetricManager.hh"
 
@@ -56,11 +60,42 @@ private:
   size_t first_evb_rank_;
   size_t evb_count_;
   int rt_priority_;
+  artdaq::NumaPlacement numa_placement_;
+  artdaq::NumaMemoryReport numa_memory_report_;
   bool skip_seqId_test_;
   bool synchronous_sends_;
+  bool shared_memory_transport_;
+  bool one_sided_transport_;
+  size_t clock_sync_rounds_; // Zero unless measuring latency.
+  bool credit_flow_control_;
+  std::vector<std::string> tcp_destinations_;
+  bool batch_sends_;
+  fhicl::ParameterSet routing_pset_;
+  size_t send_slot_spin_rounds_;
+  bool persistent_requests_;
+  size_t send_queue_depth_; // Zero unless sending from a thread of its own.
 
   std::unique_ptr<artdaq::SHandles> sender_ptr_;
 
+  // Create the SHandles for this run and wait for the EventBuilders.
+  void createSender_();
+
+  // With a send thread: the Fragments for it to send, and what went
+  // wrong there, if anything, for process_fragments() to rethrow.
+  static const size_t SEND_QUEUE_WAIT_USEC;
+  std::unique_ptr<artdaq::detail::SPSCQueue<artdaq::FragmentPtr>> send_queue_;
+  std::exception_ptr fragment_send_error_;
+  std::atomic<bool> send_failed_;
+
+  // Hand a Fragment, or an empty pointer for the end of the run, to the
+  // send thread, waiting while its queue is full; false if it has failed.
+  bool queueForSend_(artdaq::FragmentPtr && frag);
+
+  // The send thread: creates the SHandles, signals ready, then sends
+  // what is queued until the end of the run. It alone makes MPI calls
+  // and sends metrics while it runs.
+  void sendQueued_(std::promise<void> & ready);
+
   size_t fragment_count_;
   artdaq::Fragment::sequence_id_t prev_seq_id_;
   std::atomic<bool> stop_requested_;
@@ -78,6 +113,10 @@ private:
   std::string INPUT_WAIT_METRIC_NAME_;
   std::string OUTPUT_WAIT_METRIC_NAME_;
   std::string FRAGMENTS_PER_READ_METRIC_NAME_;
+  std::string SEND_SLOT_WAIT_METRIC_NAME_;
+  std::string NUMA_MEMORY_METRIC_NAME_;
+  std::string SEND_QUEUE_DEPTH_METRIC_NAME_;
+  std::vector<double> reported_slot_wait_;
 };
 
 #endif /* artdaq_Application_MPI2_BoardReaderCore_hh */
@@ -19,7 +19,13 @@ int main(int argc, char *argv[])
   artdaq::configureMessageFacility("boardreader");
 
   // initialization
-  int const wanted_threading_level { MPI_THREAD_FUNNELED };
+  // MPI is called from more than one thread, though never from two at
+  // once: this one sets it up and tears it down; in between, each run's
+  // process_fragments() thread creates the SHandles and sends, or with
+  // send_queue_depth, hands both to its send thread and makes no MPI
+  // calls itself until that has been joined. The command thread makes
+  // none. MPISentry checks the level provided.
+  int const wanted_threading_level { MPI_THREAD_SERIALIZED };
 
   MPI_Comm local_group_comm;
   std::unique_ptr<artdaq::MPISentry> mpiSentry;
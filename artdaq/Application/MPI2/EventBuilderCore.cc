@@ -1,11 +1,15 @@
 #include "artdaq/Application/MPI2/EventBuilderCore.hh"
 #include "art/Utilities/Exception.h"
 #include "messagefacility/MessageLogger/MessageLogger.h"
+#include "artdaq/DAQrate/ClockOffset.hh"
 #include "artdaq/DAQrate/EventStore.hh"
+#include "artdaq/DAQrate/RoutingPolicy.hh"
 #include "art/Framework/Art/artapp.h"
 #include "artdaq-core/Core/SimpleQueueReader.hh"
 #include "artdaq/DAQdata/NetMonHeader.hh"
 
+#include <unistd.h>
+
 const std::string artdaq::EventBuilderCore::INPUT_FRAGMENTS_STAT_KEY("EventBuilderCoreInputFragments");
 const std::string artdaq::EventBuilderCore::INPUT_WAIT_STAT_KEY("EventBuilderCoreInputWaitTime");
 const std::string artdaq::EventBuilderCore::STORE_EVENT_WAIT_STAT_KEY("EventBuilderCoreStoreEventWaitTime");
@@ -15,7 +19,7 @@ const std::string artdaq::EventBuilderCore::STORE_EVENT_WAIT_STAT_KEY("EventBuil
  */
 artdaq::EventBuilderCore::EventBuilderCore(int mpi_rank, MPI_Comm local_group_comm, std::string name) :
   mpi_rank_(mpi_rank), local_group_comm_(local_group_comm), name_(name),
-  data_sender_count_(0), art_initialized_(false),
+  data_sender_count_(0), numa_memory_report_(), art_initialized_(false),
   stop_requested_(false), pause_requested_(false), run_is_paused_(false)
 {
   mf::LogDebug(name_) << "Constructor";
@@ -34,25 +38,32 @@ artdaq::EventBuilderCore::~EventBuilderCore()
 
 void artdaq::EventBuilderCore::initializeEventStore(size_t depth, double wait_time, size_t check_count)
 {
-  if (use_art_) {
-    artdaq::EventStore::ART_CFGSTRING_FCN * reader = &artapp_string_config;
-    event_store_ptr_.reset(new artdaq::EventStore(expected_fragments_per_event_, 1,
-						  mpi_rank_, init_string_,
-						  reader, depth, wait_time, check_count,
-                                                  print_event_store_stats_));
-    art_initialized_ = true;
-  }
-  else {
+  // The art (reader) thread and the assembly workers are started here, and
+  // take the placement of this thread at the time.
+  {
+    artdaq::ScopedThreadPlacement art_placement(numa_placement_, "art");
+    if (use_art_) {
+      artdaq::EventStore::ART_CFGSTRING_FCN * reader = &artapp_string_config;
+      event_store_ptr_.reset(new artdaq::EventStore(expected_fragments_per_event_, 1,
+                                                    mpi_rank_, init_string_,
+                                                    reader, depth, wait_time, check_count,
+                                                    print_event_store_stats_));
+      art_initialized_ = true;
+    }
+    else {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wwrite-strings"
-    char * dummyArgs[1] { "SimpleQueueReader" };
+      char * dummyArgs[1] { "SimpleQueueReader" };
 #pragma GCC diagnostic pop
-    artdaq::EventStore::ART_CMDLINE_FCN * reader = &artdaq::simpleQueueReaderApp;
-    event_store_ptr_.reset(new artdaq::EventStore(expected_fragments_per_event_, 1,
-						  mpi_rank_, 1, dummyArgs,
-						  reader, depth, wait_time, check_count,
-                                                  print_event_store_stats_));
+      artdaq::EventStore::ART_CMDLINE_FCN * reader = &artdaq::simpleQueueReaderApp;
+      event_store_ptr_.reset(new artdaq::EventStore(expected_fragments_per_event_, 1,
+                                                    mpi_rank_, 1, dummyArgs,
+                                                    reader, depth, wait_time, check_count,
+                                                    print_event_store_stats_));
+    }
   }
+  artdaq::ScopedThreadPlacement assembly_placement(numa_placement_, "assembly");
+  event_store_ptr_->setShardCount(event_store_shards_);
 }
 
 /**
@@ -106,6 +117,23 @@ bool artdaq::EventBuilderCore::initialize(fhicl::ParameterSet const& pset)
       << daq_pset.to_string() << "\".";
     return false;
   }
+  // Fragments between a BoardReader and an EventBuilder on the same node
+  // go through shared memory instead of MPI; the same setting must be
+  // given to both.
+  receive_options_.shared_memory = daq_pset.get<bool>("shared_memory_transport", false);
+  // The others are put straight into the EventBuilder's memory with
+  // one-sided MPI rather than sent as messages; again set for both.
+  receive_options_.one_sided = daq_pset.get<bool>("one_sided_transport", false);
+  // Stamp Fragments with their send time, and measure the BoardReaders'
+  // clock offsets with this many MPI pings at the start of each run, so
+  // the EventBuilders can report how long each took from its send to
+  // being in the EventStore; set for both.
+  receive_options_.clock_sync_rounds = daq_pset.get<bool>("measure_latency", false) ?
+    daq_pset.get<size_t>("clock_sync_rounds", 10) : 0;
+  // Send over two-sided MPI only with credit granted by the EventBuilder
+  // (see RHandles::useCredits), which holds the BoardReaders back as soon
+  // as it falls behind; set for both.
+  credit_flow_control_ = daq_pset.get<bool>("credit_flow_control", false);
   try {mpi_buffer_count_ = evb_pset.get<size_t>("mpi_buffer_count");}
   catch (...) {
     mf::LogError(name_)
@@ -153,6 +181,45 @@ bool artdaq::EventBuilderCore::initialize(fhicl::ParameterSet const& pset)
     return false;
   }
   print_event_store_stats_ = evb_pset.get<bool>("print_event_store_stats", false);
+  // With more than one shard, events are assembled by that many worker
+  // threads, leaving this receiving thread free to keep up with the network.
+  // Like the other EventStore settings, it takes effect when the store is created.
+  event_store_shards_ = evb_pset.get<size_t>("event_store_shards", 1);
+  // Where to run the receive, assembly and art threads, and which NUMA
+  // node the buffers come from (see NumaPlacement.hh); the memory on each
+  // node is reported too if asked for, at most once per interval.
+  fhicl::ParameterSet numa_pset =
+    evb_pset.get<fhicl::ParameterSet>("numa", fhicl::ParameterSet());
+  numa_placement_ = artdaq::NumaPlacement(numa_pset);
+  numa_memory_report_ = artdaq::NumaMemoryReport(numa_pset);
+  receive_options_.probe_receives = evb_pset.get<bool>("probe_receives", false);
+  // Post receives with persistent requests (see RHandles.hh); best for
+  // small Fragments.
+  receive_options_.persistent_requests = evb_pset.get<bool>("persistent_requests", false);
+  // Share the receive buffers among the BoardReaders by need, within
+  // per-source limits (see RHandles::setSourceQuotas); 0 means no maximum.
+  fair_receive_scheduling_ = evb_pset.get<bool>("fair_receive_scheduling", false);
+  mpi_min_buffers_per_source_ = evb_pset.get<size_t>("mpi_min_buffers_per_source", 1);
+  mpi_max_buffers_per_source_ = evb_pset.get<size_t>("mpi_max_buffers_per_source", 0);
+  // With credit_flow_control, the most messages each BoardReader may have
+  // in flight to us (0 for the receive buffers posted for it), and how often
+  // to check for room downstream while they are being held back.
+  mpi_credits_per_source_ = evb_pset.get<size_t>("mpi_credits_per_source", 0);
+  credit_recheck_usec_ = evb_pset.get<size_t>("credit_recheck_usec", 1000);
+  if (credit_recheck_usec_ == 0) {credit_recheck_usec_ = 1;}
+  // An inactive EventBuilder stands by, receiving nothing, while the
+  // BoardReaders route its share of events to the others. This can be
+  // changed with soft_init while paused (or between runs), taking effect
+  // at the resume (or start).
+  active_ = evb_pset.get<bool>("active", true);
+  // A non-negative tcp_port means the BoardReaders send to us over TCP
+  // (their tcp_destinations) rather than through MPI.
+  receive_options_.tcp_port = evb_pset.get<int>("tcp_port", -1);
+  // A non-negative routing_master_rank means the BoardReaders use token
+  // routing, and we advertise our free capacity to that rank.
+  routing_master_rank_ = evb_pset.get<int>("routing_master_rank", -1);
+  routing_token_interval_ = evb_pset.get<size_t>("routing_token_interval", 100);
+  if (routing_token_interval_ == 0) {routing_token_interval_ = 1;}
   inrun_recv_timeout_usec_=evb_pset.get<size_t>("inrun_recv_timeout_usec",    100000);
   endrun_recv_timeout_usec_=evb_pset.get<size_t>("endrun_recv_timeout_usec",20000000);
   pause_recv_timeout_usec_=evb_pset.get<size_t>("pause_recv_timeout_usec",3000000);
@@ -194,6 +261,9 @@ bool artdaq::EventBuilderCore::initialize(fhicl::ParameterSet const& pset)
   DATA_RATE_METRIC_NAME_ = metricsReportingInstanceName + " Data Rate";
   INPUT_WAIT_METRIC_NAME_ = metricsReportingInstanceName + " Avg Input Wait Time";
   EVENT_STORE_WAIT_METRIC_NAME_ = metricsReportingInstanceName + " Avg art Queue Wait Time";
+  ART_BLOCKED_METRIC_NAME_ = metricsReportingInstanceName + " Avg art Blocked Time";
+  LATENCY_METRIC_NAME_ = metricsReportingInstanceName + " Fragment Send-to-Insert Latency";
+  NUMA_MEMORY_METRIC_NAME_ = metricsReportingInstanceName + " Memory on NUMA Node ";
 
   return true;
 }
@@ -227,6 +297,7 @@ bool artdaq::EventBuilderCore::stop()
   // exit (after the timeout), the lock will be released (in the
   // processFragments method), and this method can continue.
   stop_requested_.store(true);
+  wakeStandby_();
 
   flush_mutex_.lock();
   if (! run_is_paused_.load()) {
@@ -267,6 +338,7 @@ bool artdaq::EventBuilderCore::pause()
   logMessage_("Pausing run " + boost::lexical_cast<std::string>(run_id_.run()) +
               ", subrun " + boost::lexical_cast<std::string>(event_store_ptr_->subrunID()));
   pause_requested_.store(true);
+  wakeStandby_();
   flush_mutex_.lock();
 
   bool endSucceeded = false;
@@ -323,6 +395,15 @@ bool artdaq::EventBuilderCore::soft_initialize(fhicl::ParameterSet const& pset)
   mf::LogDebug(name_) << "soft_initialize method called with DAQ "
                                << "ParameterSet = \"" << pset.to_string()
                                << "\".";
+  fhicl::ParameterSet evb_pset =
+    pset.get<fhicl::ParameterSet>("daq", fhicl::ParameterSet()).
+    get<fhicl::ParameterSet>("event_builder", fhicl::ParameterSet());
+  bool active = evb_pset.get<bool>("active", active_);
+  if (active != active_) {
+    logMessage_(std::string(active ? "Joining" : "Leaving") +
+                " the EventBuilder pool at the next start or resume.");
+    active_ = active;
+  }
   return true;
 }
 
@@ -341,10 +422,43 @@ size_t artdaq::EventBuilderCore::process_fragments()
   std::vector<size_t> fragments_received(data_sender_count_ + first_data_sender_rank_, 0);
   std::vector<size_t> fragments_sent(data_sender_count_ + first_data_sender_rank_, 0);
 
+  // Every BoardReader learns which EventBuilders take part this time
+  // before it starts sending (see SHandles::setActiveDestinations).
+  artdaq::announceMembership(active_, data_sender_count_, first_data_sender_rank_);
+  if (! active_) {
+    MPI_Barrier(local_group_comm_);
+    logMessage_("Standing by: not receiving data until the next start or resume.");
+    {
+      std::unique_lock<std::mutex> lock(standby_mutex_);
+      standby_cv_.wait(lock, [this] {
+          return stop_requested_.load() || pause_requested_.load();
+        });
+    }
+    event_store_ptr_->flushData();
+    flush_mutex_.unlock();
+    if (stop_requested_.load()) {metricMan_.do_stop();}
+    else if (pause_requested_.load()) {metricMan_.do_pause();}
+    return 0;
+  }
+
+  // Before creating the receiver, so that its buffers are placed too.
+  numa_placement_.apply("receive");
   receiver_ptr_.reset(new artdaq::RHandles(mpi_buffer_count_,
                                            max_fragment_size_words_,
                                            data_sender_count_,
-                                           first_data_sender_rank_));
+                                           first_data_sender_rank_,
+                                           receive_options_));
+  latency_histograms_.assign(data_sender_count_, artdaq::detail::LatencyHistogram());
+  if (fair_receive_scheduling_) {
+    receiver_ptr_->setSourceQuotas(mpi_min_buffers_per_source_,
+                                   mpi_max_buffers_per_source_);
+  }
+  if (credit_flow_control_) {
+    receiver_ptr_->useCredits(mpi_credits_per_source_);
+  }
+  if (routing_master_rank_ >= 0) {
+    token_sender_.reset(new artdaq::RoutingTokenSender(routing_master_rank_));
+  }
 
   MPI_Barrier(local_group_comm_);
 
@@ -356,6 +470,18 @@ size_t artdaq::EventBuilderCore::process_fragments()
     size_t recvTimeout = inrun_recv_timeout_usec_;
     if (stop_requested_.load()) {recvTimeout = endrun_recv_timeout_usec_;}
     else if (pause_requested_.load()) {recvTimeout = pause_recv_timeout_usec_;}
+    if (credit_flow_control_) {
+      // Each free slot on the art queue takes one more Fragment from
+      // every BoardReader; grant no more credit than that.
+      size_t free_slots = event_store_ptr_->freeQueueSlots();
+      receiver_ptr_->setCreditLimit(free_slots);
+      if (free_slots < receiver_ptr_->creditWindow() &&
+          ! stop_requested_.load() && ! pause_requested_.load() &&
+          (recvTimeout == 0 || recvTimeout > credit_recheck_usec_)) {
+        // Come back soon to grant more as the queue drains.
+        recvTimeout = credit_recheck_usec_;
+      }
+    }
     startTime = artdaq::MonitoredQuantity::getCurrentTime();
     senderSlot = receiver_ptr_->recvFragment(*pfragment, recvTimeout);
     statsHelper_.addSample(INPUT_WAIT_STAT_KEY,
@@ -463,6 +589,17 @@ size_t artdaq::EventBuilderCore::process_fragments()
     }
     statsHelper_.addSample(STORE_EVENT_WAIT_STAT_KEY,
                            artdaq::MonitoredQuantity::getCurrentTime() - startTime);
+    // From the BoardReader's send to its Fragment being in the EventStore.
+    int64_t send_time = receiver_ptr_->lastSendTime();
+    if (send_time >= 0) {
+      latency_histograms_[senderSlot - first_data_sender_rank_].
+        add((artdaq::steadyClockNanoseconds() - send_time) * 1e-9);
+    }
+
+    if (routing_master_rank_ >= 0 &&
+        (fragment_count_in_run_ % routing_token_interval_) == 0) {
+      token_sender_->send(event_store_ptr_->freeQueueSlots());
+    }
 
     /* If we've received EOD fragments from all of the BoardReaders we can
        verify that we've also received every fragment that they have sent.  If
@@ -490,6 +627,7 @@ size_t artdaq::EventBuilderCore::process_fragments()
   if (stop_requested_.load()) {metricMan_.do_stop();}
   else if (pause_requested_.load()) {metricMan_.do_pause();}
 
+  token_sender_.reset(nullptr);
   receiver_ptr_.reset(nullptr);
   return 0;
 }
@@ -601,6 +739,49 @@ void artdaq::EventBuilderCore::sendMetrics_()
                           (mqPtr->recentValueSum() / fragmentCount),
                           "seconds/fragment", 3);
   }
+
+  // The part of the EventStore time spent waiting for art to make room on
+  // its queue; when this dominates, the builder is art-bound rather than
+  // network-bound.
+  mqPtr = artdaq::StatisticsCollection::getInstance().
+    getMonitoredQuantity(artdaq::EventStore::ART_BLOCKED_TIME_STAT_KEY);
+  if (mqPtr.get() != 0) {
+    metricMan_.sendMetric(ART_BLOCKED_METRIC_NAME_,
+                          (mqPtr->recentValueSum() / fragmentCount),
+                          "seconds/fragment", 3);
+  }
+
+  // Send-to-insert latency percentiles per BoardReader since the last
+  // report, each an upper bound within a factor of two (see
+  // LatencyHistogram.hh). Time in the BoardReader before the send, and
+  // waiting for the rest of the event, are not included.
+  for (size_t i = 0; i < latency_histograms_.size(); ++i) {
+    artdaq::detail::LatencyHistogram & histogram = latency_histograms_[i];
+    if (histogram.count() == 0) { continue; }
+    std::string name = LATENCY_METRIC_NAME_ + " from rank " +
+      boost::lexical_cast<std::string>(i + first_data_sender_rank_);
+    metricMan_.sendMetric(name + " p50", histogram.percentile(0.50), "seconds", 3);
+    metricMan_.sendMetric(name + " p99", histogram.percentile(0.99), "seconds", 3);
+    metricMan_.sendMetric(name + " max", histogram.percentile(1.0), "seconds", 3);
+    histogram.reset();
+  }
+
+  if (numa_memory_report_.due()) {
+    std::vector<size_t> bytes = artdaq::memoryPerNumaNode();
+    for (size_t node = 0; node < bytes.size(); ++node) {
+      metricMan_.sendMetric(NUMA_MEMORY_METRIC_NAME_ +
+                            boost::lexical_cast<std::string>(node),
+                            bytes[node] / 1024.0 / 1024.0, "MB", 3);
+    }
+  }
+}
+
+void artdaq::EventBuilderCore::wakeStandby_()
+{
+  // Taking the lock orders this after a standby check of the flags that
+  // missed the request, so that the wait it goes into sees the notify.
+  { std::lock_guard<std::mutex> lock(standby_mutex_); }
+  standby_cv_.notify_all();
 }
 
 void artdaq::EventBuilderCore::logMessage_(std::string const& text)
@@ -4,14 +4,19 @@
 #include <string>
 #include <vector>
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 
 #include "fhiclcpp/ParameterSet.h"
 #include "art/Persistency/Provenance/RunID.h"
 #include "artdaq/DAQrate/quiet_mpi.hh"
 #include "artdaq/DAQrate/RHandles.hh"
+#include "artdaq/DAQrate/RoutingPolicy.hh"
 #include "artdaq/DAQrate/EventStore.hh"
+#include "artdaq/DAQrate/NumaPlacement.hh"
 #include "artdaq/Application/MPI2/StatisticsHelper.hh"
 #include "artdaq/DAQrate/MetricManager.hh"
+#include "artdaq/DAQrate/detail/LatencyHistogram.hh"
 
 namespace artdaq
 {
@@ -55,15 +60,29 @@ private:
 
   uint64_t max_fragment_size_words_;
   size_t mpi_buffer_count_;
+  artdaq::RHandlesOptions receive_options_;
+  bool fair_receive_scheduling_;
+  size_t mpi_min_buffers_per_source_;
+  size_t mpi_max_buffers_per_source_;
+  bool credit_flow_control_;
+  size_t mpi_credits_per_source_;
+  size_t credit_recheck_usec_;
+  bool active_; // Taking part in the EventBuilder pool.
+  int routing_master_rank_;
+  size_t routing_token_interval_;
   size_t first_data_sender_rank_;
   size_t data_sender_count_;
   size_t expected_fragments_per_event_;
   size_t eod_fragments_received_;
   bool use_art_;
   bool print_event_store_stats_;
+  size_t event_store_shards_;
+  artdaq::NumaPlacement numa_placement_;
+  artdaq::NumaMemoryReport numa_memory_report_;
   art::RunID run_id_;
 
   std::unique_ptr<artdaq::RHandles> receiver_ptr_;
+  std::unique_ptr<artdaq::RoutingTokenSender> token_sender_; // With token routing.
   std::unique_ptr<artdaq::EventStore> event_store_ptr_;
   bool art_initialized_;
   std::atomic<bool> stop_requested_;
@@ -84,6 +103,10 @@ private:
      attempt to lock the mutex as well and will be blocked until all data has
      been clocked into the EventBuilderCore. */
   std::mutex flush_mutex_;
+  // An EventBuilder standing by waits on this for a stop or pause.
+  std::mutex standby_mutex_;
+  std::condition_variable standby_cv_;
+  void wakeStandby_();
 
   // attributes and methods for statistics gathering & reporting
   artdaq::StatisticsHelper statsHelper_;
@@ -96,6 +119,11 @@ private:
   std::string DATA_RATE_METRIC_NAME_;
   std::string INPUT_WAIT_METRIC_NAME_;
   std::string EVENT_STORE_WAIT_METRIC_NAME_;
+  std::string ART_BLOCKED_METRIC_NAME_;
+  std::string LATENCY_METRIC_NAME_;
+  std::string NUMA_MEMORY_METRIC_NAME_;
+  // Fragment latencies since the last report, by sender index.
+  std::vector<artdaq::detail::LatencyHistogram> latency_histograms_;
 
   void logMessage_(std::string const& text);
 };
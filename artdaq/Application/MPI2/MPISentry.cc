@@ -1,6 +1,7 @@
 
 #include "messagefacility/MessageLogger/MessageLogger.h"
 #include "artdaq/Application/MPI2/MPISentry.hh"
+#include "artdaq/DAQrate/Locality.hh"
 #include "artdaq/DAQrate/quiet_mpi.hh"
 #include "cetlib/exception.h"
 
@@ -36,7 +37,8 @@ MPISentry(int * argc_ptr,
 
   mf::LogDebug("MPISentry") << threadresult.str();
 
-  if (threading_level != threading_level_) throw cet::exception("MPISentry") << threadresult.str();
+  // MPI may provide more than was asked for, but not less.
+  if (threading_level_ < threading_level) throw cet::exception("MPISentry") << threadresult.str();
 					     
   mf::LogDebug("MPISentry")
     << "size = "
@@ -64,7 +66,8 @@ MPISentry(int * argc_ptr,
 
   mf::LogDebug("MPISentry") << threadresult.str();
 
-  if (threading_level != threading_level_) throw cet::exception("MPISentry") << threadresult.str();
+  // MPI may provide more than was asked for, but not less.
+  if (threading_level_ < threading_level) throw cet::exception("MPISentry") << threadresult.str();
 					     
   mf::LogDebug("MPISentry")
     << "size = "
@@ -129,4 +132,6 @@ artdaq::MPISentry::
 initialize_() {
   MPI_Comm_size(MPI_COMM_WORLD, &procs_);
   MPI_Comm_rank(MPI_COMM_WORLD, &rank_);
+  // Collective: every process learns which ranks share its node.
+  discoverLocality();
 }
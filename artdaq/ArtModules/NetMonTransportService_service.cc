@@ -1,4 +1,5 @@
 #include "artdaq/ArtModules/NetMonTransportService.h"
+#include "artdaq/DAQrate/EventStore.hh"
 #include "artdaq/DAQrate/SHandles.hh"
 #include "artdaq-core/Core/GlobalQueue.hh"
 
@@ -99,6 +100,7 @@ receiveMessage(TBufferFile *&msg)
   if (recvd_fragments_ == nullptr) {
     std::shared_ptr<artdaq::RawEvent> popped_event;
     incoming_events_.deqWait(popped_event);
+    artdaq::EventStore::notifyEventDequeued();
 
     if (popped_event == nullptr) {
       msg = nullptr;
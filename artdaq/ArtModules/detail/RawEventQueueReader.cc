@@ -5,6 +5,7 @@
 #include "art/Utilities/Exception.h"
 #include "artdaq-core/Data/Fragment.hh"
 #include "artdaq-core/Data/Fragments.hh"
+#include "artdaq/DAQrate/EventStore.hh"
 #include "messagefacility/MessageLogger/MessageLogger.h"
 #include <sys/time.h>
 
@@ -91,7 +92,10 @@ bool artdaq::detail::RawEventQueueReader::readNext(art::RunPrincipal * const & i
   while (keep_looping) {
     keep_looping = false;
     got_event = incoming_events.deqTimedWait(popped_event, waiting_time);
-    if (!got_event) {
+    if (got_event) {
+      artdaq::EventStore::notifyEventDequeued();
+    }
+    else {
       mf::LogInfo("InputFailure")
           << "Reading timed out in RawEventQueueReader::readNext()";
       keep_looping = resume_after_timeout;
@@ -0,0 +1,51 @@
+#include "artdaq/DAQrate/ClockOffset.hh"
+#include "artdaq/DAQrate/MPITag.hh"
+#include "trace.h"		// TRACE
+
+#include <chrono>
+#include <limits>
+
+#include "artdaq/DAQrate/quiet_mpi.hh"
+
+int64_t
+artdaq::steadyClockNanoseconds()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t
+artdaq::measureClockOffset(int peer, size_t rounds)
+{
+  int64_t best_round_trip = std::numeric_limits<int64_t>::max();
+  int64_t best_offset = 0;
+  for (size_t i = 0; i < rounds; ++i) {
+    int64_t sent = steadyClockNanoseconds();
+    MPI_Send(&sent, sizeof(sent), MPI_BYTE, peer, MPITag::CLOCK,
+             MPI_COMM_WORLD);
+    int64_t peer_time;
+    MPI_Recv(&peer_time, sizeof(peer_time), MPI_BYTE, peer, MPITag::CLOCK,
+             MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    int64_t round_trip = steadyClockNanoseconds() - sent;
+    if (round_trip < best_round_trip) {
+      best_round_trip = round_trip;
+      best_offset = peer_time - (sent + round_trip / 2);
+    }
+  }
+  TRACE( 5, "measureClockOffset peer=%d offset=%ld ns round_trip=%ld ns",
+         peer, (long)best_offset, (long)best_round_trip );
+  return best_offset;
+}
+
+void
+artdaq::answerClockProbes(int peer, size_t rounds)
+{
+  for (size_t i = 0; i < rounds; ++i) {
+    int64_t ping;
+    MPI_Recv(&ping, sizeof(ping), MPI_BYTE, peer, MPITag::CLOCK,
+             MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    int64_t now = steadyClockNanoseconds();
+    MPI_Send(&now, sizeof(now), MPI_BYTE, peer, MPITag::CLOCK,
+             MPI_COMM_WORLD);
+  }
+}
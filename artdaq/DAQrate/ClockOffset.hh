@@ -0,0 +1,26 @@
+#ifndef artdaq_DAQrate_ClockOffset_hh
+#define artdaq_DAQrate_ClockOffset_hh
+
+#include <cstddef>
+#include <cstdint>
+
+// Comparing send and receive times of processes on different nodes,
+// whose steady clocks are unrelated. A receiver pings each of its
+// sources over MPI (MPITag::CLOCK) and takes the offset of that source's
+// clock from its own, assuming the reply was stamped halfway through the
+// round trip; the shortest of several round trips gives the best bound.
+
+namespace artdaq {
+  // This process's steady clock, in nanoseconds.
+  int64_t steadyClockNanoseconds();
+
+  // Ping the given rank of MPI_COMM_WORLD rounds times, and return the
+  // peer's clock minus ours, in nanoseconds. The peer must be calling
+  // answerClockProbes() with the same rounds.
+  int64_t measureClockOffset(int peer, size_t rounds);
+
+  // Answer rounds pings from the given rank with our clock.
+  void answerClockProbes(int peer, size_t rounds);
+}
+
+#endif /* artdaq_DAQrate_ClockOffset_hh */
@@ -1,5 +1,6 @@
 
 #include "artdaq/DAQrate/EventStore.hh"
+#include <algorithm>
 #include <utility>
 #include <cstring>
 #include <dlfcn.h>
@@ -11,6 +12,7 @@
 #include "artdaq-core/Core/StatisticsCollection.hh"
 #include "artdaq-core/Core/SimpleQueueReader.hh"
 #include "artdaq/DAQrate/Utils.hh"
+#include "artdaq/DAQrate/detail/PoolAllocator.hh"
 #include "messagefacility/MessageLogger/MessageLogger.h"
 #include "tracelib.h"
 
@@ -28,6 +30,23 @@ using namespace std;
 namespace artdaq {
   const std::string EventStore::EVENT_RATE_STAT_KEY("EventStoreEventRate");
   const std::string EventStore::INCOMPLETE_EVENT_STAT_KEY("EventStoreIncompleteEvents");
+  const std::string EventStore::ART_BLOCKED_TIME_STAT_KEY("EventStoreArtBlockedTime");
+  const size_t EventStore::EVENT_RING_SIZE = 1024;
+  const size_t EventStore::SHARD_QUEUE_SIZE = 1024;
+  const std::chrono::microseconds EventStore::SHARD_WAIT(100000);
+  std::mutex EventStore::queue_space_mutex_;
+  std::condition_variable EventStore::queue_space_cv_;
+
+  EventStore::Shard::Shard() :
+    event_ring(EVENT_RING_SIZE),
+    event_ring_keys(EVENT_RING_SIZE, 0),
+    overflow_events(),
+    inbox(SHARD_QUEUE_SIZE),
+    items_pushed(0),
+    items_done(0),
+    worker()
+  {
+  }
 
   EventStore::EventStore(size_t num_fragments_per_event,
                          run_id_t run,
@@ -41,7 +60,15 @@ namespace artdaq {
     max_queue_size_(50),
     run_id_(run),
     subrun_id_(0),
-    events_(),
+    shards_(),
+    completion_mutex_(),
+    returned_mutex_(),
+    returned_fragments_(),
+    returned_count_(0),
+    drain_mutex_(),
+    drain_cond_(),
+    draining_(false),
+    incomplete_count_(0),
     queue_(getGlobalQueue(max_queue_size_)),
     reader_thread_(std::async(std::launch::async, reader, argc, argv)),
     seqIDModulus_(1),
@@ -51,6 +78,7 @@ namespace artdaq {
     enq_check_count_(5000),
     printSummaryStats_(printSummaryStats)
   {
+    shards_.emplace_back(new Shard);
     initStatistics_();
     TRACE( 12, "artdaq::EventStore::EventStore ctor - reader_thread_ initialized" );
   }
@@ -66,7 +94,15 @@ namespace artdaq {
     max_queue_size_(50),
     run_id_(run),
     subrun_id_(0),
-    events_(),
+    shards_(),
+    completion_mutex_(),
+    returned_mutex_(),
+    returned_fragments_(),
+    returned_count_(0),
+    drain_mutex_(),
+    drain_cond_(),
+    draining_(false),
+    incomplete_count_(0),
     queue_(getGlobalQueue(max_queue_size_)),
     reader_thread_(std::async(std::launch::async, reader, configString)),
     seqIDModulus_(1),
@@ -76,6 +112,7 @@ namespace artdaq {
     enq_check_count_(5000),
     printSummaryStats_(printSummaryStats)
   {
+    shards_.emplace_back(new Shard);
     initStatistics_();
   }
 
@@ -94,7 +131,15 @@ namespace artdaq {
     max_queue_size_(max_art_queue_size),
     run_id_(run),
     subrun_id_(0),
-    events_(),
+    shards_(),
+    completion_mutex_(),
+    returned_mutex_(),
+    returned_fragments_(),
+    returned_count_(0),
+    drain_mutex_(),
+    drain_cond_(),
+    draining_(false),
+    incomplete_count_(0),
     queue_(getGlobalQueue(max_queue_size_)),
     reader_thread_(std::async(std::launch::async, reader, argc, argv)),
     seqIDModulus_(1),
@@ -104,6 +149,7 @@ namespace artdaq {
     enq_check_count_(enq_check_count),
     printSummaryStats_(printSummaryStats)
   {
+    shards_.emplace_back(new Shard);
     initStatistics_();
   }
 
@@ -121,7 +167,15 @@ namespace artdaq {
     max_queue_size_(max_art_queue_size),
     run_id_(run),
     subrun_id_(0),
-    events_(),
+    shards_(),
+    completion_mutex_(),
+    returned_mutex_(),
+    returned_fragments_(),
+    returned_count_(0),
+    drain_mutex_(),
+    drain_cond_(),
+    draining_(false),
+    incomplete_count_(0),
     queue_(getGlobalQueue(max_queue_size_)),
     reader_thread_(std::async(std::launch::async, reader, configString)),
     seqIDModulus_(1),
@@ -131,11 +185,13 @@ namespace artdaq {
     enq_check_count_(enq_check_count),
     printSummaryStats_(printSummaryStats)
   {
+    shards_.emplace_back(new Shard);
     initStatistics_();
   }
 
   EventStore::~EventStore()
   {
+    stopShards_();
     if (printSummaryStats_) {
       reportStatistics_();
     }
@@ -143,6 +199,13 @@ namespace artdaq {
 
   void EventStore::insert(FragmentPtr pfrag,
                           bool printWarningWhenFragmentIsDropped)
+  {
+    insert_(std::move(pfrag), printWarningWhenFragmentIsDropped, false);
+  }
+
+  void EventStore::insert_(FragmentPtr pfrag,
+                           bool printWarningWhenFragmentIsDropped,
+                           bool rejectWhenQueueFull)
   {
     // We should never get a null pointer, nor should we get a
     // Fragment without a good fragment ID.
@@ -164,32 +227,87 @@ namespace artdaq {
     TRACE( 13, "EventStore::insert seq=%lu fragID=%d id=%d lastFlushed=%lu seqIDMod=%d seq=%lu"
 	  , pfrag->sequenceID(), pfrag->fragmentID(), id_, lastFlushedSeqID_, seqIDModulus_, sequence_id );
 
-    // Find if the right event id is already known to events_ and, if so, where
-    // it is.
-    EventMap::iterator loc = events_.lower_bound(sequence_id);
+    if (shards_.size() == 1) {
+      insertIntoShard_(*shards_[0], sequence_id, std::move(pfrag),
+                       printWarningWhenFragmentIsDropped, rejectWhenQueueFull);
+      return;
+    }
+
+    // Hand the Fragment to the worker thread owning this event, waiting
+    // for room in its queue if that worker has fallen behind.
+    Shard & shard(*shards_[sequence_id % shards_.size()]);
+    ShardItem item {sequence_id, std::move(pfrag),
+                    printWarningWhenFragmentIsDropped, rejectWhenQueueFull};
+    shard.items_pushed.fetch_add(1);
+    while (! shard.inbox.push(std::move(item), SHARD_WAIT)) { }
+  }
+
+  void EventStore::insertIntoShard_(Shard & shard,
+                                    sequence_id_t sequence_id,
+                                    FragmentPtr pfrag,
+                                    bool printWarningWhenFragmentIsDropped,
+                                    bool rejectWhenQueueFull)
+  {
+    // Find the event with this id, either in its ring slot or in the
+    // overflow map; if there is none, create it in its ring slot if
+    // that is free, otherwise in the overflow map.
+    size_t slot = (sequence_id / shards_.size()) % EVENT_RING_SIZE;
+    RawEvent_ptr * loc;
+    EventMap::iterator overflow_loc = shard.overflow_events.end();
+    if (shard.event_ring[slot] != nullptr && shard.event_ring_keys[slot] == sequence_id) {
+      loc = &shard.event_ring[slot];
+    }
+    else if (! shard.overflow_events.empty() &&
+             (overflow_loc = shard.overflow_events.find(sequence_id)) != shard.overflow_events.end()) {
+      loc = &overflow_loc->second;
+    }
+    else if (shard.event_ring[slot] == nullptr) {
+      shard.event_ring[slot] = makeEvent_(pfrag->sequenceID());
+      shard.event_ring_keys[slot] = sequence_id;
+      loc = &shard.event_ring[slot];
+      ++incomplete_count_;
+    }
+    else {
+      overflow_loc = shard.overflow_events.emplace(sequence_id,
+                                              makeEvent_(pfrag->sequenceID())).first;
+      loc = &overflow_loc->second;
+      ++incomplete_count_;
+    }
 
-    if (loc == events_.end() || events_.key_comp()(sequence_id, loc->first)) {
-      // We don't have an event with this id; create one and insert it at loc,
-      // and ajust loc to point to the newly inserted event.
-      RawEvent_ptr newevent(new RawEvent(run_id_, subrun_id_, pfrag->sequenceID()));
-      loc =
-        events_.insert(loc, EventMap::value_type(sequence_id, newevent));
+    // If this Fragment completes the event, make sure first that the
+    // event can be queued, unless it is to be dropped otherwise.
+    bool const completes = (*loc)->numFragments() + 1 == num_fragments_per_event_;
+    std::unique_lock<std::mutex> completion_lock(completion_mutex_, std::defer_lock);
+    if (completes) {
+      completion_lock.lock();
+      if (rejectWhenQueueFull && queue_.full() && ! waitForQueueSpace_()) {
+        std::lock_guard<std::mutex> lock(returned_mutex_);
+        returned_fragments_.push_back(std::move(pfrag));
+        ++returned_count_;
+        return;
+      }
     }
 
     // Now insert the fragment into the event we have located.
-    loc->second->insertFragment(std::move(pfrag));
-    if (loc->second->numFragments() == num_fragments_per_event_) {
+    (*loc)->insertFragment(std::move(pfrag));
+    if (completes) {
       // This RawEvent is complete; capture it, remove it from the
-      // map, report on statistics, and put the shared pointer onto
+      // store, report on statistics, and put the shared pointer onto
       // the event queue.
-      RawEvent_ptr complete_event(loc->second);
+      RawEvent_ptr complete_event(std::move(*loc));
       complete_event->markComplete();
 #if 0
       // jbk - see note at top of file
       PerfWriteEvent(EventMeas::END, sequence_id);
 #endif
 
-      events_.erase(loc);
+      if (overflow_loc != shard.overflow_events.end()) {
+        shard.overflow_events.erase(overflow_loc);
+      }
+      else {
+        shard.event_ring[slot].reset();
+      }
+      --incomplete_count_;
       // 13-Dec-2012, KAB - this monitoring needs to come before
       // the enqueueing of the event lest it be empty by the
       // time that we ask for the word count.
@@ -199,7 +317,15 @@ namespace artdaq {
         mqPtr->addSample(complete_event->wordCount());
       }
       TRACE( 14, "EventStore::insert seq=%lu enqTimedWait start", sequence_id );
-      bool enqSuccess = queue_.enqTimedWait(complete_event, enq_timeout_);
+      bool enqSuccess;
+      if (queue_.full()) {
+        MonitoredQuantity::TIME_POINT_T blockStart = MonitoredQuantity::getCurrentTime();
+        enqSuccess = queue_.enqTimedWait(complete_event, enq_timeout_);
+        recordArtBlockedTime_(MonitoredQuantity::getCurrentTime() - blockStart);
+      }
+      else {
+        enqSuccess = queue_.enqTimedWait(complete_event, enq_timeout_);
+      }
       TRACE( enqSuccess?14:0, "EventStore::insert seq=%lu enqTimedWait complete", sequence_id );
       if (! enqSuccess) {
 	  //TRACE_CNTL( "modeM", 0 );
@@ -218,7 +344,7 @@ namespace artdaq {
     MonitoredQuantityPtr mqPtr = StatisticsCollection::getInstance().
       getMonitoredQuantity(INCOMPLETE_EVENT_STAT_KEY);
     if (mqPtr.get() != 0) {
-      mqPtr->addSample(events_.size());
+      mqPtr->addSample(incomplete_count_.load());
     }
   }
 
@@ -229,28 +355,27 @@ namespace artdaq {
     // can be pushed onto the event queue.  If not, we return it and
     // let the caller know that we didn't accept it.
     TRACE(12, "EventStore: Testing if queue is full");
-    if (queue_.full()) {
-      size_t sleepTime = 1000000 * (enq_timeout_.count() / enq_check_count_);
-      TRACE(12, "EventStore: sleepTime is %lu.",sleepTime);
-      size_t loopCount = 0;
-      while (loopCount < enq_check_count_ && queue_.full()) {
-        ++loopCount;
-        usleep(sleepTime);
-      }
-      if (queue_.full()) {
-        rejectedFragment = std::move(pfrag);
-        return false;
-      }
+    if (queue_.full() && ! waitForQueueSpace_()) {
+      rejectedFragment = std::move(pfrag);
+      return false;
     }
 
     TRACE(12, "EventStore: Performing insert");
-    insert(std::move(pfrag));
-    return true;
+    insert_(std::move(pfrag), true, true);
+    if (returned_count_.load() == 0) {
+      return true;
+    }
+    std::lock_guard<std::mutex> lock(returned_mutex_);
+    rejectedFragment = std::move(returned_fragments_.front());
+    returned_fragments_.pop_front();
+    --returned_count_;
+    return false;
   }
 
   bool
   EventStore::endOfData(int& readerReturnValue)
   {
+    drainShards_();
     RawEvent_ptr end_of_data(nullptr);
     bool enqSuccess = queue_.enqTimedWait(end_of_data, enq_timeout_);
     if (! enqSuccess) {
@@ -267,14 +392,28 @@ namespace artdaq {
 
   bool EventStore::flushData()
   {
+    drainShards_();
     bool enqSuccess;
-    size_t initialStoreSize = events_.size();
+    size_t initialStoreSize = incomplete_count_;
     mf::LogDebug("EventStore") << "Flushing " << initialStoreSize
                                << " stale events from the EventStore.";
-    EventMap::iterator loc;
-    std::vector<sequence_id_t> flushList;
-    for (loc = events_.begin(); loc != events_.end(); ++loc) {
-      RawEvent_ptr complete_event(loc->second);
+    // Flush in sequence ID order, as the events would have completed.
+    std::vector<std::pair<sequence_id_t, RawEvent_ptr *>> staleEvents;
+    staleEvents.reserve(initialStoreSize);
+    for (auto & shard : shards_) {
+      for (size_t slot = 0; slot < EVENT_RING_SIZE; ++slot) {
+        if (shard->event_ring[slot] != nullptr) {
+          staleEvents.emplace_back(shard->event_ring_keys[slot], &shard->event_ring[slot]);
+        }
+      }
+      for (auto & entry : shard->overflow_events) {
+        staleEvents.emplace_back(entry.first, &entry.second);
+      }
+    }
+    std::sort(staleEvents.begin(), staleEvents.end());
+    size_t flushCount = 0;
+    for (auto & entry : staleEvents) {
+      RawEvent_ptr complete_event(*entry.second);
       MonitoredQuantityPtr mqPtr = StatisticsCollection::getInstance().
         getMonitoredQuantity(EVENT_RATE_STAT_KEY);
       if (mqPtr.get() != 0) {
@@ -285,21 +424,62 @@ namespace artdaq {
         break;
       }
       else {
-        flushList.push_back(loc->first);
+        entry.second->reset();
+        ++flushCount;
       }
     }
-    for (size_t idx=0; idx < flushList.size(); ++idx) {
-      events_.erase(flushList[idx]);
+    for (auto & shard : shards_) {
+      EventMap & overflow(shard->overflow_events);
+      for (auto it = overflow.begin(); it != overflow.end(); ) {
+        if (it->second == nullptr) {
+          it = overflow.erase(it);
+        }
+        else {
+          ++it;
+        }
+      }
     }
-    mf::LogDebug("EventStore") << "Done flushing " << flushList.size()
+    incomplete_count_ -= flushCount;
+    mf::LogDebug("EventStore") << "Done flushing " << flushCount
                                << " stale events from the EventStore.";
 
     lastFlushedSeqID_ = highestSeqIDSeen_;
-    return (flushList.size() >= initialStoreSize);
+    return (flushCount >= initialStoreSize);
+  }
+
+  void EventStore::setShardCount(size_t shard_count)
+  {
+    if (shard_count == 0) {shard_count = 1;}
+    stopShards_();
+    if (incomplete_count_ != 0) {
+      throw cet::exception("EventStore")
+        << "The number of shards can not be changed while "
+        << incomplete_count_ << " incomplete events are in the store.";
+    }
+    shards_.clear();
+    for (size_t idx = 0; idx < shard_count; ++idx) {
+      shards_.emplace_back(new Shard);
+    }
+    if (shard_count > 1) {
+      for (auto & shard : shards_) {
+        Shard & s(*shard);
+        s.worker = std::thread([this, &s] () { runShard_(s); });
+      }
+    }
+    mf::LogDebug("EventStore") << "Assembling events in "
+                               << shard_count << " shard(s).";
+  }
+
+  size_t EventStore::freeQueueSlots() const
+  {
+    size_t queued = queue_.size();
+    size_t capacity = queue_.capacity();
+    return (queued < capacity) ? (capacity - queued) : 0;
   }
 
   void EventStore::startRun(run_id_t runID)
   {
+    drainShards_();
     run_id_ = runID;
     subrun_id_ = 1;
     lastFlushedSeqID_ = 0;
@@ -315,11 +495,13 @@ namespace artdaq {
 
   void EventStore::startSubrun()
   {
+    drainShards_();
     ++subrun_id_;
   }
 
   bool EventStore::endRun()
   {
+    drainShards_();
     RawEvent_ptr endOfRunEvent(new RawEvent(run_id_, subrun_id_, 0));
     std::unique_ptr<artdaq::Fragment>
       endOfRunFrag(new
@@ -336,6 +518,7 @@ namespace artdaq {
 
   bool EventStore::endSubrun()
   {
+    drainShards_();
     RawEvent_ptr endOfSubrunEvent(new RawEvent(run_id_, subrun_id_, 0));
     std::unique_ptr<artdaq::Fragment>
       endOfSubrunFrag(new
@@ -350,6 +533,128 @@ namespace artdaq {
     return queue_.enqTimedWait(endOfSubrunEvent, enq_timeout_);
   }
 
+  void
+  EventStore::notifyEventDequeued()
+  {
+    // Taking the lock orders this notification after a waiter's last
+    // check of the queue, so the wakeup can not be lost.
+    {
+      std::lock_guard<std::mutex> lock(queue_space_mutex_);
+    }
+    queue_space_cv_.notify_all();
+  }
+
+  bool
+  EventStore::waitForQueueSpace_()
+  {
+    typedef std::chrono::steady_clock clock;
+    // Not every queue reader is guaranteed to notify, so the queue is
+    // also rechecked every enq_timeout_/enq_check_count_.
+    clock::duration checkInterval =
+      std::chrono::duration_cast<clock::duration>(enq_timeout_ /
+                                                   std::max(enq_check_count_, (size_t) 1));
+    clock::time_point startTime = clock::now();
+    clock::time_point deadline =
+      startTime + std::chrono::duration_cast<clock::duration>(enq_timeout_);
+    TRACE(12, "EventStore: waiting for room on the queue");
+
+    std::unique_lock<std::mutex> lock(queue_space_mutex_);
+    while (queue_.full()) {
+      clock::time_point now = clock::now();
+      if (now >= deadline) {break;}
+      queue_space_cv_.wait_until(lock, std::min(deadline, now + checkInterval));
+    }
+    bool haveSpace = ! queue_.full();
+    lock.unlock();
+
+    recordArtBlockedTime_(std::chrono::duration<double>(clock::now() - startTime).count());
+    return haveSpace;
+  }
+
+  void
+  EventStore::recordArtBlockedTime_(double seconds)
+  {
+    MonitoredQuantityPtr mqPtr = StatisticsCollection::getInstance().
+      getMonitoredQuantity(ART_BLOCKED_TIME_STAT_KEY);
+    if (mqPtr.get() != 0) {
+      mqPtr->addSample(seconds);
+    }
+  }
+
+  RawEvent_ptr
+  EventStore::makeEvent_(sequence_id_t seqID)
+  {
+    // The pool allocator recycles the storage of RawEvents released by
+    // art, so steady-state event building does not go to the heap for them.
+    return std::allocate_shared<RawEvent>(detail::PoolAllocator<RawEvent>(),
+                                          run_id_, subrun_id_, seqID);
+  }
+
+  void
+  EventStore::runShard_(Shard & shard)
+  {
+    ShardItem item;
+    while (true) {
+      if (! shard.inbox.pop(item, SHARD_WAIT)) {continue;}
+      if (item.fragment == nullptr) {break;}
+      insertIntoShard_(shard, item.sequence_id, std::move(item.fragment),
+                       item.printWarningWhenFragmentIsDropped,
+                       item.rejectWhenQueueFull);
+      shard.items_done.fetch_add(1);
+      // Pairs with drainShards_(): either it sees the count, or we see
+      // that it is waiting.
+      if (draining_.load()) {
+        {
+          std::lock_guard<std::mutex> lock(drain_mutex_);
+        }
+        drain_cond_.notify_all();
+      }
+    }
+  }
+
+  void
+  EventStore::drainShards_()
+  {
+    draining_.store(true);
+    while (true) {
+      for (auto & shard : shards_) {
+        if (! shard->worker.joinable()) {continue;}
+        std::unique_lock<std::mutex> lock(drain_mutex_);
+        Shard & s(*shard);
+        drain_cond_.wait(lock, [&s] () {
+            return s.items_done.load() == s.items_pushed.load();
+          });
+      }
+      // Fragments handed back since the caller's last insert() would
+      // otherwise be lost: insert them again, now dropping their events
+      // if the queue stays full, as insert() without rejection does.
+      std::deque<FragmentPtr> returned;
+      {
+        std::lock_guard<std::mutex> lock(returned_mutex_);
+        returned.swap(returned_fragments_);
+        returned_count_.store(0);
+      }
+      if (returned.empty()) {break;}
+      for (auto & pfrag : returned) {
+        insert_(std::move(pfrag), true, false);
+      }
+    }
+    draining_.store(false);
+  }
+
+  void
+  EventStore::stopShards_()
+  {
+    drainShards_();
+    for (auto & shard : shards_) {
+      if (shard->worker.joinable()) {
+        ShardItem stop {0, nullptr, false, false};
+        while (! shard->inbox.push(std::move(stop), SHARD_WAIT)) { }
+        shard->worker.join();
+      }
+    }
+  }
+
   void
   EventStore::initStatistics_()
   {
@@ -370,6 +675,15 @@ namespace artdaq {
         addMonitoredQuantity(INCOMPLETE_EVENT_STAT_KEY, mqPtr);
     }
     mqPtr->reset();
+
+    mqPtr = StatisticsCollection::getInstance().
+      getMonitoredQuantity(ART_BLOCKED_TIME_STAT_KEY);
+    if (mqPtr.get() == 0) {
+      mqPtr.reset(new MonitoredQuantity(3.0, 300.0));
+      StatisticsCollection::getInstance().
+        addMonitoredQuantity(ART_BLOCKED_TIME_STAT_KEY, mqPtr);
+    }
+    mqPtr->reset();
   }
 
   void
@@ -463,7 +777,7 @@ namespace artdaq {
                     << " sec" << std::endl;
         }
       }
-      outStream << "Incomplete count now = " << events_.size() << std::endl;
+      outStream << "Incomplete count now = " << incomplete_count_.load() << std::endl;
       outStream.close();
     }
   }
@@ -3,10 +3,17 @@
 
 #include "artdaq-core/Data/RawEvent.hh"
 #include "artdaq-core/Core/GlobalQueue.hh"
+#include "artdaq/DAQrate/detail/SPSCQueue.hh"
 
-#include <map>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <memory>
-//#include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <thread>
 #include <future>
 #include <stdint.h>
 
@@ -38,10 +45,21 @@ namespace artdaq {
     typedef RawEvent::run_id_t      run_id_t;
     typedef RawEvent::subrun_id_t   subrun_id_t;
     typedef Fragment::sequence_id_t    sequence_id_t;
-    typedef std::map<sequence_id_t, RawEvent_ptr> EventMap;
+    typedef std::unordered_map<sequence_id_t, RawEvent_ptr> EventMap;
 
     static const std::string EVENT_RATE_STAT_KEY;
     static const std::string INCOMPLETE_EVENT_STAT_KEY;
+    // Seconds spent waiting for room on the RawEvent queue, i.e. for art.
+    static const std::string ART_BLOCKED_TIME_STAT_KEY;
+
+    // Events being built are kept in a ring indexed by sequence ID
+    // modulo EVENT_RING_SIZE; an event whose slot is already taken by
+    // another event goes into an overflow map instead.
+    static const size_t EVENT_RING_SIZE;
+    // Number of Fragments that may wait for each shard worker thread.
+    static const size_t SHARD_QUEUE_SIZE;
+    // Longest single wait on a shard queue before checking again.
+    static const std::chrono::microseconds SHARD_WAIT;
 
     EventStore() = delete;
     EventStore(EventStore const &) = delete;
@@ -69,6 +87,10 @@ namespace artdaq {
 
     ~EventStore();
 
+    // Readers of the RawEvent queue call this after taking an event off
+    // it, to wake an EventStore that is waiting for room on the queue.
+    static void notifyEventDequeued();
+
     // Give ownership of the Fragment to the EventStore. The pointer
     // we are given must NOT be null, and the Fragment to which it
     // points must NOT be empty; the Fragment must at least contain
@@ -82,7 +104,12 @@ namespace artdaq {
     // -> this second instance of the insert method returns false,
     //    and returns the fragment to the caller, if there is no
     //    room to push events onto the event queue, within the
-    //    timeout that was specified at construction time.
+    //    timeout that was specified at construction time. While
+    //    waiting, the queue is rechecked whenever a reader reports
+    //    a dequeue, and at least enq_check_count times. With several
+    //    shards, the Fragment returned may instead be an earlier one
+    //    whose event a shard worker could not queue; pfrag has then
+    //    been accepted.
     bool insert(FragmentPtr pfrag, FragmentPtr& rejectedFragment);
 
     // Put the end-of-data marker onto the RawEvent queue (if possible),
@@ -98,6 +125,15 @@ namespace artdaq {
     // different sequence IDs.
     void setSeqIDModulus(unsigned int seqIDModulus);
 
+    // Split event assembly across shard_count worker threads, each
+    // owning the events whose sequence IDs are congruent to its index
+    // modulo shard_count. insert() then only hands the Fragment to the
+    // right worker. The default, one shard, assembles events in the
+    // thread calling insert(). This must be called while the store
+    // holds no incomplete events.
+    void setShardCount(size_t shard_count);
+    size_t shardCount() const {return shards_.size();}
+
     // Push any incomplete events onto the queue.  Returns true if
     // all stale events were flushed, false if one or more events
     // could not be flushed because the queue was full.
@@ -108,6 +144,10 @@ namespace artdaq {
 
     subrun_id_t subrunID() const {return subrun_id_;}
 
+    // Number of complete events that can currently be pushed onto the
+    // RawEvent queue without waiting.
+    size_t freeQueueSlots() const;
+
     // These methods return true if the relevant markers were pushed
     // onto the RawEvent queue, false if not.
     bool endRun();
@@ -121,7 +161,43 @@ namespace artdaq {
     size_t  const  max_queue_size_;
     run_id_t run_id_;
     subrun_id_t subrun_id_;
-    EventMap       events_;
+    // A Fragment on its way to a shard worker thread; one without a
+    // Fragment tells the worker to stop.
+    struct ShardItem {
+      sequence_id_t sequence_id;
+      FragmentPtr   fragment;
+      bool          printWarningWhenFragmentIsDropped;
+      bool          rejectWhenQueueFull;
+    };
+
+    // The events belonging to one shard, and when shards run in worker
+    // threads, that worker's input queue and progress counters.
+    struct Shard {
+      Shard();
+
+      std::vector<RawEvent_ptr>   event_ring;
+      std::vector<sequence_id_t>  event_ring_keys;
+      EventMap                    overflow_events;
+
+      detail::SPSCQueue<ShardItem> inbox;
+      std::atomic<size_t>         items_pushed;
+      std::atomic<size_t>         items_done;
+      std::thread                 worker;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    // Held while completing an event, so room found on the RawEvent
+    // queue is still there when the event is pushed.
+    std::mutex completion_mutex_;
+    // Fragments handed back by shard workers, for insert() to return.
+    std::mutex returned_mutex_;
+    std::deque<FragmentPtr> returned_fragments_;
+    std::atomic<size_t> returned_count_;
+    // For drainShards_() to wait on the workers.
+    std::mutex drain_mutex_;
+    std::condition_variable drain_cond_;
+    std::atomic<bool> draining_;
+    std::atomic<size_t> incomplete_count_;
     RawEventQueue & queue_;
     std::future<int> reader_thread_;
 
@@ -133,6 +209,26 @@ namespace artdaq {
     size_t        enq_check_count_;
     bool const     printSummaryStats_;
 
+    static std::mutex queue_space_mutex_;
+    static std::condition_variable queue_space_cv_;
+
+    RawEvent_ptr makeEvent_(sequence_id_t seqID);
+    // Wait up to enq_timeout_ for the RawEvent queue to have room.
+    bool waitForQueueSpace_();
+    void recordArtBlockedTime_(double seconds);
+    void insert_(FragmentPtr pfrag, bool printWarningWhenFragmentIsDropped,
+                 bool rejectWhenQueueFull);
+    // If rejectWhenQueueFull is set and pfrag would complete an event
+    // for which there is no room on the RawEvent queue, pfrag is not
+    // inserted but handed back through returned_fragments_.
+    void insertIntoShard_(Shard & shard, sequence_id_t sequence_id,
+                          FragmentPtr pfrag,
+                          bool printWarningWhenFragmentIsDropped,
+                          bool rejectWhenQueueFull);
+    void runShard_(Shard & shard);
+    // Wait until the shard workers have processed everything handed to them.
+    void drainShards_();
+    void stopShards_();
     void initStatistics_();
     void reportStatistics_();
   };
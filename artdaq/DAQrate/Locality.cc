@@ -0,0 +1,70 @@
+#include "artdaq/DAQrate/Locality.hh"
+
+#include "messagefacility/MessageLogger/MessageLogger.h"
+
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "artdaq/DAQrate/quiet_mpi.hh"
+
+namespace {
+  std::vector<bool> same_node_; // Indexed by rank.
+  uint64_t job_token_ = 0;
+}
+
+void
+artdaq::discoverLocality()
+{
+  int rank, procs;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &procs);
+
+  char name[MPI_MAX_PROCESSOR_NAME];
+  int length = 0;
+  std::memset(name, 0, sizeof(name));
+  MPI_Get_processor_name(name, &length);
+  std::vector<char> all_names(procs * MPI_MAX_PROCESSOR_NAME);
+  MPI_Allgather(name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR,
+                &all_names[0], MPI_MAX_PROCESSOR_NAME, MPI_CHAR,
+                MPI_COMM_WORLD);
+
+  same_node_.assign(procs, false);
+  size_t local_count = 0;
+  for (int r = 0; r < procs; ++r) {
+    if (std::strncmp(name, &all_names[r * MPI_MAX_PROCESSOR_NAME],
+                     MPI_MAX_PROCESSOR_NAME) == 0) {
+      same_node_[r] = true;
+      ++local_count;
+    }
+  }
+
+  uint64_t token = 0;
+  if (rank == 0) {
+    token = (static_cast<uint64_t>(getpid()) << 32) ^
+      static_cast<uint64_t>(time(0));
+  }
+  MPI_Bcast(&token, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+  job_token_ = token;
+
+  mf::LogDebug("Locality") << "Rank " << rank << " shares node " << name
+                           << " with " << (local_count - 1)
+                           << " other rank(s).";
+}
+
+bool
+artdaq::sameNode(int rank)
+{
+  return rank >= 0 && static_cast<size_t>(rank) < same_node_.size() &&
+    same_node_[rank];
+}
+
+uint64_t
+artdaq::jobToken()
+{
+  // Without discoverLocality() no rank shares a node, so the process
+  // alone needs a name of its own.
+  return job_token_ != 0 ? job_token_ : static_cast<uint64_t>(getpid()) << 32;
+}
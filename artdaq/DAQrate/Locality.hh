@@ -0,0 +1,25 @@
+#ifndef artdaq_DAQrate_Locality_hh
+#define artdaq_DAQrate_Locality_hh
+
+#include <cstdint>
+
+// Knowledge of which ranks of MPI_COMM_WORLD share a node with this
+// process, so that transports can bypass MPI between co-located ranks.
+
+namespace artdaq {
+  // Exchange the processor names of all the ranks in MPI_COMM_WORLD.
+  // This is collective over MPI_COMM_WORLD, so every process must call
+  // it, once, after MPI has been initialized.
+  void discoverLocality();
+
+  // True if the given rank of MPI_COMM_WORLD runs on the same node as
+  // this process. Always false if discoverLocality() was not called.
+  bool sameNode(int rank);
+
+  // A value identifying this MPI job, identical in all of its ranks;
+  // used to keep the names of shared resources of concurrent jobs apart.
+  // Before discoverLocality(), it identifies this process instead.
+  uint64_t jobToken();
+}
+
+#endif /* artdaq_DAQrate_Locality_hh */
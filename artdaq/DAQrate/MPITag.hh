@@ -9,7 +9,20 @@ namespace artdaq {
   // want enum class because we need to be able to convert to integral
   // types easily for use with MPI.
   namespace detail {
-  enum MPITag : uint8_t { FINAL = 1, INCOMPLETE = 2};
+  // INCOMPLETE marks one chunk of a Fragment too large to be sent
+  // whole (see detail/ChunkHeader.hh).
+  // BATCH marks a message holding several complete Fragments packed
+  // back to back; the receiver walks their headers to split them.
+  // TOKEN carries a receiver's free capacity to the routing master.
+  // RMA_COMM tags the creation of an RMAChannel's communicator.
+  // CLOCK carries the pings used to estimate clock offsets.
+  // CREDIT carries send credits from a receiver to one of its sources.
+  // MEMBERSHIP tells the senders whether a receiver is taking part.
+  // LEASE carries a routing lease from the routing master to the other
+  // senders.
+  enum MPITag : uint8_t { FINAL = 1, INCOMPLETE = 2, BATCH = 3, TOKEN = 4,
+                          RMA_COMM = 5, CLOCK = 6, CREDIT = 7,
+                          MEMBERSHIP = 8, LEASE = 9};
   }
 
   typedef detail::MPITag MPITag;
@@ -0,0 +1,242 @@
+#include "artdaq/DAQrate/NumaPlacement.hh"
+
+#include "fhiclcpp/ParameterSet.h"
+#include "messagefacility/MessageLogger/MessageLogger.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+  std::string const CORES_SUFFIX = "_cores";
+
+  // The memory policy calls, made directly so as not to need libnuma.
+  long setMempolicy(int mode, unsigned long const * nodes, unsigned long max_node)
+  {
+    return syscall(SYS_set_mempolicy, mode, nodes, max_node);
+  }
+
+  long getMempolicy(int * mode, unsigned long * nodes, unsigned long max_node)
+  {
+    return syscall(SYS_get_mempolicy, mode, nodes, max_node, nullptr, 0ul);
+  }
+
+  void pinTo(std::vector<int> const & cores, std::string const & role)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int core : cores) {
+      if (core < 0 || core >= CPU_SETSIZE) {
+        mf::LogWarning("NumaPlacement") << "Ignoring core " << core
+                                        << " given for " << role << " threads.";
+        continue;
+      }
+      CPU_SET(core, &set);
+    }
+    int status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (status != 0) {
+      mf::LogWarning("NumaPlacement") << "Unable to pin " << role
+                                      << " thread to its cores: " << strerror(status);
+    }
+  }
+
+  // Prefer, rather than insist on, the node: when it runs out of memory
+  // we would rather be slow than be killed.
+  void preferNode(int node, std::string const & role)
+  {
+    std::vector<unsigned long> nodes(node / (8 * sizeof(unsigned long)) + 1, 0);
+    nodes[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+    if (setMempolicy(MPOL_PREFERRED, &nodes[0], nodes.size() * 8 * sizeof(unsigned long) + 1) != 0) {
+      mf::LogWarning("NumaPlacement") << "Unable to take memory for " << role
+                                      << " thread from NUMA node " << node
+                                      << ": " << strerror(errno);
+    }
+  }
+}
+
+int
+artdaq::numaNodeOfInterface(std::string const & interface)
+{
+  std::ifstream file("/sys/class/net/" + interface + "/device/numa_node");
+  int node = -1;
+  if (! (file >> node)) { return -1; }
+  return node;
+}
+
+std::vector<size_t>
+artdaq::parseNumaMaps(std::istream & numa_maps)
+{
+  // Each line is one mapping, e.g.
+  //   7f6c2a000000 default anon=512 dirty=512 N0=256 N1=256 kernelpagesize_kB=4
+  // where N<node>=<pages> counts the pages present on each node.
+  std::vector<size_t> bytes;
+  std::string line;
+  while (std::getline(numa_maps, line)) {
+    std::istringstream fields(line);
+    std::string field;
+    std::vector<std::pair<size_t, size_t>> pages; // (node, pages)
+    size_t page_bytes = 4096;
+    while (fields >> field) {
+      size_t eq = field.find('=');
+      if (eq == std::string::npos) { continue; }
+      std::string key = field.substr(0, eq);
+      size_t value = strtoul(field.c_str() + eq + 1, nullptr, 10);
+      if (key == "kernelpagesize_kB") {
+        page_bytes = value * 1024;
+      }
+      else if (key.size() > 1 && key[0] == 'N' &&
+               key.find_first_not_of("0123456789", 1) == std::string::npos) {
+        pages.emplace_back(strtoul(key.c_str() + 1, nullptr, 10), value);
+      }
+    }
+    for (auto const & p : pages) {
+      if (p.first >= bytes.size()) { bytes.resize(p.first + 1, 0); }
+      bytes[p.first] += p.second * page_bytes;
+    }
+  }
+  return bytes;
+}
+
+std::vector<size_t>
+artdaq::memoryPerNumaNode()
+{
+  std::ifstream file("/proc/self/numa_maps");
+  if (! file) { return std::vector<size_t>(); }
+  return parseNumaMaps(file);
+}
+
+artdaq::NumaPlacement::
+NumaPlacement()
+  :
+  node_(-1),
+  cores_()
+{
+}
+
+artdaq::NumaPlacement::
+NumaPlacement(fhicl::ParameterSet const & pset)
+  :
+  node_(pset.get<int>("node", -1)),
+  cores_()
+{
+  std::string interface = pset.get<std::string>("interface", "");
+  if (node_ < 0 && ! interface.empty()) {
+    node_ = numaNodeOfInterface(interface);
+    if (node_ < 0) {
+      mf::LogWarning("NumaPlacement") << "The NUMA node of interface " << interface
+                                      << " is not known; memory will not be placed.";
+    }
+  }
+  for (auto const & key : pset.get_keys()) {
+    if (key.size() > CORES_SUFFIX.size() &&
+        key.compare(key.size() - CORES_SUFFIX.size(), std::string::npos, CORES_SUFFIX) == 0) {
+      cores_[key.substr(0, key.size() - CORES_SUFFIX.size())] =
+        pset.get<std::vector<int>>(key);
+    }
+  }
+}
+
+artdaq::NumaPlacement::
+NumaPlacement(int node, std::map<std::string, std::vector<int>> const & cores)
+  :
+  node_(node),
+  cores_(cores)
+{
+}
+
+std::vector<int>
+artdaq::NumaPlacement::
+cores(std::string const & role) const
+{
+  auto it = cores_.find(role);
+  return it == cores_.end() ? std::vector<int>() : it->second;
+}
+
+void
+artdaq::NumaPlacement::
+apply(std::string const & role) const
+{
+  auto it = cores_.find(role);
+  if (it != cores_.end() && ! it->second.empty()) { pinTo(it->second, role); }
+  if (node_ >= 0) { preferNode(node_, role); }
+}
+
+artdaq::NumaMemoryReport::
+NumaMemoryReport()
+  :
+  enabled_(false),
+  interval_(),
+  next_()
+{
+}
+
+artdaq::NumaMemoryReport::
+NumaMemoryReport(fhicl::ParameterSet const & pset)
+  :
+  enabled_(pset.get<bool>("report_memory", false)),
+  interval_(std::chrono::seconds(pset.get<size_t>("report_memory_interval_sec", 60))),
+  next_()
+{
+}
+
+artdaq::NumaMemoryReport::
+NumaMemoryReport(std::chrono::steady_clock::duration interval)
+  :
+  enabled_(true),
+  interval_(interval),
+  next_()
+{
+}
+
+bool
+artdaq::NumaMemoryReport::
+due()
+{
+  if (! enabled_) { return false; }
+  auto now = std::chrono::steady_clock::now();
+  if (now < next_) { return false; }
+  next_ = now + interval_;
+  return true;
+}
+
+artdaq::ScopedThreadPlacement::
+ScopedThreadPlacement(NumaPlacement const & placement, std::string const & role)
+  :
+  restore_cores_(! placement.cores(role).empty()),
+  saved_cores_(),
+  restore_policy_(placement.node() >= 0),
+  saved_mode_(MPOL_DEFAULT),
+  saved_nodes_(MAX_NODES / (8 * sizeof(unsigned long)), 0)
+{
+  if (restore_cores_) {
+    restore_cores_ = pthread_getaffinity_np(pthread_self(), sizeof(saved_cores_),
+                                            &saved_cores_) == 0;
+  }
+  if (restore_policy_) {
+    restore_policy_ = getMempolicy(&saved_mode_, &saved_nodes_[0], MAX_NODES) == 0;
+  }
+  placement.apply(role);
+}
+
+artdaq::ScopedThreadPlacement::
+~ScopedThreadPlacement()
+{
+  if (restore_cores_) {
+    pthread_setaffinity_np(pthread_self(), sizeof(saved_cores_), &saved_cores_);
+  }
+  if (restore_policy_) {
+    if (saved_mode_ == MPOL_DEFAULT) {
+      setMempolicy(MPOL_DEFAULT, nullptr, 0);
+    }
+    else {
+      setMempolicy(saved_mode_, &saved_nodes_[0], MAX_NODES);
+    }
+  }
+}
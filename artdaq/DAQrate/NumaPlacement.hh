@@ -0,0 +1,134 @@
+#ifndef artdaq_DAQrate_NumaPlacement_hh
+#define artdaq_DAQrate_NumaPlacement_hh
+
+#include "fhiclcpp/fwd.h"
+
+#include <chrono>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+
+// Placement of a process's threads and memory on a NUMA machine, without
+// wrapping the whole process (as proto/numawrap does). A NumaPlacement
+// names the node whose memory the buffers should come from, typically
+// the one the network interface hangs off, and the cores on which each
+// role of thread ("receive", "assembly", "art", ...) should run.
+//
+// Memory follows the policy of the thread that first touches it, and
+// new threads inherit both the policy and the cores of the thread that
+// creates them; so placing the thread that creates the transport
+// buffers places them, and placing a thread around the creation of
+// others (see ScopedThreadPlacement) places those.
+//
+// Placement is best effort: on a machine without NUMA, or if the kernel
+// refuses, a warning is logged and the thread runs where it would have.
+
+namespace artdaq {
+  class NumaPlacement;
+  class ScopedThreadPlacement;
+  class NumaMemoryReport;
+
+  // The NUMA node of the named network interface, or -1 if it is not
+  // known (no such interface, or a machine without NUMA).
+  int numaNodeOfInterface(std::string const & interface);
+
+  // The bytes on each NUMA node, by node number, of the mappings listed
+  // in the given /proc/<pid>/numa_maps text.
+  std::vector<size_t> parseNumaMaps(std::istream & numa_maps);
+
+  // The bytes of this process's memory on each NUMA node, by node
+  // number; empty if it cannot be read. This walks the page tables of
+  // the whole process, so should not be called at high rate.
+  std::vector<size_t> memoryPerNumaNode();
+}
+
+class artdaq::NumaPlacement {
+public:
+  // No placement: apply() does nothing.
+  NumaPlacement();
+
+  // Configured from the "numa" table of a process's parameters:
+  //   node: the node for memory (default -1: leave it alone)
+  //   interface: a network interface whose node to use if node is not
+  //     given (e.g. "ib0")
+  //   <role>_cores: the cores for the threads of each role (default
+  //     empty: leave them alone)
+  explicit NumaPlacement(fhicl::ParameterSet const & pset);
+
+  NumaPlacement(int node, std::map<std::string, std::vector<int>> const & cores);
+
+  // The node for memory, or -1 for none.
+  int node() const;
+
+  // The cores for threads of the given role; empty if not configured.
+  std::vector<int> cores(std::string const & role) const;
+
+  // Run the calling thread on the cores of the given role, and have it
+  // take new memory from node(), for the rest of its life.
+  void apply(std::string const & role) const;
+
+private:
+  int node_;
+  std::map<std::string, std::vector<int>> cores_;
+};
+
+// Places the calling thread as NumaPlacement::apply() does while it is in
+// scope, then puts back its previous cores and memory policy; threads
+// started in between keep the placement.
+class artdaq::ScopedThreadPlacement {
+public:
+  ScopedThreadPlacement(NumaPlacement const & placement, std::string const & role);
+  ~ScopedThreadPlacement();
+
+  ScopedThreadPlacement(ScopedThreadPlacement const &) = delete;
+  ScopedThreadPlacement & operator=(ScopedThreadPlacement const &) = delete;
+
+private:
+  static const size_t MAX_NODES = 1024;
+
+  bool restore_cores_;
+  cpu_set_t saved_cores_;
+  bool restore_policy_;
+  int saved_mode_;
+  std::vector<unsigned long> saved_nodes_;
+};
+
+// When to report memoryPerNumaNode() from a metrics loop: at most once
+// per interval, since each reading walks the whole process's page tables
+// and the loop may be on the data path.
+class artdaq::NumaMemoryReport {
+public:
+  // Never due.
+  NumaMemoryReport();
+
+  // Configured from the same "numa" table as NumaPlacement:
+  //   report_memory: whether to report at all (default false)
+  //   report_memory_interval_sec: the least time between reports
+  //     (default 60)
+  explicit NumaMemoryReport(fhicl::ParameterSet const & pset);
+
+  // Due first at once, then every interval.
+  explicit NumaMemoryReport(std::chrono::steady_clock::duration interval);
+
+  // Whether a report is due now; if so, the next one is due an interval
+  // from now.
+  bool due();
+
+private:
+  bool enabled_;
+  std::chrono::steady_clock::duration interval_;
+  std::chrono::steady_clock::time_point next_;
+};
+
+inline
+int
+artdaq::NumaPlacement::
+node() const
+{
+  return node_;
+}
+
+#endif /* artdaq_DAQrate_NumaPlacement_hh */
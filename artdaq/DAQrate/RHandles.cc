@@ -1,8 +1,10 @@
 #include "artdaq/DAQrate/RHandles.hh"
 
 #include "art/Utilities/Exception.h"
+#include "artdaq/DAQrate/ClockOffset.hh"
 #include "artdaq/DAQrate/Perf.hh"
 #include "artdaq/DAQdata/Debug.hh"
+#include "artdaq/DAQrate/Locality.hh"
 #include "artdaq/DAQrate/MPITag.hh"
 #include "artdaq/DAQrate/Utils.hh"
 #include "cetlib/container_algorithms.h"
@@ -10,23 +12,71 @@
 #include "messagefacility/MessageLogger/MessageLogger.h"
 #include "trace.h"		// TRACE
 
+#include <chrono>
+#include <cstring>
+#include <sched.h>
+
 const size_t artdaq::RHandles::RECV_TIMEOUT = 0xfedcba98;
+const size_t artdaq::RHandles::CHUNK_RECEIVED = 0xfedcba99;
+const size_t artdaq::RHandles::MIN_SPIN_USEC = 2;
+const size_t artdaq::RHandles::MAX_SPIN_USEC = 200;
+const size_t artdaq::RHandles::MAX_IDLE_SLEEP_USEC = 100;
 
 artdaq::RHandles::RHandles(size_t buffer_count,
                            uint64_t max_payload_size,
                            size_t src_count,
-                           size_t src_start):
+                           size_t src_start,
+                           RHandlesOptions const & options):
   buffer_count_(buffer_count),
   max_payload_size_(max_payload_size),
+  buffer_bytes_((max_payload_size + detail::RawFragmentHeader::num_words()) *
+                sizeof(Fragment::value_type)),
   src_count_(src_count),
   src_start_(src_start),
+  probe_receives_(options.probe_receives),
+  next_probe_(0),
+  shm_rings_(),
+  next_ring_(0),
+  rma_channel_(),
+  rma_sources_(),
+  next_channel_(0),
+  tcp_receiver_(),
   recv_frag_count_(src_count, src_start),
   src_status_(src_count, status_t::SENDING),
   expected_count_(src_count, 0),
   reqs_(buffer_count_, MPI_REQUEST_NULL),
+  persistent_requests_(options.persistent_requests),
+  persistent_reqs_(options.persistent_requests ? buffer_count_ * src_count : 0,
+                   MPI_REQUEST_NULL),
   req_sources_(buffer_count_, MPI_ANY_SOURCE),
   last_source_posted_(-1),
-  payload_(buffer_count_)
+  fair_scheduling_(false),
+  min_posted_(0),
+  max_posted_(buffer_count),
+  posted_count_(src_count, 0),
+  posted_total_(0),
+  posts_receives_(false),
+  last_sequence_id_(src_count, 0),
+  clock_offsets_(),
+  last_send_time_(-1),
+  use_credits_(false),
+  credit_window_(0),
+  credit_limit_(0),
+  credits_outstanding_(src_count, 0),
+  credits_closed_(src_count, false),
+  credit_grants_(src_count, 0),
+  credit_close_(0),
+  grant_reqs_(src_count, MPI_REQUEST_NULL),
+  close_reqs_(src_count, MPI_REQUEST_NULL),
+  payload_(buffer_count_),
+  pending_(),
+  partial_(src_count),
+  saved_wait_result_(MPI_SUCCESS),
+  ready_indices_(buffer_count_, -1),
+  ready_statuses_(buffer_count_),
+  ready_pos_(0),
+  ready_count_(0),
+  spin_usec_(MIN_SPIN_USEC)
 {
   Debug << "RHandles construction: "
         << buffer_count << " buffers, "
@@ -40,84 +90,172 @@ artdaq::RHandles::RHandles(size_t buffer_count,
     throw art::Exception(art::errors::Configuration, "RHandles: ")
       << "No buffers configured.\n";
   }
+  if (options.tcp_port >= 0) {
+    // Every source comes over TCP: nothing to post.
+    // Reading ahead at most as many Fragments as we would post buffers.
+    tcp_receiver_.reset(new TCPReceiver(options.tcp_port, src_count_, src_start_,
+                                        buffer_count_));
+    Debug << "RHandles receiving over TCP on port "
+          << tcp_receiver_->port() << flusher;
+    return;
+  }
+  std::vector<int> mpi_sources;
+  if (options.shared_memory) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    // Room for buffer_count max-size Fragments, and never less than
+    // twice one, since a Fragment may have to skip the end of the ring.
+    size_t capacity = std::max(buffer_count_, size_t(2)) *
+      (max_payload_size_ + detail::RawFragmentHeader::num_words());
+    for (int idx = 0; idx < src_count_; ++idx) {
+      if (sameNode(idx + src_start_)) {
+        if (shm_rings_.empty()) { shm_rings_.resize(src_count_); }
+        shm_rings_[idx] = SharedMemoryRing::create(idx + src_start_, rank, capacity);
+      }
+      else {
+        mpi_sources.push_back(idx + src_start_);
+      }
+    }
+  }
+  else {
+    for (int idx = 0; idx < src_count_; ++idx) {
+      mpi_sources.push_back(idx + src_start_);
+    }
+  }
+  if (options.one_sided) {
+    // Created collectively with all the sources, including any using a
+    // ring, since they all take part; only the others use their slots.
+    size_t slot_count =
+      std::max<size_t>(buffer_count_ / std::max<size_t>(mpi_sources.size(), 1), 2);
+    size_t slot_words = max_payload_size_ + detail::RawFragmentHeader::num_words();
+    rma_channel_ = RMAChannel::forReceiver(src_count_, src_start_,
+                                           slot_count, slot_words);
+    rma_sources_.assign(src_count_, false);
+    for (int src : mpi_sources) {
+      rma_sources_[indexFromSource_(src)] = true;
+    }
+    mpi_sources.clear();
+  }
+  if (options.clock_sync_rounds > 0) {
+    // After any RMAChannel, which the sources set up first, and in
+    // increasing source rank order (see SHandles::enableLatencyStamps).
+    clock_offsets_.resize(src_count_);
+    for (int idx = 0; idx < src_count_; ++idx) {
+      clock_offsets_[idx] = measureClockOffset(idx + src_start_,
+                                               options.clock_sync_rounds);
+    }
+  }
+  if (probe_receives_) {
+#if MPI_VERSION >= 3
+    // Nothing to post: each message is received as it is probed.
+    return;
+#else
+    throw art::Exception(art::errors::Configuration, "RHandles: ")
+      << "Probed receives require MPI-3 (MPI_Improbe/MPI_Mrecv).\n";
+#endif
+  }
+  if (mpi_sources.empty()) {
+    return; // Every source has a ring: nothing to post.
+  }
   // Post all the buffers.
+  posts_receives_ = true;
   for (size_t i = 0; i < buffer_count_; ++i) {
     // make sure all buffers are the correct size
     payload_[i].resize(max_payload_size_);
     // Note that nextSource_() is not used here: it is not necessary to
     // check whether a source is DONE, and we avoid violating the
     // precondition of nextSource_().
-    post_(i, (i % src_count_) + src_start_);
+    post_(i, mpi_sources[i % mpi_sources.size()]);
   }
 }
 
 artdaq::RHandles::
 ~RHandles()
 {
+  if (use_credits_) {
+    // The sources wait for this before they finish.
+    for (int idx = 0; idx < src_count_; ++idx) {
+      if (viaMPI_(idx) && ! credits_closed_[idx]) { closeCredits_(idx); }
+    }
+    MPI_Waitall(src_count_, &grant_reqs_[0], MPI_STATUSES_IGNORE);
+    MPI_Waitall(src_count_, &close_reqs_[0], MPI_STATUSES_IGNORE);
+  }
   waitAll_();
+  for (auto & req : persistent_reqs_) {
+    if (req != MPI_REQUEST_NULL) { MPI_Request_free(&req); }
+  }
 }
 
 size_t
 artdaq::RHandles::
 recvFragment(Fragment & output, size_t timeout_usec)
 {
+  size_t src;
+  do {
+    src = recvMessage_(output, timeout_usec);
+  } while (src == CHUNK_RECEIVED);
+  return src;
+}
+
+size_t
+artdaq::RHandles::
+recvMessage_(Fragment & output, size_t timeout_usec)
+{
+  last_send_time_ = -1;
+  grantCredits_();
+  if (! pending_.empty()) {
+    return popPending_(output); // Left over from a batch.
+  }
   if (!anySourceActive()) {
     return MPI_ANY_SOURCE; // Nothing to do.
   }
+  if (tcp_receiver_) {
+    return recvTCP_(output, timeout_usec);
+  }
+  if (probe_receives_) {
+    return recvProbed_(output, timeout_usec);
+  }
   TRACE( 6,"recvFragment entered tmo=%lu us",timeout_usec  );
-  RecvMeas rm;
-  int wait_result;
-  int which;
-  MPI_Status status;
-
-  if (timeout_usec > 0) {
-    if (ready_indices_.size() == 0) {
-      ready_indices_.resize(buffer_count_, -1);
-      ready_statuses_.resize(buffer_count_);
-
-      int readyCount = 0;
-      wait_result = MPI_Testsome(buffer_count_, &reqs_[0], &readyCount,
-                                 &ready_indices_[0], &ready_statuses_[0]);
-      if (readyCount > 0) {
-        saved_wait_result_ = wait_result;
-        ready_indices_.resize(readyCount);
-        ready_statuses_.resize(readyCount);
+  if (! shm_rings_.empty() || rma_channel_) {
+    // Some sources come through rings or one-sided channels, which
+    // MPI_Waitany can not wait on, so poll them and the MPI receives
+    // together.
+    int ring_src = -1;
+    auto test = [&]() {
+      return pollRings_(output, ring_src) || pollChannels_(output, ring_src) ||
+        testReady_();
+    };
+    if (ready_pos_ == ready_count_ && ! test()) {
+      if (timeout_usec > 0) {
+        if (! waitFor_(timeout_usec, test)) {
+          return RECV_TIMEOUT;
+        }
       }
       else {
-        size_t sleep_loops = 10;
-        size_t sleep_time = timeout_usec / sleep_loops;
-        if (sleep_time > 250) {
-          sleep_time = 250;
-          sleep_loops = timeout_usec / sleep_time;
-        }
-        for (size_t idx = 0; idx < sleep_loops; ++idx) {
-          usleep(sleep_time);
-          wait_result = MPI_Testsome(buffer_count_, &reqs_[0], &readyCount,
-                                     &ready_indices_[0], &ready_statuses_[0]);
-          if (readyCount > 0) {break;}
-        }
-        if (readyCount > 0) {
-          saved_wait_result_ = wait_result;
-          ready_indices_.resize(readyCount);
-          ready_statuses_.resize(readyCount);
-        }
-        else {
-          ready_indices_.clear();
-          ready_statuses_.clear();
-        }
+        waitIdle_(test);
       }
     }
-    if (ready_indices_.size() > 0) {
-      wait_result = saved_wait_result_;
-      which = ready_indices_.front();
-      status = ready_statuses_.front();
-      ready_indices_.erase(ready_indices_.begin());
-      ready_statuses_.erase(ready_statuses_.begin());
+    if (ring_src >= 0) {
+      return ring_src;
     }
-    else {
+  }
+  RecvMeas rm;
+  int wait_result;
+  int which;
+  MPI_Status status;
+
+  if (ready_pos_ == ready_count_ && timeout_usec > 0) {
+    if (! waitFor_(timeout_usec, [this]() { return testReady_(); })) {
       return RECV_TIMEOUT;
     }
   }
+  if (ready_pos_ != ready_count_) {
+    // Take the next completed receive found by an earlier MPI_Testsome.
+    wait_result = saved_wait_result_;
+    which = ready_indices_[ready_pos_];
+    status = ready_statuses_[ready_pos_];
+    ++ready_pos_;
+  }
   else {
     wait_result = MPI_Waitany(buffer_count_, &reqs_[0], &which, &status);
   }
@@ -129,10 +267,17 @@ recvFragment(Fragment & output, size_t timeout_usec)
   if (which == MPI_UNDEFINED)
   { throw art::Exception(art::errors::LogicError, "RHandles: ")
       << "MPI_UNDEFINED returned as on index value from Waitany.\n"; }
-  if (reqs_[which] != MPI_REQUEST_NULL)
+  // (A completed persistent request stays allocated, just inactive.)
+  if (! persistent_requests_ && reqs_[which] != MPI_REQUEST_NULL)
   { throw art::Exception(art::errors::LogicError, "RHandles: ")
       << "INTERNAL ERROR: req is not MPI_REQUEST_NULL in recvFragment.\n"; }
-  Fragment::sequence_id_t sequence_id = payload_[which].sequenceID();
+  // Its receive is done, so the buffer is no longer posted, even if the
+  // message turns out to be bad and we throw before reposting it.
+  release_(which);
+  RawDataType const * buffer = &*payload_[which].headerBegin();
+  detail::RawFragmentHeader const & header =
+    *reinterpret_cast<detail::RawFragmentHeader const *>(buffer);
+  Fragment::sequence_id_t sequence_id = header.sequence_id;
   Debug << "recv: " << rank
         << " idx=" << which
         << " Waitany_error=" << wait_result
@@ -140,9 +285,9 @@ recvFragment(Fragment & output, size_t timeout_usec)
         << " source=" << status.MPI_SOURCE
         << " tag=" << status.MPI_TAG
         << " Fragment_sequenceID=" << sequence_id
-        << " Fragment_size=" << payload_[which].size()
-        << " preAutoResize_Fragment_dataSize=" << payload_[which].dataSize()
-        << " fragID=" << payload_[which].fragmentID()
+        << " buffer_bytes=" << buffer_bytes_
+        << " Fragment_words=" << header.word_count
+        << " fragID=" << header.fragment_id
         << flusher;
   char err_buffer[MPI_MAX_ERROR_STRING];
   int resultlen;
@@ -159,40 +304,413 @@ recvFragment(Fragment & output, size_t timeout_usec)
     mf::LogError("RHandles_WaitError")
       << "Waitany ERROR: " << err_buffer << "\n";
   }
-  // The Fragment at index 'which' is now available.
-  // Resize (down) to size to remove trailing garbage.
-  TRACE( 7, "recvFragment before autoResize/swap" );
-  payload_[which].autoResize();
-  output.swap(payload_[which]);
-  TRACE( 7, "recvFragment after autoResize/swap seqID=%lu. "
-	"Reset our buffer. max=%d adr=%p"
-	, output.sequenceID(), max_payload_size_, (void*)output.headerAddress() );
-  // Reset our buffer.
-  Fragment tmp(max_payload_size_);
-  TRACE( 7, "recvFragment before payload_[which].swap(tmp) adr=%p", (void*)tmp.headerAddress() );
-  payload_[which].swap(tmp);
-  TRACE( 7, "recvFragment after payload_[which].swap(tmp)" );
+  bool const batch = (status.MPI_TAG == MPITag::BATCH);
+  bool const chunk = (status.MPI_TAG == MPITag::INCOMPLETE);
+  if (batch || chunk ||
+      header.type != Fragment::EndOfDataFragmentType) {
+    spendCredit_(status.MPI_SOURCE); // EOD Fragments are sent without.
+  }
+  if (chunk) {
+    // Likewise for a piece of a large Fragment: copy it into place.
+    int byte_count = 0;
+    MPI_Get_count(&status, MPI_BYTE, &byte_count);
+    addChunk_(buffer, byte_count, status.MPI_SOURCE);
+  }
+  else if (batch) {
+    // Copy the packed Fragments out; the buffer itself can be reposted
+    // as is.
+    int byte_count = 0;
+    MPI_Get_count(&status, MPI_BYTE, &byte_count);
+    unpackBatch_(buffer, byte_count, status.MPI_SOURCE);
+  }
+  else {
+    readStamp_(buffer, status);
+    // Copy the Fragment out into one of exactly its size, keeping the
+    // buffer (and so any persistent request) for the next receive. The
+    // Fragment goes on to the EventStore and art and never comes back,
+    // so handing the buffer itself out would mean value-initializing a
+    // new max-size one in its place, which costs more than the copy.
+    size_t words = header.word_count;
+    output.resize(words - detail::RawFragmentHeader::num_words());
+    std::copy(buffer, buffer + words, output.headerBegin());
+    TRACE( 7, "recvFragment copied out of buffer %d seqID=%lu",
+           which, output.sequenceID() );
+  }
   // Performance measurement.
   rm.woke(sequence_id, which);
   // Fragment accounting.
+  if (! batch && ! chunk) {
+    countFragment_(output, status.MPI_SOURCE);
+  }
+  // Repost to receive more data.
+  int nextSource = sourceFor_(status.MPI_SOURCE);
+  if (nextSource != MPI_ANY_SOURCE) { // Else no eligible source: leave idle.
+    rm.post(nextSource);
+    post_(which, nextSource); // This buffer doesn't need cancelling.
+  }
+  if (src_status_[src_index] == status_t::DONE) { // Just happened.
+    cancelAndRepost_(status.MPI_SOURCE); // Cancel and possibly repost.
+  }
+  // This receive may have brought its source below its maximum, or
+  // the one behind the others forward.
+  postIdle_();
+  if (batch) {
+    return popPending_(output);
+  }
+  if (chunk) {
+    return pending_.empty() ? CHUNK_RECEIVED : popPending_(output);
+  }
+  return status.MPI_SOURCE;
+}
+
+bool
+artdaq::RHandles::
+testReady_()
+{
+  int readyCount = 0;
+  int wait_result = MPI_Testsome(buffer_count_, &reqs_[0], &readyCount,
+                                 &ready_indices_[0], &ready_statuses_[0]);
+  if (readyCount == MPI_UNDEFINED || readyCount <= 0) {
+    return false;
+  }
+  saved_wait_result_ = wait_result;
+  ready_pos_ = 0;
+  ready_count_ = readyCount;
+  return true;
+}
+
+template <typename TEST>
+bool
+artdaq::RHandles::
+waitFor_(size_t timeout_usec, TEST test)
+{
+  // Spin first: at high rates the next message is usually only a few
+  // microseconds away. The spin budget grows while messages keep
+  // arriving within it and shrinks when they do not, so an idle
+  // receiver soon stops burning the CPU.
+  typedef std::chrono::steady_clock clock;
+  auto const start = clock::now();
+  auto const deadline = start + std::chrono::microseconds(timeout_usec);
+  auto const spin_end =
+    start + std::chrono::microseconds(std::min(spin_usec_, timeout_usec));
+  do {
+    if (test()) {
+      spin_usec_ = std::min(spin_usec_ * 2, MAX_SPIN_USEC);
+      return true;
+    }
+  } while (clock::now() < spin_end);
+  spin_usec_ = std::max(spin_usec_ / 2, MIN_SPIN_USEC);
+
+  // Then keep testing until the deadline, yielding the processor
+  // between tests instead of sleeping: a sleep costs at least the
+  // timer slack (tens of microseconds) in latency on every wakeup.
+  while (clock::now() < deadline) {
+    sched_yield();
+    if (test()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename TEST>
+void
+artdaq::RHandles::
+waitIdle_(TEST test)
+{
+  size_t sleep_usec = 1;
+  while (! waitFor_(spin_usec_, test)) {
+    usleep(sleep_usec);
+    sleep_usec = std::min(sleep_usec * 2, MAX_IDLE_SLEEP_USEC);
+  }
+}
+
+size_t
+artdaq::RHandles::
+recvProbed_(Fragment & output, size_t timeout_usec)
+{
+#if MPI_VERSION >= 3
+  RecvMeas rm;
+  MPI_Message msg;
+  MPI_Status status;
+  int ring_src = -1;
+  auto test = [&]() {
+    return pollRings_(output, ring_src) || pollChannels_(output, ring_src) ||
+      probeActive_(msg, status);
+  };
+  bool found = test();
+  if (timeout_usec > 0) {
+    if (! found && ! waitFor_(timeout_usec, test)) {
+      return RECV_TIMEOUT;
+    }
+  }
+  else if (! found) {
+    // Probe the active sources in turn, rather than using MPI_Mprobe
+    // with MPI_ANY_SOURCE, so that only our sources are matched; that
+    // can not block.
+    waitIdle_(test);
+  }
+  if (ring_src >= 0) {
+    return ring_src;
+  }
+  int byte_count = 0;
+  MPI_Get_count(&status, MPI_BYTE, &byte_count);
+  size_t word_count = byte_count / sizeof(Fragment::value_type);
+  bool const chunk = (status.MPI_TAG == MPITag::INCOMPLETE);
+  size_t const min_words = chunk ? detail::ChunkHeader::num_words() + 1 :
+    detail::RawFragmentHeader::num_words();
+  if (word_count < min_words) {
+    throw art::Exception(art::errors::LogicError, "RHandles: ")
+      << "Probed message of " << byte_count << " bytes from source "
+      << status.MPI_SOURCE << " is too short to hold a Fragment.\n";
+  }
+  // (The last chunk of a Fragment may be shorter than a Fragment header.)
+  output.resize(std::max(word_count, detail::RawFragmentHeader::num_words()) -
+                detail::RawFragmentHeader::num_words());
+  TRACE( 8, "recvProbed_ src=%d bytes=%d", status.MPI_SOURCE, byte_count );
+  int result = MPI_Mrecv(&*output.headerBegin(), byte_count, MPI_BYTE,
+                         &msg, &status);
+  if (result != MPI_SUCCESS) {
+    char err_buffer[MPI_MAX_ERROR_STRING];
+    int resultlen;
+    MPI_Error_string(result, err_buffer, &resultlen);
+    mf::LogError("RHandles_WaitError")
+      << "Mrecv ERROR: " << err_buffer << "\n";
+  }
+  Debug << "recv (probed): source=" << status.MPI_SOURCE
+        << " tag=" << status.MPI_TAG
+        << " Fragment_sequenceID=" << output.sequenceID()
+        << " Fragment_size=" << output.size()
+        << " fragID=" << output.fragmentID()
+        << flusher;
+  rm.woke(output.sequenceID(), 0);
+  rm.post(status.MPI_SOURCE);
+  if (status.MPI_TAG != MPITag::FINAL ||
+      output.type() != Fragment::EndOfDataFragmentType) {
+    spendCredit_(status.MPI_SOURCE);
+  }
+  if (status.MPI_TAG == MPITag::BATCH) {
+    Fragment packed;
+    packed.swap(output);
+    unpackBatch_(&*packed.headerBegin(), byte_count, status.MPI_SOURCE);
+    return popPending_(output);
+  }
+  if (chunk) {
+    addChunk_(&*output.headerBegin(), byte_count, status.MPI_SOURCE);
+    return pending_.empty() ? CHUNK_RECEIVED : popPending_(output);
+  }
+  readStamp_(&*output.headerBegin(), status);
+  output.autoResize();
+  countFragment_(output, status.MPI_SOURCE);
+  return status.MPI_SOURCE;
+#else
+  (void) output;
+  (void) timeout_usec;
+  return RECV_TIMEOUT; // Unreachable: rejected at construction.
+#endif
+}
+
+size_t
+artdaq::RHandles::
+recvTCP_(Fragment & output, size_t timeout_usec)
+{
+  int src = tcp_receiver_->receive(output, timeout_usec);
+  if (src < 0) {
+    return RECV_TIMEOUT;
+  }
+  TRACE( 8, "recvTCP_ src=%d seqID=%lu", src, output.sequenceID() );
+  countFragment_(output, src);
+  return src;
+}
+
+#if MPI_VERSION >= 3
+bool
+artdaq::RHandles::
+probeActive_(MPI_Message & msg, MPI_Status & status)
+{
+  for (int n = 0; n < src_count_; ++n) {
+    int idx = (next_probe_ + n) % src_count_;
+    if (src_status_[idx] == status_t::DONE || ! viaMPI_(idx)) { continue; }
+    int flag = 0;
+    MPI_Improbe(idx + src_start_, MPI_ANY_TAG, MPI_COMM_WORLD,
+                &flag, &msg, &status);
+    if (flag) {
+      next_probe_ = (idx + 1) % src_count_;
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+bool
+artdaq::RHandles::
+pollRings_(Fragment & output, int & src)
+{
+  if (shm_rings_.empty()) { return false; }
+  for (int n = 0; n < src_count_; ++n) {
+    int idx = (next_ring_ + n) % src_count_;
+    SharedMemoryRing * ring = shm_rings_[idx].get();
+    if (ring == nullptr || src_status_[idx] == status_t::DONE ||
+        ring->empty()) { continue; }
+    if (ring->read(output)) {
+      next_ring_ = (idx + 1) % src_count_;
+      src = idx + src_start_;
+      TRACE( 8, "pollRings_ src=%d seqID=%lu", src, output.sequenceID() );
+      countFragment_(output, src);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+artdaq::RHandles::
+pollChannels_(Fragment & output, int & src)
+{
+  if (! rma_channel_) { return false; }
+  for (int n = 0; n < src_count_; ++n) {
+    int idx = (next_channel_ + n) % src_count_;
+    if (! rma_sources_[idx] || src_status_[idx] == status_t::DONE ||
+        ! rma_channel_->ready(idx)) { continue; }
+    if (rma_channel_->get(idx, output)) {
+      next_channel_ = (idx + 1) % src_count_;
+      src = idx + src_start_;
+      TRACE( 8, "pollChannels_ src=%d seqID=%lu", src, output.sequenceID() );
+      countFragment_(output, src);
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+artdaq::RHandles::
+unpackBatch_(RawDataType const * words, int byte_count, int src)
+{
+  size_t const header_words = detail::RawFragmentHeader::num_words();
+  size_t const total_words = byte_count / sizeof(Fragment::value_type);
+  size_t offset = 0;
+  while (offset < total_words) {
+    size_t word_count =
+      reinterpret_cast<detail::RawFragmentHeader const *>(words + offset)->word_count;
+    if (word_count < header_words || offset + word_count > total_words) {
+      throw art::Exception(art::errors::LogicError, "RHandles: ")
+        << "Corrupt batch of " << byte_count << " bytes from source "
+        << src << ": Fragment at word " << offset
+        << " claims " << word_count << " words.\n";
+    }
+    Fragment frag(word_count - header_words);
+    std::copy(words + offset, words + offset + word_count,
+              frag.headerBegin());
+    countFragment_(frag, src);
+    pending_.emplace_back(src, std::move(frag));
+    offset += word_count;
+  }
+  TRACE( 8, "unpackBatch_ src=%d nFrags=%lu", src, pending_.size() );
+}
+
+void
+artdaq::RHandles::
+readStamp_(RawDataType const * begin, MPI_Status const & status)
+{
+  if (clock_offsets_.empty()) { return; }
+  int byte_count = 0;
+  MPI_Get_count(const_cast<MPI_Status *>(&status), MPI_BYTE, &byte_count);
+  size_t words =
+    reinterpret_cast<detail::RawFragmentHeader const *>(begin)->word_count;
+  if (byte_count < static_cast<int>((words + 1) * sizeof(Fragment::value_type))) {
+    return; // Not stamped.
+  }
+  int64_t stamp;
+  memcpy(&stamp, begin + words, sizeof(stamp));
+  // Sent at stamp by the source's clock; convert it to ours.
+  last_send_time_ = stamp - clock_offsets_[indexFromSource_(status.MPI_SOURCE)];
+}
+
+void
+artdaq::RHandles::
+addChunk_(RawDataType const * words, int byte_count, int src)
+{
+  size_t const header_words = detail::RawFragmentHeader::num_words();
+  size_t const src_index = indexFromSource_(src);
+  detail::ChunkHeader const & chunk =
+    *reinterpret_cast<detail::ChunkHeader const *>(words);
+  size_t const chunk_words =
+    byte_count / sizeof(Fragment::value_type) - detail::ChunkHeader::num_words();
+  auto & streams = partial_[src_index];
+  auto found = streams.find(chunk.stream_id);
+  if (found == streams.end()) { // First chunk to complete, whichever it is.
+    if (chunk.total_words < header_words) {
+      throw art::Exception(art::errors::LogicError, "RHandles: ")
+        << "Chunk from source " << src << " claims a Fragment of "
+        << chunk.total_words << " words.\n";
+    }
+    found = streams.emplace(chunk.stream_id, Partial()).first;
+    found->second.frag.resize(chunk.total_words - header_words);
+  }
+  Fragment & frag = found->second.frag;
+  size_t & received = found->second.words;
+  if (chunk.total_words != frag.size() ||
+      chunk.offset_words + chunk_words > chunk.total_words) {
+    throw art::Exception(art::errors::LogicError, "RHandles: ")
+      << "Chunk of " << chunk_words << " words at word "
+      << chunk.offset_words << " of stream " << chunk.stream_id
+      << " from source " << src << " does not fit the Fragment of "
+      << frag.size() << " words being reassembled.\n";
+  }
+  std::copy(words + detail::ChunkHeader::num_words(),
+            words + detail::ChunkHeader::num_words() + chunk_words,
+            frag.headerBegin() + chunk.offset_words);
+  received += chunk_words;
+  TRACE( 8, "addChunk_ src=%d stream=%lu offset=%lu words=%lu of %lu", src,
+         (unsigned long)chunk.stream_id, (unsigned long)chunk.offset_words,
+         chunk_words, (unsigned long)chunk.total_words );
+  if (received == chunk.total_words) {
+    countFragment_(frag, src);
+    pending_.emplace_back(src, std::move(frag));
+    streams.erase(found);
+  }
+}
+
+size_t
+artdaq::RHandles::
+popPending_(Fragment & output)
+{
+  output.swap(pending_.front().second);
+  size_t src = pending_.front().first;
+  pending_.pop_front();
+  return src;
+}
+
+void
+artdaq::RHandles::
+countFragment_(Fragment const & output, int src)
+{
+  size_t src_index(indexFromSource_(src));
   if (output.type() == Fragment::EndOfDataFragmentType) {
     src_status_[src_index] = status_t::PENDING;
     expected_count_[src_index] = *output.dataBegin();
-    Debug << "Received EOD from source " << status.MPI_SOURCE
+    Debug << "Received EOD from source " << src
           << " (index " << src_index << ") expecting total of "
           << *output.dataBegin() << " fragments" << flusher;
+    if (use_credits_ && viaMPI_(src_index) && ! credits_closed_[src_index]) {
+      closeCredits_(src_index); // Nothing more will be sent.
+    }
   }
   else {
-    recv_frag_count_.incSlot(status.MPI_SOURCE);
+    recv_frag_count_.incSlot(src);
+    last_sequence_id_[src_index] =
+      std::max(last_sequence_id_[src_index], output.sequenceID());
   }
   switch (src_status_[src_index]) {
   case status_t::PENDING:
     Debug << "Checking received count "
-          << recv_frag_count_.slotCount(status.MPI_SOURCE)
+          << recv_frag_count_.slotCount(src)
           << " against expected total "
           << expected_count_[src_index]
           << flusher;
-    if (recv_frag_count_.slotCount(status.MPI_SOURCE) ==
+    if (recv_frag_count_.slotCount(src) ==
         expected_count_[src_index]) {
       src_status_[src_index] = status_t::DONE;
     }
@@ -200,7 +718,7 @@ recvFragment(Fragment & output, size_t timeout_usec)
   case status_t::DONE:
     throw art::Exception(art::errors::LogicError, "RHandles: ")
       << "Received extra fragments from source "
-      << status.MPI_SOURCE
+      << src
       << ".\n";
   case status_t::SENDING:
     break;
@@ -210,23 +728,6 @@ recvFragment(Fragment & output, size_t timeout_usec)
       << static_cast<int>(src_status_[src_index])
       << ".\n";
   }
-  // Repost to receive more data.
-  if (src_status_[src_index] == status_t::DONE) { // Just happened.
-    int nextSource = nextSource_();
-    if (nextSource == MPI_ANY_SOURCE) { // No active sources left.
-      req_sources_[which] = MPI_ANY_SOURCE; // Done with this buffer.
-    }
-    else { // Post for input from a still-active source.
-      rm.post(nextSource);
-      post_(which, nextSource); // This buffer doesn't need cancelling.
-    }
-    cancelAndRepost_(status.MPI_SOURCE); // Cancel and possibly repost.
-  }
-  else {
-    rm.post(status.MPI_SOURCE);
-    post_(which, status.MPI_SOURCE);
-  }
-  return status.MPI_SOURCE;
 }
 
 void
@@ -251,6 +752,9 @@ nextSource_()
   for (int result = (last_index + 1) % src_count_;
        result != last_index;
        result = (result + 1) % src_count_) {
+    if (! viaMPI_(result)) {
+      continue; // Read from its ring or channel, not posted for.
+    }
     if (src_status_[result] != status_t::DONE) {
       return result + src_start_;
     }
@@ -310,21 +814,231 @@ artdaq::RHandles::
 post_(size_t buf, size_t src)
 {
   Debug << "Posting buffer " << buf
-        << " size=" << payload_[buf].size()
+        << " bytes=" << buffer_bytes_
         << " for receive src=" << src
-        << " header address=0x" << std::hex << payload_[buf].headerAddress() << std::dec
+        << " header address=0x" << std::hex << &*payload_[buf].headerBegin() << std::dec
         << flusher;
-  MPI_Irecv(&*payload_[buf].headerBegin(),
-            (payload_[buf].size() * sizeof(Fragment::value_type)),
-            MPI_BYTE,
-            src,
-            MPI_ANY_TAG,
-            MPI_COMM_WORLD,
-            &reqs_[buf]);
+  if (persistent_requests_) {
+    // One request per buffer and source, so moving a buffer from one
+    // source to another (as fair scheduling does all the time) never
+    // makes a new one. The buffers themselves never move.
+    MPI_Request & req =
+      persistent_reqs_[buf * src_count_ + indexFromSource_(src)];
+    if (req == MPI_REQUEST_NULL) {
+      MPI_Recv_init(&*payload_[buf].headerBegin(), buffer_bytes_, MPI_BYTE, src,
+                    MPI_ANY_TAG, MPI_COMM_WORLD, &req);
+    }
+    // Completing a persistent request leaves its handle as it is, so
+    // reqs_ can hold a copy for MPI_Waitany.
+    reqs_[buf] = req;
+    MPI_Start(&reqs_[buf]);
+  }
+  else {
+    MPI_Irecv(&*payload_[buf].headerBegin(),
+              buffer_bytes_,
+              MPI_BYTE,
+              src,
+              MPI_ANY_TAG,
+              MPI_COMM_WORLD,
+              &reqs_[buf]);
+  }
+  if (req_sources_[buf] != MPI_ANY_SOURCE) {
+    --posted_count_[indexFromSource_(req_sources_[buf])];
+  }
+  else {
+    ++posted_total_;
+  }
+  ++posted_count_[indexFromSource_(src)];
   req_sources_[buf] = src;
   last_source_posted_ = src;
 }
 
+void
+artdaq::RHandles::
+postIdle_()
+{
+  if (! posts_receives_) { return; }
+  for (size_t i = 0; i < buffer_count_ && posted_total_ < buffer_count_; ++i) {
+    if (req_sources_[i] != MPI_ANY_SOURCE) { continue; }
+    int src = sourceFor_(MPI_ANY_SOURCE);
+    if (src == MPI_ANY_SOURCE) { return; } // Nobody may have another.
+    post_(i, src);
+  }
+}
+
+void
+artdaq::RHandles::
+release_(size_t buf)
+{
+  if (req_sources_[buf] != MPI_ANY_SOURCE) {
+    --posted_count_[indexFromSource_(req_sources_[buf])];
+    --posted_total_;
+    req_sources_[buf] = MPI_ANY_SOURCE;
+  }
+}
+
+int
+artdaq::RHandles::
+sourceFor_(int last_src)
+{
+  if (! fair_scheduling_) {
+    // Keep the buffer with its last source while that is still active.
+    if (last_src != MPI_ANY_SOURCE &&
+        src_status_[indexFromSource_(last_src)] != status_t::DONE) {
+      return last_src;
+    }
+    return nextSource_();
+  }
+  // Favour sources below their minimum, then the one furthest behind:
+  // the oldest incomplete events are waiting for its Fragments. Ties go
+  // to the source with the fewest buffers.
+  int best = -1;
+  bool best_below_min = false;
+  for (int idx = 0; idx < src_count_; ++idx) {
+    if (src_status_[idx] == status_t::DONE || ! viaMPI_(idx) ||
+        posted_count_[idx] >= max_posted_) {
+      continue;
+    }
+    bool below_min = posted_count_[idx] < min_posted_;
+    if (best < 0 || (below_min && ! best_below_min) ||
+        (below_min == best_below_min &&
+         (last_sequence_id_[idx] < last_sequence_id_[best] ||
+          (last_sequence_id_[idx] == last_sequence_id_[best] &&
+           posted_count_[idx] < posted_count_[best])))) {
+      best = idx;
+      best_below_min = below_min;
+    }
+  }
+  return best < 0 ? MPI_ANY_SOURCE : best + src_start_;
+}
+
+void
+artdaq::RHandles::
+setSourceQuotas(size_t min_buffers, size_t max_buffers)
+{
+  size_t mpi_sources = 0;
+  for (int idx = 0; idx < src_count_; ++idx) {
+    if (viaMPI_(idx)) { ++mpi_sources; }
+  }
+  if (max_buffers == 0) { max_buffers = buffer_count_; }
+  if (min_buffers > max_buffers || min_buffers * mpi_sources > buffer_count_) {
+    throw art::Exception(art::errors::Configuration, "RHandles: ")
+      << "Cannot give each of " << mpi_sources << " sources between "
+      << min_buffers << " and " << max_buffers << " of "
+      << buffer_count_ << " buffers.\n";
+  }
+  fair_scheduling_ = true;
+  min_posted_ = min_buffers;
+  max_posted_ = max_buffers;
+  // Sources over their new maximum give up the excess as those receives
+  // complete: cancelling them could lose a message already matched.
+  // Idle buffers, though, may now have takers.
+  postIdle_();
+}
+
+void
+artdaq::RHandles::
+useCredits(size_t window)
+{
+  if (tcp_receiver_) {
+    return;
+  }
+  size_t mpi_sources = 0;
+  for (int idx = 0; idx < src_count_; ++idx) {
+    if (viaMPI_(idx)) { ++mpi_sources; }
+  }
+  if (mpi_sources == 0) {
+    return; // Rings and one-sided channels are bounded already.
+  }
+  use_credits_ = true;
+  credit_window_ = window;
+  credit_limit_ = window > 0 ? window : buffer_count_;
+  grantCredits_();
+}
+
+size_t
+artdaq::RHandles::
+creditWindow() const
+{
+  if (! use_credits_) { return 0; }
+  if (credit_window_ > 0) { return credit_window_; }
+  size_t most = 0;
+  for (int idx = 0; idx < src_count_; ++idx) {
+    if (viaMPI_(idx)) { most = std::max(most, creditAllowance_(idx)); }
+  }
+  return most;
+}
+
+size_t
+artdaq::RHandles::
+creditAllowance_(int idx) const
+{
+  if (credit_window_ > 0) { return credit_window_; }
+  // A source with no receive posted may still send one message, which
+  // waits for a buffer to come its way.
+  return std::max<size_t>(posted_count_[idx], 1);
+}
+
+void
+artdaq::RHandles::
+setCreditLimit(size_t limit)
+{
+  credit_limit_ = limit;
+  grantCredits_();
+}
+
+void
+artdaq::RHandles::
+grantCredits_()
+{
+  if (! use_credits_) { return; }
+  for (int idx = 0; idx < src_count_; ++idx) {
+    if (! viaMPI_(idx) || credits_closed_[idx] ||
+        src_status_[idx] != status_t::SENDING) {
+      continue;
+    }
+    size_t const allowance = std::min(creditAllowance_(idx), credit_limit_);
+    size_t const held = credits_outstanding_[idx];
+    if (held >= allowance) { continue; }
+    // Top up in steps of at least half the allowance, to keep the grants
+    // few, unless the source has run out.
+    uint64_t grant = allowance - held;
+    if (held > 0 && grant < (allowance + 1) / 2) { continue; }
+    if (grant_reqs_[idx] != MPI_REQUEST_NULL) {
+      // Its last grant is still on its way; top up on a later call.
+      int done = 0;
+      MPI_Test(&grant_reqs_[idx], &done, MPI_STATUS_IGNORE);
+      if (! done) { continue; }
+    }
+    credit_grants_[idx] = grant;
+    MPI_Isend(&credit_grants_[idx], sizeof(grant), MPI_BYTE, idx + src_start_,
+              MPITag::CREDIT, MPI_COMM_WORLD, &grant_reqs_[idx]);
+    credits_outstanding_[idx] += grant;
+    TRACE( 8, "grantCredits_ src=%d grant=%lu", idx + src_start_,
+           (unsigned long)grant );
+  }
+}
+
+void
+artdaq::RHandles::
+spendCredit_(int src)
+{
+  if (! use_credits_) { return; }
+  size_t & held = credits_outstanding_[indexFromSource_(src)];
+  if (held > 0) { --held; }
+}
+
+void
+artdaq::RHandles::
+closeCredits_(int idx)
+{
+  // A zero grant: no more to come. It arrives after any grant still in
+  // flight, as messages with the same tag do not overtake each other.
+  MPI_Isend(&credit_close_, sizeof(credit_close_), MPI_BYTE, idx + src_start_,
+            MPITag::CREDIT, MPI_COMM_WORLD, &close_reqs_[idx]);
+  credits_closed_[idx] = true;
+}
+
 void
 artdaq::RHandles::
 cancelAndRepost_(size_t src)
@@ -332,11 +1046,9 @@ cancelAndRepost_(size_t src)
   for (size_t i = 0; i < buffer_count_; ++i) {
     if (static_cast<int>(src) == req_sources_[i]) {
       cancelReq_(i);
-      int nextSource = nextSource_();
-      if (nextSource == MPI_ANY_SOURCE) { // Done.
-        req_sources_[i] = MPI_ANY_SOURCE;
-      }
-      else { // Still busy.
+      release_(i);
+      int nextSource = sourceFor_(MPI_ANY_SOURCE);
+      if (nextSource != MPI_ANY_SOURCE) { // Still busy.
         post_(i, nextSource);
       }
     }
@@ -3,9 +3,17 @@
 
 #include "artdaq-core/Data/Fragment.hh"
 #include "artdaq-core/Data/Fragments.hh"
+#include "artdaq/DAQrate/RMAChannel.hh"
+#include "artdaq/DAQrate/SharedMemoryRing.hh"
+#include "artdaq/DAQrate/TCPTransport.hh"
+#include "artdaq/DAQrate/detail/ChunkHeader.hh"
 #include "artdaq/DAQrate/detail/FragCounter.hh"
 
 #include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include "artdaq/DAQrate/quiet_mpi.hh"
@@ -21,27 +29,133 @@
 
 namespace artdaq {
   class RHandles;
+  struct RHandlesOptions;
 }
 
+// How an RHandles receives; the defaults post two-sided MPI receives
+// for every source.
+struct artdaq::RHandlesOptions {
+  RHandlesOptions() :
+    probe_receives(false),
+    shared_memory(false),
+    tcp_port(-1),
+    one_sided(false),
+    persistent_requests(false),
+    clock_sync_rounds(0)
+  { }
+
+  // If probe_receives is true, no receives are posted in advance:
+  // recvFragment() probes for the next message (MPI_Improbe) and
+  // receives it (MPI_Mrecv) into a Fragment sized exactly for it, so
+  // max_payload_size only bounds what senders may send and no memory is
+  // pinned per buffer. This requires an MPI-3 implementation.
+  bool probe_receives;
+
+  // If shared_memory is true, a SharedMemoryRing is created for each
+  // source on the same node (see Locality.hh), and those sources are
+  // read from their rings rather than through MPI; they must send with
+  // an SHandles created with shared_memory as well.
+  bool shared_memory;
+
+  // If tcp_port is not negative, every source is received over TCP on
+  // that port instead (0 picks a free one; see RHandles::tcpPort()), and
+  // MPI is not used at all: the other options are then ignored. The
+  // sources must send with SHandles::useTCP().
+  int tcp_port;
+
+  // If one_sided is true, the sources that would otherwise be received
+  // through two-sided MPI put their Fragments directly into an
+  // RMAChannel window instead, and no receives are posted for them.
+  // Each such source gets buffer_count / (number of such sources)
+  // slots, but at least two. The sources must send with an SHandles on
+  // which useOneSided() has been called. This requires MPI-3.
+  bool one_sided;
+
+  // If persistent_requests is true, the receives posted in advance use
+  // a persistent request per buffer and source (MPI_Recv_init once, then
+  // MPI_Start for each message) instead of a new MPI_Irecv each time,
+  // which pays off for small Fragments. Either way the receive buffers
+  // stay in place at full size, and recvFragment() copies each Fragment
+  // out of them.
+  bool persistent_requests;
+
+  // If clock_sync_rounds is not zero, the offset of each source's clock
+  // from ours is estimated with that many MPI pings (see ClockOffset.hh)
+  // before any receive is posted, and RHandles::lastSendTime() reports
+  // when each Fragment stamped by the source was sent. The sources must
+  // call SHandles::enableLatencyStamps() with the same number of rounds.
+  size_t clock_sync_rounds;
+};
+
+
 class artdaq::RHandles {
 public:
   static const size_t RECV_TIMEOUT;
 
+  // Receive from the src_count ranks starting at src_start into
+  // buffer_count buffers of max_payload_size words, as set out in
+  // options.
   RHandles(size_t buffer_count,
            uint64_t max_payload_size,
            size_t src_count,
-           size_t src_start);
+           size_t src_start,
+           RHandlesOptions const & options = RHandlesOptions());
   ~RHandles();
 
   // recvFragment() puts the next received fragment in frag, with the
-  // source of that fragment as its return value.
+  // source of that fragment as its return value. A Fragment larger than
+  // max_payload_size, sent in chunks, is returned once all its chunks
+  // have arrived; timeout_usec then applies to each chunk in turn.
   //
   // It is a precondition that a sources_sending() != 0.
   size_t recvFragment(Fragment & frag, size_t timeout_usec = 0);
 
+  // Hand out freed receive buffers by need rather than keeping each
+  // with the source that last used it: every source reached through
+  // two-sided MPI keeps at least min_buffers and at most max_buffers
+  // (0 for no limit) posted, and otherwise buffers go to the source
+  // whose latest Fragment has the lowest sequence ID, since the oldest
+  // incomplete events are waiting on it. A source holding more than
+  // max_buffers when this is called gives up the excess as those
+  // receives complete.
+  void setSourceQuotas(size_t min_buffers, size_t max_buffers);
+
+  // Number of receives currently posted for the source of the given rank.
+  size_t postedBuffers(size_t rank) const;
+
+  // Let each source received through two-sided MPI have at most window
+  // messages (single Fragments, batches or chunks) in flight to us at
+  // once, by granting it credits, which recvFragment() tops up as its
+  // messages arrive; 0 keeps each source's credits to the receives
+  // posted for it (at least one), so that every message has a buffer
+  // waiting, and follows them as they move. Grants to a source
+  // are closed once its EOD Fragment arrives, or at destruction. Does
+  // nothing over TCP. The sources must send with SHandles::useCredits().
+  void useCredits(size_t window);
+
+  // From now on, top up each source's credits only to limit, if that is
+  // below the window: e.g. to the free capacity downstream, or zero to
+  // stop the sources once the credits already granted are spent. Those
+  // cannot be taken back, so up to a window more messages per source may
+  // still arrive. While sources wait for credit, recvFragment() should be
+  // given a timeout, and this called again as capacity frees up.
+  void setCreditLimit(size_t limit);
+
+  // Most credits any source can currently hold (0 if credits are not
+  // in use).
+  size_t creditWindow() const;
+
+  // When the Fragment last returned by recvFragment() was sent, in
+  // nanoseconds of our steadyClockNanoseconds(), corrected for the
+  // source's clock offset; -1 if it was not stamped.
+  int64_t lastSendTime() const;
+
   // Number of sources still not done.
   size_t sourcesActive() const;
 
+  // Port receiving over TCP, or -1 if TCP is not in use.
+  int tcpPort() const;
+
   // Are any sources still active (faster)?
   bool anySourceActive() const;
 
@@ -60,24 +174,143 @@ private:
   void cancelReq_(size_t buf, bool blocking_wait = true);
   void post_(size_t buf, size_t src);
   void cancelAndRepost_(size_t src);
+  // Forget the source of buffer buf, whose receive is complete or cancelled.
+  void release_(size_t buf);
+  // The source to post a freed buffer for, last used by last_src (or
+  // MPI_ANY_SOURCE); MPI_ANY_SOURCE if none should have it.
+  int sourceFor_(int last_src);
+  // Post the buffers left idle, when no source could have them, to
+  // any source that now can.
+  void postIdle_();
+  void countFragment_(Fragment const & output, int src);
+  // Most credits the source at this index may hold (see useCredits()).
+  size_t creditAllowance_(int idx) const;
+  // Grant credits to each source below its allowance, unless its last
+  // grant is still being sent.
+  void grantCredits_();
+  // A message from src has arrived, using one of its credits.
+  void spendCredit_(int src);
+  // Tell the source at this index that it will get no more credits.
+  void closeCredits_(int idx);
+  void unpackBatch_(RawDataType const * packed, int byte_count, int src);
+  // Copy a chunk (see ChunkHeader.hh) into the source's partial
+  // Fragment; once that is complete, count it and queue it in pending_.
+  void addChunk_(RawDataType const * buffer, int byte_count, int src);
+  // Take the send time stamped after the Fragment in buffer, if any.
+  void readStamp_(RawDataType const * buffer, MPI_Status const & status);
+  // Receive and handle one message: the source of the Fragment put in
+  // output, RECV_TIMEOUT, or CHUNK_RECEIVED if a chunk came in but no
+  // Fragment is complete yet.
+  size_t recvMessage_(Fragment & output, size_t timeout_usec);
+  size_t popPending_(Fragment & output);
+
+  // Wait up to timeout_usec for test() to return true: spin for an
+  // adaptive interval, then test between yields of the processor.
+  template <typename TEST>
+  bool waitFor_(size_t timeout_usec, TEST test);
+  // Wait as long as it takes for test() to return true: spin for the
+  // adaptive interval, then sleep with backoff between rounds, so an
+  // idle receiver does not hold a core.
+  template <typename TEST>
+  void waitIdle_(TEST test);
+  // Refill the ready ring from MPI_Testsome; true if anything completed.
+  bool testReady_();
+
+  size_t recvProbed_(Fragment & output, size_t timeout_usec);
+  size_t recvTCP_(Fragment & output, size_t timeout_usec);
+  // Read the next Fragment from any active source's ring into output;
+  // true (with src set) if there was one.
+  bool pollRings_(Fragment & output, int & src);
+  // The same for the sources putting into the RMAChannel.
+  bool pollChannels_(Fragment & output, int & src);
+  // Is the source at this index received through two-sided MPI?
+  bool viaMPI_(int idx) const;
+#if MPI_VERSION >= 3
+  bool probeActive_(MPI_Message & msg, MPI_Status & status);
+#endif
 
   size_t buffer_count_;
   int max_payload_size_;
+  // Posted with every receive; not payload_[buf].size(), which is the
+  // word count in the header of whatever the buffer last received.
+  int const buffer_bytes_;
   int src_count_;
   int src_start_; // Start of the source ranks.
+  bool const probe_receives_;
+  int next_probe_; // Index of the next source to probe.
+  // Rings of the sources on this node, by source index (null for
+  // sources reached through MPI); empty if no source uses one.
+  std::vector<std::unique_ptr<SharedMemoryRing>> shm_rings_;
+  int next_ring_; // Index of the next source ring to poll.
+  // Window the one_sided sources put into (null if there is none), and
+  // which sources, by index, use it.
+  std::unique_ptr<RMAChannel> rma_channel_;
+  std::vector<bool> rma_sources_;
+  int next_channel_; // Index of the next source to poll in the window.
+  std::unique_ptr<TCPReceiver> tcp_receiver_; // Null unless receiving over TCP.
   detail::FragCounter recv_frag_count_; // Number of frags received per source.
   std::vector<status_t> src_status_; // Status of each sender.
   std::vector<size_t> expected_count_; // After EOD received: expected frags.
 
   std::vector<MPI_Request> reqs_; // Request to fill each buffer.
+  bool const persistent_requests_;
+  // With persistent_requests, the request for each buffer and source
+  // index (at buf * src_count_ + index), made when first posted.
+  std::vector<MPI_Request> persistent_reqs_;
   std::vector<int> req_sources_; // Source for each request.
   int last_source_posted_;
+  bool fair_scheduling_; // See setSourceQuotas().
+  size_t min_posted_;
+  size_t max_posted_;
+  std::vector<size_t> posted_count_; // Posted receives, by source index.
+  size_t posted_total_; // Posted receives, in all.
+  bool posts_receives_; // Whether the buffers are posted at all.
+  // Highest sequence ID received, by source index.
+  std::vector<Fragment::sequence_id_t> last_sequence_id_;
+  // Each source's clock minus ours, in ns (empty unless measured).
+  std::vector<int64_t> clock_offsets_;
+  int64_t last_send_time_;
+  bool use_credits_;
+  size_t credit_window_; // Zero to follow the receives posted.
+  size_t credit_limit_;
+  // Credits granted but not yet used, and whether grants have been
+  // closed, by source index.
+  std::vector<size_t> credits_outstanding_;
+  std::vector<bool> credits_closed_;
+  // The latest grant to each source index, and the sends of it and of
+  // the closing zero grant; the buffers stay put until those complete.
+  std::vector<uint64_t> credit_grants_;
+  uint64_t credit_close_;
+  std::vector<MPI_Request> grant_reqs_;
+  std::vector<MPI_Request> close_reqs_;
 
   Fragments payload_;
+  // Fragments unpacked from a batch but not yet handed out, with source.
+  std::deque<std::pair<int, Fragment>> pending_;
+  // A Fragment being reassembled from chunks, and how many of its words
+  // have arrived.
+  struct Partial {
+    Partial() : frag(), words(0) { }
+    Fragment frag;
+    size_t words;
+  };
+  // Those under way, by source index and then by the chunk stream they
+  // came in (see ChunkHeader.hh).
+  std::vector<std::map<uint64_t, Partial>> partial_;
 
+  // Completed receives found by MPI_Testsome, consumed in order from
+  // ready_pos_ up to ready_count_.
   int saved_wait_result_;
   std::vector<int> ready_indices_;
   std::vector<MPI_Status> ready_statuses_;
+  size_t ready_pos_;
+  size_t ready_count_;
+
+  static const size_t CHUNK_RECEIVED;
+  static const size_t MIN_SPIN_USEC;
+  static const size_t MAX_SPIN_USEC;
+  static const size_t MAX_IDLE_SLEEP_USEC; // Between rounds of waitIdle_().
+  size_t spin_usec_; // Current spin budget for timed receives.
 };
 
 inline
@@ -112,6 +345,39 @@ sourcesPending() const
                     status_t::PENDING);
 }
 
+inline
+int
+artdaq::RHandles::
+tcpPort() const
+{
+  return tcp_receiver_ ? tcp_receiver_->port() : -1;
+}
+
+inline
+int64_t
+artdaq::RHandles::
+lastSendTime() const
+{
+  return last_send_time_;
+}
+
+inline
+size_t
+artdaq::RHandles::
+postedBuffers(size_t rank) const
+{
+  return posted_count_[indexFromSource_(rank)];
+}
+
+inline
+bool
+artdaq::RHandles::
+viaMPI_(int idx) const
+{
+  return (shm_rings_.empty() || ! shm_rings_[idx]) &&
+    (rma_sources_.empty() || ! rma_sources_[idx]);
+}
+
 inline
 size_t
 artdaq::RHandles::
@@ -0,0 +1,260 @@
+#include "artdaq/DAQrate/RMAChannel.hh"
+
+#include "artdaq/DAQrate/MPITag.hh"
+#include "cetlib/exception.h"
+#include "trace.h"		// TRACE
+
+#include <algorithm>
+#include <numeric>
+
+namespace {
+  // Layout of the receiver's window, in 64-bit words: the slot geometry,
+  // a head and a tail counter per sender, then each sender's slot_count
+  // slots of slot_words each.
+  enum ControlWord : size_t { SLOT_COUNT = 0, SLOT_WORDS = 1, FIRST_COUNTER = 2 };
+}
+
+std::unique_ptr<artdaq::RMAChannel>
+artdaq::RMAChannel::
+forSender(MPI_Comm sender_comm, int dest_rank)
+{
+  // The senders' world ranks, in increasing order, as the receiver
+  // lists them.
+  int size;
+  MPI_Comm_size(sender_comm, &size);
+  std::vector<int> local(size);
+  std::iota(local.begin(), local.end(), 0);
+  std::vector<int> src_ranks(size);
+  MPI_Group sender_group, world_group;
+  MPI_Comm_group(sender_comm, &sender_group);
+  MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+  MPI_Group_translate_ranks(sender_group, size, &local[0], world_group, &src_ranks[0]);
+  MPI_Group_free(&sender_group);
+  MPI_Group_free(&world_group);
+  std::sort(src_ranks.begin(), src_ranks.end());
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  int src_index = std::find(src_ranks.begin(), src_ranks.end(), rank) - src_ranks.begin();
+  return std::unique_ptr<RMAChannel>
+    (new RMAChannel(src_ranks, dest_rank, src_index, 0, 0));
+}
+
+std::unique_ptr<artdaq::RMAChannel>
+artdaq::RMAChannel::
+forReceiver(size_t src_count, size_t src_start, size_t slot_count,
+            size_t slot_words)
+{
+  if (slot_count == 0 || slot_words < detail::RawFragmentHeader::num_words()) {
+    throw cet::exception("Configuration")
+      << "RMAChannel needs at least one slot able to hold a Fragment header.";
+  }
+  std::vector<int> src_ranks(src_count);
+  std::iota(src_ranks.begin(), src_ranks.end(), static_cast<int>(src_start));
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  return std::unique_ptr<RMAChannel>
+    (new RMAChannel(src_ranks, rank, -1, slot_count, slot_words));
+}
+
+inline
+MPI_Aint
+artdaq::RMAChannel::
+headDisp_(size_t src_index) const
+{
+  return (FIRST_COUNTER + 2 * src_index) * sizeof(uint64_t);
+}
+
+inline
+MPI_Aint
+artdaq::RMAChannel::
+tailDisp_(size_t src_index) const
+{
+  return (FIRST_COUNTER + 2 * src_index + 1) * sizeof(uint64_t);
+}
+
+inline
+MPI_Aint
+artdaq::RMAChannel::
+slotDisp_(size_t src_index, uint64_t count) const
+{
+  return (FIRST_COUNTER + 2 * src_count_ +
+          (src_index * slot_count_ + count % slot_count_) * slot_words_) *
+    sizeof(uint64_t);
+}
+
+#if MPI_VERSION >= 3
+
+artdaq::RMAChannel::
+RMAChannel(std::vector<int> const & src_ranks, int dest_rank, int src_index,
+           size_t slot_count, size_t slot_words)
+  :
+  src_index_(src_index),
+  src_count_(src_ranks.size()),
+  dest_(src_ranks.size()),
+  comm_(MPI_COMM_NULL),
+  win_(MPI_WIN_NULL),
+  base_(nullptr),
+  slot_count_(slot_count),
+  slot_words_(slot_words),
+  head_(src_index < 0 ? src_ranks.size() : 1, 0),
+  tail_(src_index < 0 ? src_ranks.size() : 1, 0)
+{
+  if (src_index >= static_cast<int>(src_count_)) {
+    throw cet::exception("LogicError")
+      << "RMAChannel::forSender() called by a rank outside the sender communicator.";
+  }
+  // The senders, then the receiver: the same group on every member.
+  // Only these ranks take part, so other receivers are not held up.
+  std::vector<int> ranks(src_ranks);
+  ranks.push_back(dest_rank);
+  MPI_Group world_group, channel_group;
+  MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+  MPI_Group_incl(world_group, ranks.size(), &ranks[0], &channel_group);
+  MPI_Comm_create_group(MPI_COMM_WORLD, channel_group, MPITag::RMA_COMM, &comm_);
+  MPI_Group_free(&channel_group);
+  MPI_Group_free(&world_group);
+
+  // MPI_Alloc_mem gives memory the fabric can write into directly.
+  bool const receiver = (src_index_ < 0);
+  MPI_Aint bytes = receiver ? slotDisp_(src_count_ - 1, slot_count_ - 1) +
+    slot_words_ * sizeof(uint64_t) : 0;
+  if (receiver) {
+    MPI_Alloc_mem(bytes, MPI_INFO_NULL, &base_);
+  }
+  MPI_Win_create(base_, bytes, 1, MPI_INFO_NULL, comm_, &win_);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, win_);
+  if (receiver) {
+    std::fill(base_, base_ + FIRST_COUNTER + 2 * src_count_, 0);
+    base_[SLOT_COUNT] = slot_count_;
+    base_[SLOT_WORDS] = slot_words_;
+    MPI_Win_sync(win_);
+  }
+  MPI_Barrier(comm_);
+  if (! receiver) {
+    uint64_t geometry[2];
+    MPI_Get(geometry, 2, MPI_UINT64_T, dest_, SLOT_COUNT * sizeof(uint64_t),
+            2, MPI_UINT64_T, win_);
+    MPI_Win_flush(dest_, win_);
+    slot_count_ = geometry[0];
+    slot_words_ = geometry[1];
+  }
+  TRACE( 5, "RMAChannel to %d ready: %lu senders, %lu slots of %lu words each",
+         dest_rank, src_count_, slot_count_, slot_words_ );
+}
+
+artdaq::RMAChannel::
+~RMAChannel()
+{
+  MPI_Win_unlock_all(win_);
+  MPI_Win_free(&win_);
+  if (base_ != nullptr) {
+    MPI_Free_mem(base_);
+  }
+  MPI_Comm_free(&comm_);
+}
+
+bool
+artdaq::RMAChannel::
+put(Fragment const & frag)
+{
+  if (frag.size() > slot_words_) {
+    throw cet::exception("RMAChannel")
+      << "Fragment of " << frag.size() << " words does not fit in a slot of "
+      << slot_words_ << " words.";
+  }
+  uint64_t & head = head_[0];
+  uint64_t & tail = tail_[0];
+  if (head - tail >= slot_count_) {
+    // Only look at the receiver's progress when we appear to be full.
+    uint64_t ignored = 0;
+    MPI_Fetch_and_op(&ignored, &tail, MPI_UINT64_T, dest_,
+                     tailDisp_(src_index_), MPI_NO_OP, win_);
+    MPI_Win_flush(dest_, win_);
+    if (head - tail >= slot_count_) {
+      return false;
+    }
+  }
+  MPI_Put(&*frag.headerBegin(), frag.size(), MPI_UINT64_T, dest_,
+          slotDisp_(src_index_, head), frag.size(), MPI_UINT64_T, win_);
+  // The data must be complete at the receiver before the new head is.
+  MPI_Win_flush(dest_, win_);
+  uint64_t next = head + 1;
+  MPI_Accumulate(&next, 1, MPI_UINT64_T, dest_, headDisp_(src_index_),
+                 1, MPI_UINT64_T, MPI_REPLACE, win_);
+  MPI_Win_flush(dest_, win_);
+  head = next;
+  return true;
+}
+
+bool
+artdaq::RMAChannel::
+ready(size_t src_index)
+{
+  uint64_t & head = head_[src_index];
+  uint64_t & tail = tail_[src_index];
+  if (tail == head) {
+    uint64_t ignored = 0;
+    MPI_Fetch_and_op(&ignored, &head, MPI_UINT64_T, dest_,
+                     headDisp_(src_index), MPI_NO_OP, win_);
+    MPI_Win_flush(dest_, win_);
+    if (tail == head) {
+      return false;
+    }
+    MPI_Win_sync(win_); // Make the new slots visible to our loads.
+  }
+  return true;
+}
+
+bool
+artdaq::RMAChannel::
+get(size_t src_index, Fragment & frag)
+{
+  if (! ready(src_index)) {
+    return false;
+  }
+  uint64_t & tail = tail_[src_index];
+  uint64_t const * slot = base_ + slotDisp_(src_index, tail) / sizeof(uint64_t);
+  size_t words =
+    reinterpret_cast<detail::RawFragmentHeader const *>(slot)->word_count;
+  if (words < detail::RawFragmentHeader::num_words() || words > slot_words_) {
+    throw cet::exception("RMAChannel")
+      << "Corrupt Fragment header (" << words << " words) from sender "
+      << src_index << ".";
+  }
+  frag.resize(words - detail::RawFragmentHeader::num_words());
+  std::copy(slot, slot + words, frag.headerBegin());
+  ++tail;
+  // Hand the slot back to the sender.
+  MPI_Accumulate(&tail, 1, MPI_UINT64_T, dest_, tailDisp_(src_index),
+                 1, MPI_UINT64_T, MPI_REPLACE, win_);
+  MPI_Win_flush(dest_, win_);
+  return true;
+}
+
+#else
+
+artdaq::RMAChannel::
+RMAChannel(std::vector<int> const & src_ranks, int, int src_index,
+           size_t slot_count, size_t slot_words)
+  :
+  src_index_(src_index),
+  src_count_(src_ranks.size()),
+  dest_(0),
+  comm_(MPI_COMM_NULL),
+  win_(MPI_WIN_NULL),
+  base_(nullptr),
+  slot_count_(slot_count),
+  slot_words_(slot_words),
+  head_(),
+  tail_()
+{
+  throw cet::exception("Configuration")
+    << "One-sided transfers require MPI-3 (MPI_Win_lock_all, MPI_Win_flush).";
+}
+
+artdaq::RMAChannel::~RMAChannel() { }
+bool artdaq::RMAChannel::put(Fragment const &) { return false; }
+bool artdaq::RMAChannel::ready(size_t) { return false; }
+bool artdaq::RMAChannel::get(size_t, Fragment &) { return false; }
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef artdaq_DAQrate_RMAChannel_hh
+#define artdaq_DAQrate_RMAChannel_hh
+
+#include "artdaq-core/Data/Fragment.hh"
+
+#include <memory>
+#include <vector>
+
+#include "artdaq/DAQrate/quiet_mpi.hh"
+
+// RMAChannel carries Fragments from a set of sender ranks to one
+// receiver rank with one-sided MPI operations. The receiver exposes, in
+// an MPI window, a ring of fixed-size slots for each sender, each ring
+// with two counters: head (the number of Fragments put so far, advanced
+// only by the sender) and tail (the number consumed, advanced only by
+// the receiver). A sender MPI_Puts each Fragment straight into its next
+// free slot and then publishes the new head with an atomic
+// MPI_Accumulate; the receiver notices it by polling head, with no
+// receive posted and no message matching. On RDMA-capable fabrics the
+// data is written into the receiver's memory without involving its CPU.
+//
+// The window lives on a communicator of all the senders and the one
+// receiver. Creating and destroying a channel are collective over it,
+// so the senders must set up their channels in the same (increasing)
+// receiver rank order. This requires MPI-3.
+
+namespace artdaq {
+  class RMAChannel;
+}
+
+class artdaq::RMAChannel {
+public:
+  // Sender side of the channel to dest_rank; sender_comm must contain
+  // exactly the sending ranks, each of which must call this. The slot
+  // geometry is read from the receiver.
+  static std::unique_ptr<RMAChannel> forSender(MPI_Comm sender_comm,
+                                               int dest_rank);
+
+  // Receiver side of the channel from the ranks src_start to src_start +
+  // src_count - 1, with slot_count slots of slot_words words each
+  // (including the Fragment header) per sender.
+  static std::unique_ptr<RMAChannel>
+  forReceiver(size_t src_count, size_t src_start, size_t slot_count,
+              size_t slot_words);
+
+  // Collective over the channel's ranks.
+  ~RMAChannel();
+
+  RMAChannel(RMAChannel const &) = delete;
+  RMAChannel & operator=(RMAChannel const &) = delete;
+
+  // Sender side: put the Fragment into our next free slot; false if all
+  // our slots are still waiting to be consumed.
+  bool put(Fragment const & frag);
+
+  // Receiver side: whether the sender of the given index has put a
+  // Fragment that get() has not yet taken.
+  bool ready(size_t src_index);
+
+  // Receiver side: copy the next Fragment from the sender of the given
+  // index into frag, if there is one.
+  bool get(size_t src_index, Fragment & frag);
+
+  // The largest Fragment, in words including its header, that fits.
+  size_t slotWords() const { return slot_words_; }
+
+private:
+  RMAChannel(std::vector<int> const & src_ranks, int dest_rank,
+             int src_index, size_t slot_count, size_t slot_words);
+
+  MPI_Aint headDisp_(size_t src_index) const;
+  MPI_Aint tailDisp_(size_t src_index) const;
+  MPI_Aint slotDisp_(size_t src_index, uint64_t count) const;
+
+  int const src_index_; // Ours, on a sender; -1 on the receiver.
+  size_t const src_count_;
+  int dest_; // The receiver's rank within comm_.
+  MPI_Comm comm_;
+  MPI_Win win_;
+  uint64_t * base_; // Receiver's window memory; null on a sender.
+  size_t slot_count_;
+  size_t slot_words_;
+  // Per sender on the receiver, or just ours (one entry) on a sender:
+  std::vector<uint64_t> head_; // Fragments put, as last seen.
+  std::vector<uint64_t> tail_; // Fragments consumed, as last seen.
+};
+
+#endif /* artdaq_DAQrate_RMAChannel_hh */
@@ -0,0 +1,452 @@
+#include "artdaq/DAQrate/RoutingPolicy.hh"
+
+#include "art/Utilities/Exception.h"
+#include "artdaq/DAQrate/MPITag.hh"
+#include "fhiclcpp/ParameterSet.h"
+#include "messagefacility/MessageLogger/MessageLogger.h"
+#include "trace.h"		// TRACE
+
+#include <algorithm>
+#include <numeric>
+#include <string>
+
+std::unique_ptr<artdaq::RoutingPolicy>
+artdaq::makeRoutingPolicy(fhicl::ParameterSet const & pset,
+                          size_t dest_count,
+                          size_t dest_start,
+                          MPI_Comm sender_comm)
+{
+  std::string policy = pset.get<std::string>("policy", "modulo");
+  if (policy == "modulo") {
+    return std::unique_ptr<RoutingPolicy>
+      (new ModuloRoutingPolicy(dest_count, dest_start));
+  }
+  if (policy == "weighted") {
+    auto weights = pset.get<std::vector<size_t>>("weights");
+    return std::unique_ptr<RoutingPolicy>
+      (new WeightedRoutingPolicy(dest_count, dest_start, weights));
+  }
+  if (policy == "token") {
+    size_t table_size = pset.get<size_t>("table_size", 100);
+    size_t max_lease_blocks = pset.get<size_t>("max_lease_blocks", 16);
+    return std::unique_ptr<RoutingPolicy>
+      (new TokenRoutingPolicy(dest_count, dest_start, sender_comm, table_size,
+                              max_lease_blocks));
+  }
+  throw art::Exception(art::errors::Configuration, "RoutingPolicy: ")
+    << "Unknown routing policy \"" << policy << "\".\n";
+}
+
+void
+artdaq::announceMembership(bool active, size_t sender_count, size_t sender_start)
+{
+  uint64_t member = active ? 1 : 0;
+  for (size_t sender = sender_start; sender != sender_start + sender_count; ++sender) {
+    MPI_Send(&member, sizeof(member), MPI_BYTE, sender,
+             MPITag::MEMBERSHIP, MPI_COMM_WORLD);
+  }
+}
+
+std::vector<bool>
+artdaq::receiveMembership(size_t dest_count, size_t dest_start)
+{
+  std::vector<bool> active(dest_count, false);
+  for (size_t i = 0; i < dest_count; ++i) {
+    uint64_t member = 0;
+    MPI_Recv(&member, sizeof(member), MPI_BYTE, i + dest_start,
+             MPITag::MEMBERSHIP, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    active[i] = (member != 0);
+  }
+  return active;
+}
+
+artdaq::RoutingPolicy::
+RoutingPolicy(size_t dest_count, size_t dest_start)
+  :
+  dest_count_(dest_count),
+  dest_start_(dest_start)
+{
+}
+
+artdaq::ModuloRoutingPolicy::
+ModuloRoutingPolicy(size_t dest_count, size_t dest_start)
+  :
+  RoutingPolicy(dest_count, dest_start)
+{
+}
+
+size_t
+artdaq::ModuloRoutingPolicy::
+calcDest(Fragment::sequence_id_t sequence_id)
+{
+  // Works if dest_count_ == 1
+  return sequence_id % dest_count_ + dest_start_;
+}
+
+artdaq::WeightedRoutingPolicy::
+WeightedRoutingPolicy(size_t dest_count, size_t dest_start,
+                      std::vector<size_t> const & weights)
+  :
+  RoutingPolicy(dest_count, dest_start),
+  table_()
+{
+  if (weights.size() != dest_count_) {
+    throw art::Exception(art::errors::Configuration, "WeightedRoutingPolicy: ")
+      << weights.size() << " weights given for "
+      << dest_count_ << " destinations.\n";
+  }
+  size_t total = std::accumulate(weights.begin(), weights.end(), size_t(0));
+  if (total == 0) {
+    throw art::Exception(art::errors::Configuration, "WeightedRoutingPolicy: ")
+      << "All weights are zero.\n";
+  }
+  // Smooth weighted round robin: interleave the destinations so that
+  // consecutive sequence IDs are spread out rather than sent in runs.
+  std::vector<long> current(dest_count_, 0);
+  table_.reserve(total);
+  for (size_t pos = 0; pos < total; ++pos) {
+    for (size_t i = 0; i < dest_count_; ++i) {
+      current[i] += weights[i];
+    }
+    size_t best = std::max_element(current.begin(), current.end()) - current.begin();
+    current[best] -= total;
+    table_.push_back(best);
+  }
+}
+
+size_t
+artdaq::WeightedRoutingPolicy::
+calcDest(Fragment::sequence_id_t sequence_id)
+{
+  return table_[sequence_id % table_.size()] + dest_start_;
+}
+
+namespace {
+  // A lease message: first block, block count and whether the table
+  // follows; then the table, if it does.
+  size_t const LEASE_HEADER_WORDS = 3;
+}
+
+artdaq::TokenRoutingPolicy::
+TokenRoutingPolicy(size_t dest_count, size_t dest_start,
+                   MPI_Comm sender_comm, size_t table_size,
+                   size_t max_lease_blocks)
+  :
+  RoutingPolicy(dest_count, dest_start),
+  sender_comm_(MPI_COMM_NULL),
+  sender_count_(0),
+  is_master_(false),
+  table_size_(table_size),
+  max_lease_blocks_(max_lease_blocks),
+  lease_{0, 0, std::vector<int>()},
+  previous_lease_{0, 0, std::vector<int>()},
+  next_lease_{0, 0, std::vector<int>()},
+  table_broadcasts_(0),
+  credits_(dest_count, 0),
+  incoming_(LEASE_HEADER_WORDS + table_size),
+  lease_request_(MPI_REQUEST_NULL),
+  outgoing_()
+{
+  // A sender that gave up here would leave the others waiting for its
+  // leases, so agree on the configuration first: [table_size,
+  // -table_size, bad] reduced by maximum.
+  long check[3] = { static_cast<long>(table_size_),
+                    -static_cast<long>(table_size_),
+                    (table_size_ == 0 || dest_count_ == 0 ||
+                     max_lease_blocks_ == 0) ? 1 : 0 };
+  long agreed[3];
+  MPI_Allreduce(check, agreed, 3, MPI_LONG, MPI_MAX, sender_comm);
+  if (agreed[2] != 0) {
+    throw art::Exception(art::errors::Configuration, "TokenRoutingPolicy: ")
+      << "table_size, max_lease_blocks and the destination count must be "
+      << "greater than zero on every sender.\n";
+  }
+  if (agreed[0] != -agreed[1]) {
+    throw art::Exception(art::errors::Configuration, "TokenRoutingPolicy: ")
+      << "The senders' table_size ranges from " << -agreed[1]
+      << " to " << agreed[0] << "; it must be the same on all of them.\n";
+  }
+  // Leases left over from an earlier policy stay on the communicator
+  // that policy had.
+  MPI_Comm_dup(sender_comm, &sender_comm_);
+  int rank;
+  MPI_Comm_rank(sender_comm_, &rank);
+  MPI_Comm_size(sender_comm_, &sender_count_);
+  is_master_ = (rank == 0);
+  if (! is_master_) {
+    MPI_Irecv(&incoming_[0], incoming_.size(), MPI_UINT64_T, 0,
+              MPITag::LEASE, sender_comm_, &lease_request_);
+  }
+}
+
+artdaq::TokenRoutingPolicy::
+~TokenRoutingPolicy()
+{
+  if (lease_request_ != MPI_REQUEST_NULL) {
+    MPI_Cancel(&lease_request_);
+    MPI_Wait(&lease_request_, MPI_STATUS_IGNORE);
+  }
+  for (auto & out : outgoing_) {
+    for (auto & request : out.requests) {
+      int done = 0;
+      MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+      if (! done) {
+        // That sender has stopped routing.
+        MPI_Cancel(&request);
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+      }
+    }
+  }
+  MPI_Comm_free(&sender_comm_);
+}
+
+size_t
+artdaq::TokenRoutingPolicy::
+calcDest(Fragment::sequence_id_t sequence_id)
+{
+  Fragment::sequence_id_t block = sequence_id / table_size_;
+  if (block >= lease_.end()) {
+    advance_(block);
+  }
+  if (lease_.covers(block)) {
+    return lease_.table[sequence_id % table_size_] + dest_start_;
+  }
+  // The previous lease routes every block up to the current one.
+  if (previous_lease_.block_count == 0 || block < previous_lease_.first_block) {
+    throw art::Exception(art::errors::LogicError, "TokenRoutingPolicy: ")
+      << "Sequence ID " << sequence_id
+      << " is from before the routing tables still held.\n";
+  }
+  return previous_lease_.table[sequence_id % table_size_] + dest_start_;
+}
+
+void
+artdaq::TokenRoutingPolicy::
+advance_(Fragment::sequence_id_t block)
+{
+  while (block >= lease_.end()) {
+    Lease next;
+    if (is_master_) {
+      if (next_lease_.block_count == 0) {
+        // The first lease starts at block 0, so that it covers whatever
+        // the other senders start with.
+        publishLease_(0);
+      }
+      next.first_block = next_lease_.first_block;
+      next.block_count = next_lease_.block_count;
+      next.table.swap(next_lease_.table);
+      next_lease_.block_count = 0;
+    }
+    else {
+      receiveLease_(next);
+    }
+    previous_lease_.first_block = lease_.first_block;
+    previous_lease_.block_count = lease_.block_count;
+    previous_lease_.table.swap(lease_.table);
+    lease_.first_block = next.first_block;
+    lease_.block_count = next.block_count;
+    lease_.table.swap(next.table);
+    if (is_master_) {
+      // Send the next lease out now, so the others have it before they
+      // need it. If this one stops short of block, it starts at block.
+      publishLease_(std::max(lease_.end(), block));
+    }
+  }
+}
+
+void
+artdaq::TokenRoutingPolicy::
+publishLease_(Fragment::sequence_id_t first_block)
+{
+  // Measured against the latest lease: the current one, or nothing yet.
+  collectTokens_();
+  std::vector<int> table = buildTable_();
+  bool changed = (lease_.block_count == 0 || table != lease_.table);
+  size_t block_count =
+    changed ? 1 : std::min(lease_.block_count * 2, max_lease_blocks_);
+  if (sender_count_ > 1) {
+    // Let go of the leases every sender has.
+    while (! outgoing_.empty()) {
+      int done = 0;
+      MPI_Testall(outgoing_.front().requests.size(),
+                  &outgoing_.front().requests[0], &done, MPI_STATUSES_IGNORE);
+      if (! done) { break; }
+      outgoing_.pop_front();
+    }
+    outgoing_.emplace_back();
+    Outgoing & out = outgoing_.back();
+    out.message = { first_block, block_count, changed ? 1ul : 0ul };
+    if (changed) {
+      out.message.insert(out.message.end(), table.begin(), table.end());
+    }
+    out.requests.resize(sender_count_ - 1, MPI_REQUEST_NULL);
+    for (int rank = 1; rank < sender_count_; ++rank) {
+      MPI_Isend(&out.message[0], out.message.size(), MPI_UINT64_T, rank,
+                MPITag::LEASE, sender_comm_, &out.requests[rank - 1]);
+    }
+  }
+  if (changed) {
+    TRACE( 18, "TokenRoutingPolicy distributing table for block %lu", first_block );
+    ++table_broadcasts_;
+  }
+  else {
+    table = lease_.table;
+  }
+  next_lease_.first_block = first_block;
+  next_lease_.block_count = block_count;
+  next_lease_.table.swap(table);
+}
+
+void
+artdaq::TokenRoutingPolicy::
+receiveLease_(Lease & lease)
+{
+  MPI_Wait(&lease_request_, MPI_STATUS_IGNORE);
+  lease.first_block = incoming_[0];
+  lease.block_count = incoming_[1];
+  if (incoming_[2] != 0) {
+    lease.table.assign(incoming_.begin() + LEASE_HEADER_WORDS, incoming_.end());
+    ++table_broadcasts_;
+  }
+  else {
+    lease.table = lease_.table;
+  }
+  MPI_Irecv(&incoming_[0], incoming_.size(), MPI_UINT64_T, 0,
+            MPITag::LEASE, sender_comm_, &lease_request_);
+}
+
+void
+artdaq::TokenRoutingPolicy::
+collectTokens_()
+{
+  // Keep only the latest advertisement from each destination.
+  int flag = 1;
+  while (flag) {
+    MPI_Status status;
+    MPI_Iprobe(MPI_ANY_SOURCE, MPITag::TOKEN, MPI_COMM_WORLD, &flag, &status);
+    if (! flag) { break; }
+    uint64_t token;
+    MPI_Recv(&token, sizeof(token), MPI_BYTE, status.MPI_SOURCE,
+             MPITag::TOKEN, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    size_t src = status.MPI_SOURCE;
+    if (src < dest_start_ || src >= dest_start_ + dest_count_) {
+      mf::LogWarning("TokenRoutingPolicy")
+        << "Ignoring routing token from rank " << src
+        << ", which is not a destination.";
+      continue;
+    }
+    credits_[src - dest_start_] = token;
+  }
+}
+
+std::vector<int>
+artdaq::TokenRoutingPolicy::
+buildTable_()
+{
+  // Give each sequence ID to the destination with the most free
+  // capacity left; with no capacity advertised, fall back to modulo.
+  // The capacity is that last advertised, not what is left of it after
+  // earlier tables, so a table holds steady until the tokens change.
+  std::vector<size_t> credits(credits_);
+  std::vector<int> table(table_size_, 0);
+  for (size_t pos = 0; pos < table_size_; ++pos) {
+    auto best = std::max_element(credits.begin(), credits.end());
+    if (*best == 0) {
+      table[pos] = pos % dest_count_;
+    }
+    else {
+      table[pos] = best - credits.begin();
+      --*best;
+    }
+  }
+  return table;
+}
+
+artdaq::ActiveSetRoutingPolicy::
+ActiveSetRoutingPolicy(std::unique_ptr<RoutingPolicy> && policy,
+                       std::vector<bool> const & active)
+  :
+  RoutingPolicy(policy->destCount(), policy->destStart()),
+  policy_(std::move(policy)),
+  active_(active),
+  active_ranks_()
+{
+  if (active_.size() != dest_count_) {
+    throw art::Exception(art::errors::Configuration, "ActiveSetRoutingPolicy: ")
+      << active_.size() << " memberships given for "
+      << dest_count_ << " destinations.\n";
+  }
+  for (size_t i = 0; i < dest_count_; ++i) {
+    if (active_[i]) { active_ranks_.push_back(i + dest_start_); }
+  }
+  if (active_ranks_.empty()) {
+    throw art::Exception(art::errors::Configuration, "ActiveSetRoutingPolicy: ")
+      << "No destination is active.\n";
+  }
+}
+
+size_t
+artdaq::ActiveSetRoutingPolicy::
+calcDest(Fragment::sequence_id_t sequence_id)
+{
+  // Always consult the wrapped policy: a token policy's routing master
+  // sends the other senders their leases as it goes.
+  size_t dest = policy_->calcDest(sequence_id);
+  if (active_[dest - dest_start_]) {
+    return dest;
+  }
+  // Spread by the round of destinations the ID falls in rather than by
+  // the ID itself, which would pick the same stand-in every time when
+  // the wrapped policy is the modulo one.
+  return active_ranks_[(sequence_id / dest_count_) % active_ranks_.size()];
+}
+
+artdaq::RoutingTokenSender::
+RoutingTokenSender(int master_rank)
+  :
+  master_rank_(master_rank),
+  in_flight_(0),
+  held_(0),
+  holding_(false),
+  request_(MPI_REQUEST_NULL)
+{
+}
+
+artdaq::RoutingTokenSender::
+~RoutingTokenSender()
+{
+  if (request_ != MPI_REQUEST_NULL) {
+    int done = 0;
+    MPI_Test(&request_, &done, MPI_STATUS_IGNORE);
+    if (! done) {
+      // The master may have stopped collecting tokens.
+      MPI_Cancel(&request_);
+      MPI_Wait(&request_, MPI_STATUS_IGNORE);
+    }
+  }
+}
+
+void
+artdaq::RoutingTokenSender::
+send(size_t free_slots)
+{
+  held_ = free_slots;
+  holding_ = true;
+  progress_();
+}
+
+void
+artdaq::RoutingTokenSender::
+progress_()
+{
+  if (request_ != MPI_REQUEST_NULL) {
+    int done = 0;
+    MPI_Test(&request_, &done, MPI_STATUS_IGNORE);
+    if (! done) { return; } // The held token waits for the next call.
+  }
+  if (! holding_) { return; }
+  in_flight_ = held_;
+  holding_ = false;
+  MPI_Isend(&in_flight_, sizeof(in_flight_), MPI_BYTE, master_rank_,
+            MPITag::TOKEN, MPI_COMM_WORLD, &request_);
+}
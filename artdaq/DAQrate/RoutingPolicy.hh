@@ -0,0 +1,216 @@
+#ifndef artdaq_DAQrate_RoutingPolicy_hh
+#define artdaq_DAQrate_RoutingPolicy_hh
+
+#include "artdaq-core/Data/Fragment.hh"
+#include "fhiclcpp/fwd.h"
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "artdaq/DAQrate/quiet_mpi.hh"
+
+// A RoutingPolicy decides which receiver rank gets the Fragments with a
+// given sequence ID. Every sender must return the same destination for
+// the same sequence ID, so that all the Fragments of an event end up at
+// the same EventBuilder.
+//
+//   ModuloRoutingPolicy   - sequence_id % dest_count (the original scheme).
+//   WeightedRoutingPolicy - round robin in proportion to per-receiver weights.
+//   TokenRoutingPolicy    - receivers advertise free capacity ("tokens") to
+//                           a routing master, which assigns blocks of
+//                           sequence IDs to the least-loaded receivers and
+//                           sends the assignment to the other senders
+//                           ahead of its use.
+//   ActiveSetRoutingPolicy - wraps another policy, moving the share of
+//                           receivers not taking part to the others.
+
+namespace artdaq {
+  class RoutingPolicy;
+  class ModuloRoutingPolicy;
+  class WeightedRoutingPolicy;
+  class TokenRoutingPolicy;
+  class ActiveSetRoutingPolicy;
+  class RoutingTokenSender;
+
+  // Create the policy named by the "policy" parameter of pset ("modulo",
+  // "weighted" or "token"); an empty pset gives the modulo policy.
+  // sender_comm must contain exactly the sending processes; it is only
+  // used by the token policy, whose creation is collective over it.
+  std::unique_ptr<RoutingPolicy>
+  makeRoutingPolicy(fhicl::ParameterSet const & pset,
+                    size_t dest_count,
+                    size_t dest_start,
+                    MPI_Comm sender_comm);
+
+  // Called by each receiver as data taking starts or resumes, to tell
+  // every sender (ranks sender_start to sender_start + sender_count - 1)
+  // whether it takes part until the next pause or stop.
+  void announceMembership(bool active, size_t sender_count, size_t sender_start);
+
+  // Called by each sender at the same point: which of the receivers
+  // (ranks dest_start to dest_start + dest_count - 1) take part, in rank
+  // order. Every sender sees the same answer.
+  std::vector<bool> receiveMembership(size_t dest_count, size_t dest_start);
+}
+
+class artdaq::RoutingPolicy {
+public:
+  RoutingPolicy(size_t dest_count, size_t dest_start);
+  virtual ~RoutingPolicy() = default;
+
+  // Return the rank to which Fragments with this sequence ID go.
+  virtual size_t calcDest(Fragment::sequence_id_t sequence_id) = 0;
+
+  size_t destCount() const { return dest_count_; }
+  size_t destStart() const { return dest_start_; }
+
+protected:
+  size_t const dest_count_;
+  size_t const dest_start_;
+};
+
+class artdaq::ModuloRoutingPolicy : public artdaq::RoutingPolicy {
+public:
+  ModuloRoutingPolicy(size_t dest_count, size_t dest_start);
+
+  size_t calcDest(Fragment::sequence_id_t sequence_id) override;
+};
+
+class artdaq::WeightedRoutingPolicy : public artdaq::RoutingPolicy {
+public:
+  // weights must have one entry per destination; a weight of zero
+  // excludes that destination.
+  WeightedRoutingPolicy(size_t dest_count, size_t dest_start,
+                        std::vector<size_t> const & weights);
+
+  size_t calcDest(Fragment::sequence_id_t sequence_id) override;
+
+private:
+  std::vector<size_t> table_; // Destination index for each position.
+};
+
+class artdaq::TokenRoutingPolicy : public artdaq::RoutingPolicy {
+public:
+  // Sequence IDs are assigned in blocks of table_size, by a table that
+  // holds for a lease of one or more blocks. Rank 0 of sender_comm is
+  // the routing master: it builds each lease's table from the latest
+  // tokens and sends the lease (its first block, its length and, only if
+  // it changed, the table) to each of the other senders, one lease ahead
+  // of the one it is routing by itself. A lease routes every block from
+  // its first up to the first of the next, so a sender may route any
+  // sequence IDs it likes, skip blocks and stop whenever it likes. It
+  // waits for the master only when it gets more than a lease ahead. Each
+  // lease after an unchanged table is twice as long, up to
+  // max_lease_blocks, so a steady table costs ever fewer messages; a
+  // change shortens the lease to one block again. A sequence ID from
+  // before the current lease is routed by the previous one, if it falls
+  // within it.
+  //
+  // Construction is collective over sender_comm, and throws on every
+  // sender if any of them has a bad configuration or a different
+  // table_size.
+  TokenRoutingPolicy(size_t dest_count, size_t dest_start,
+                     MPI_Comm sender_comm, size_t table_size,
+                     size_t max_lease_blocks = 16);
+  // Cancels any lease still in flight.
+  ~TokenRoutingPolicy();
+
+  TokenRoutingPolicy(TokenRoutingPolicy const &) = delete;
+  TokenRoutingPolicy & operator=(TokenRoutingPolicy const &) = delete;
+
+  size_t calcDest(Fragment::sequence_id_t sequence_id) override;
+
+  // How many tables have been sent out (counted on every sender).
+  size_t tableBroadcasts() const { return table_broadcasts_; }
+
+private:
+  struct Lease {
+    Fragment::sequence_id_t first_block;
+    size_t block_count; // Zero before the first lease.
+    std::vector<int> table; // Destination index for each position.
+    Fragment::sequence_id_t end() const { return first_block + block_count; }
+    bool covers(Fragment::sequence_id_t block) const
+    {
+      return block >= first_block && block < end();
+    }
+  };
+  // A lease on its way to the other senders.
+  struct Outgoing {
+    std::vector<uint64_t> message;
+    std::vector<MPI_Request> requests;
+  };
+
+  // Move on to the lease that covers block, or the last to start
+  // before it.
+  void advance_(Fragment::sequence_id_t block);
+  // Master: build the lease starting at first_block as next_lease_ and
+  // send it to the other senders.
+  void publishLease_(Fragment::sequence_id_t first_block);
+  // Other senders: wait for the next lease from the master.
+  void receiveLease_(Lease & lease);
+  void collectTokens_();
+  std::vector<int> buildTable_();
+
+  MPI_Comm sender_comm_; // Our own duplicate, for the leases.
+  int sender_count_;
+  bool is_master_;
+  size_t const table_size_;
+  size_t const max_lease_blocks_;
+  Lease lease_;
+  Lease previous_lease_;
+  Lease next_lease_; // Master: published, but not yet routing.
+  size_t table_broadcasts_;
+  std::vector<size_t> credits_; // Free slots last advertised, per destination.
+  std::vector<uint64_t> incoming_; // Other senders: the next lease.
+  MPI_Request lease_request_; // Other senders: receiving incoming_.
+  std::deque<Outgoing> outgoing_; // Master: oldest first.
+};
+
+class artdaq::ActiveSetRoutingPolicy : public artdaq::RoutingPolicy {
+public:
+  // Route as policy does, except that the sequence IDs it gives to a
+  // destination not marked in active are spread evenly over those that
+  // are, so the active ones share the load of the others. active has an
+  // entry per destination, at least one of them true.
+  ActiveSetRoutingPolicy(std::unique_ptr<RoutingPolicy> && policy,
+                         std::vector<bool> const & active);
+
+  size_t calcDest(Fragment::sequence_id_t sequence_id) override;
+
+private:
+  std::unique_ptr<RoutingPolicy> policy_;
+  std::vector<bool> active_;
+  std::vector<size_t> active_ranks_;
+};
+
+// Advertises a receiver's free capacity ("tokens") to the routing
+// master without blocking the receiver: each token goes out with
+// MPI_Isend. A token offered while the last one is still in flight is
+// held, replacing any held before it, and goes out once that completes;
+// the master only keeps the latest from each receiver anyway.
+class artdaq::RoutingTokenSender {
+public:
+  // master_rank is the routing master's rank in MPI_COMM_WORLD.
+  explicit RoutingTokenSender(int master_rank);
+  // Cancels a token still in flight.
+  ~RoutingTokenSender();
+
+  RoutingTokenSender(RoutingTokenSender const &) = delete;
+  RoutingTokenSender & operator=(RoutingTokenSender const &) = delete;
+
+  // Advertise that we can currently accept free_slots more events.
+  void send(size_t free_slots);
+
+private:
+  // Start sending the held token if the last one has gone.
+  void progress_();
+
+  int const master_rank_;
+  uint64_t in_flight_;
+  uint64_t held_;
+  bool holding_;
+  MPI_Request request_;
+};
+
+#endif /* artdaq_DAQrate_RoutingPolicy_hh */
@@ -1,7 +1,9 @@
 
 #include "artdaq/DAQrate/SHandles.hh"
+#include "artdaq/DAQrate/ClockOffset.hh"
 #include "artdaq/DAQrate/Perf.hh"
 #include "artdaq/DAQdata/Debug.hh"
+#include "artdaq/DAQrate/Locality.hh"
 #include "artdaq/DAQrate/MPITag.hh"
 #include "artdaq/DAQrate/Utils.hh"
 #include "artdaq-core/Data/Fragment.hh"
@@ -9,13 +11,23 @@
 #include "trace.h"		// TRACE
 
 #include <algorithm>
+#include <chrono>
+#include <sched.h>
+#include <unistd.h>
+
+namespace {
+  // How long a sender waits for a co-located receiver to create its ring.
+  double const SHM_ATTACH_TIMEOUT_SEC = 30.0;
+}
 
 artdaq::SHandles::SHandles(size_t buffer_count,
                            uint64_t max_payload_size,
                            size_t dest_count,
                            size_t dest_start,
 			   bool broadcast_sends,
-                           bool synchronous_sends)
+                           bool synchronous_sends,
+                           bool shared_memory,
+                           bool persistent_requests)
   :
   buffer_count_(buffer_count),
   max_payload_size_(max_payload_size),
@@ -25,38 +37,319 @@ artdaq::SHandles::SHandles(size_t buffer_count,
   sent_frag_count_(dest_count, dest_start),
   broadcast_sends_(broadcast_sends),
   synchronous_sends_(synchronous_sends),
+  routing_policy_(new ModuloRoutingPolicy(dest_count, dest_start)),
+  spin_rounds_(0),
+  slot_wait_(dest_count, 0.0),
+  my_rank_(0),
+  local_dest_(dest_count, false),
+  active_dest_(dest_count, true),
+  shm_rings_(dest_count),
+  rma_channels_(dest_count),
+  tcp_sender_(),
   reqs_(buffer_count_, MPI_REQUEST_NULL),
-  payload_(buffer_count_)
+  slot_dest_(buffer_count_, 0),
+  persistent_requests_(persistent_requests),
+  persistent_(persistent_requests ? buffer_count_ : 0),
+  payload_(buffer_count_),
+  batch_payload_(buffer_count_),
+  batch_lengths_(),
+  batch_displacements_(),
+  shared_payload_(buffer_count_),
+  chunk_headers_(buffer_count_),
+  next_chunk_stream_(0),
+  stamp_latency_(false),
+  send_stamps_(buffer_count_, 0),
+  use_credits_(false),
+  credits_(dest_count, 0),
+  credits_closed_(dest_count, false)
 {
+  int mpi_initialized = 0;
+  MPI_Initialized(&mpi_initialized);
+  if (mpi_initialized) { // Not needed when only TCP is used.
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank_);
+  }
+  if (shared_memory) {
+    for (size_t i = 0; i < dest_count_; ++i) {
+      local_dest_[i] = sameNode(i + dest_start_);
+    }
+  }
 }
 
 artdaq::SHandles::~SHandles()
 {
   size_t dest_end = dest_start_ + dest_count_;
   for (size_t dest = dest_start_; dest != dest_end; ++dest) {
-    sendEODFrag(dest, sent_frag_count_.slotCount(dest));
+    if (active_dest_[dest - dest_start_]) {
+      sendEODFrag(dest, sent_frag_count_.slotCount(dest));
+    }
   }
   waitAll();
+  if (use_credits_ && ! tcp_sender_) {
+    // Take any grants still on their way, so that none is left for the
+    // SHandles of the next run, until each destination closes them.
+    for (size_t i = 0; i < dest_count_; ++i) {
+      if (! active_dest_[i] || local_dest_[i] || rma_channels_[i]) { continue; }
+      while (! credits_closed_[i] && receiveCredits_(i + dest_start_)) { }
+    }
+  }
+  for (size_t i = 0; i < persistent_.size(); ++i) {
+    persistent_[i].release(reqs_[i]);
+  }
+  // Freeing a channel is collective over all the senders: go in the
+  // order in which they were created.
+  for (auto & channel : rma_channels_) {
+    channel.reset();
+  }
 }
 
-size_t artdaq::SHandles::calcDest(Fragment::sequence_id_t sequence_id) const
+size_t artdaq::SHandles::calcDest(Fragment::sequence_id_t sequence_id)
 {
-  // Works if dest_count_ == 1
-  return sequence_id % dest_count_ + dest_start_;
+  return routing_policy_->calcDest(sequence_id);
 }
 
-size_t artdaq::SHandles::findAvailable()
+void
+artdaq::SHandles::
+setRoutingPolicy(std::unique_ptr<RoutingPolicy> && policy)
 {
+  if (policy->destCount() != dest_count_ ||
+      policy->destStart() != dest_start_) {
+    throw cet::exception("LogicError")
+        << "RoutingPolicy covers ranks " << policy->destStart()
+        << " to " << policy->destStart() + policy->destCount() - 1
+        << " but SHandles sends to ranks " << dest_start_
+        << " to " << dest_start_ + dest_count_ - 1 << ".";
+  }
+  if (std::find(active_dest_.begin(), active_dest_.end(), false) !=
+      active_dest_.end()) {
+    policy.reset(new ActiveSetRoutingPolicy(std::move(policy), active_dest_));
+  }
+  routing_policy_ = std::move(policy);
+}
+
+void
+artdaq::SHandles::
+setActiveDestinations(std::vector<bool> const & active)
+{
+  if (active.size() != dest_count_) {
+    throw cet::exception("Configuration")
+        << "SHandles sends to " << dest_count_ << " destinations but "
+        << active.size() << " memberships were given.";
+  }
+  if (sent_frag_count_.count() != 0) {
+    throw cet::exception("LogicError")
+        << "SHandles::setActiveDestinations() called after Fragments were sent.";
+  }
+  if (std::find(active.begin(), active.end(), true) == active.end()) {
+    throw cet::exception("Configuration")
+        << "SHandles has no active destination among ranks " << dest_start_
+        << " to " << dest_start_ + dest_count_ - 1 << ".";
+  }
+  // Wrap the current policy to re-route the inactive destinations' share.
+  active_dest_ = active;
+  std::unique_ptr<RoutingPolicy> policy(std::move(routing_policy_));
+  setRoutingPolicy(std::move(policy));
+}
+
+void
+artdaq::SHandles::
+setSpinRounds(size_t spin_rounds)
+{
+  spin_rounds_ = spin_rounds;
+}
+
+void
+artdaq::SHandles::
+useTCP(int source_rank, std::vector<std::string> const & dest_endpoints)
+{
+  if (dest_endpoints.size() != dest_count_) {
+    throw cet::exception("Configuration")
+        << "SHandles sends to " << dest_count_ << " destinations but "
+        << dest_endpoints.size() << " TCP endpoints were given.";
+  }
+  if (sent_frag_count_.count() != 0) {
+    throw cet::exception("LogicError")
+        << "SHandles::useTCP() called after Fragments were sent.";
+  }
+  my_rank_ = source_rank;
+  tcp_sender_.reset(new TCPSender(source_rank, dest_start_, dest_endpoints));
+}
+
+void
+artdaq::SHandles::
+useOneSided(MPI_Comm sender_comm)
+{
+  if (sent_frag_count_.count() != 0) {
+    throw cet::exception("LogicError")
+        << "SHandles::useOneSided() called after Fragments were sent.";
+  }
+  // Every sender takes part in every receiver's window, in increasing
+  // destination rank order (see RMAChannel.hh), even where this sender
+  // will use shared memory instead.
+  std::vector<std::unique_ptr<RMAChannel>> channels(dest_count_);
+  for (size_t i = 0; i < dest_count_; ++i) {
+    if (! active_dest_[i]) { continue; } // Not setting up a window.
+    channels[i] = RMAChannel::forSender(sender_comm, i + dest_start_);
+  }
+  rma_channels_ = std::move(channels);
+}
+
+void
+artdaq::SHandles::
+enableLatencyStamps(size_t clock_rounds)
+{
+  if (sent_frag_count_.count() != 0) {
+    throw cet::exception("LogicError")
+        << "SHandles::enableLatencyStamps() called after Fragments were sent.";
+  }
+  if (tcp_sender_) {
+    return;
+  }
+  // In increasing rank order, as the receivers ping their sources, so
+  // that no sender and receiver wait on each other.
+  size_t dest_end = dest_start_ + dest_count_;
+  for (size_t dest = dest_start_; dest != dest_end; ++dest) {
+    if (active_dest_[dest - dest_start_]) {
+      answerClockProbes(dest, clock_rounds);
+    }
+  }
+  stamp_latency_ = true;
+}
+
+void
+artdaq::SHandles::
+useCredits()
+{
+  if (sent_frag_count_.count() != 0) {
+    throw cet::exception("LogicError")
+        << "SHandles::useCredits() called after Fragments were sent.";
+  }
+  if (tcp_sender_) {
+    return;
+  }
+  // Each destination grants our first credits once it is set up.
+  use_credits_ = true;
+}
+
+bool
+artdaq::SHandles::
+receiveCredits_(size_t dest)
+{
+  uint64_t grant = 0;
+  MPI_Recv(&grant, sizeof(grant), MPI_BYTE, dest, MPITag::CREDIT,
+           MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  size_t index = dest - dest_start_;
+  if (grant == 0) {
+    // The receiver is done with us; with no one left to hold back, send
+    // whatever remains without credit.
+    TRACE( 5, "receiveCredits_ dest=%lu closed", dest );
+    credits_closed_[index] = true;
+    return false;
+  }
+  credits_[index] += grant;
+  return true;
+}
+
+artdaq::SharedMemoryRing *
+artdaq::SHandles::
+ringFor_(size_t dest)
+{
+  size_t index = dest - dest_start_;
+  if (! local_dest_[index]) { return nullptr; }
+  if (! shm_rings_[index]) {
+    TRACE( 5, "ringFor_ attaching to ring for dest=%lu", dest );
+    shm_rings_[index] = SharedMemoryRing::attach(my_rank_, dest,
+                                                 SHM_ATTACH_TIMEOUT_SEC);
+  }
+  return shm_rings_[index].get();
+}
+
+artdaq::RMAChannel *
+artdaq::SHandles::
+channelFor_(size_t dest)
+{
+  return rma_channels_[dest - dest_start_].get();
+}
+
+void
+artdaq::SHandles::
+putTo_(RMAChannel & channel, Fragment const & frag, size_t dest)
+{
+  if (channel.put(frag)) { return; }
+  // Every slot is still unread: retry until the receiver catches up,
+  // yielding the processor rather than sleeping between attempts.
+  auto start = std::chrono::steady_clock::now();
+  do {
+    sched_yield();
+  } while (! channel.put(frag));
+  slot_wait_[dest - dest_start_] +=
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void
+artdaq::SHandles::
+startPersistent_(size_t buffer_idx, size_t dest)
+{
+  void const * buffer = &*payload_[buffer_idx].headerBegin();
+  int bytes = payload_[buffer_idx].size() * sizeof(Fragment::value_type);
+  detail::PersistentRequest & persistent = persistent_[buffer_idx];
+  if (! persistent.matches(buffer, bytes, dest)) {
+    persistent.release(reqs_[buffer_idx]);
+    MPI_Send_init(buffer, bytes, MPI_BYTE, dest, MPITag::FINAL,
+                  MPI_COMM_WORLD, &reqs_[buffer_idx]);
+    persistent.set(buffer, bytes, dest);
+  }
+  MPI_Start(&reqs_[buffer_idx]);
+}
+
+void
+artdaq::SHandles::
+releasePersistent_(size_t buffer_idx)
+{
+  if (persistent_requests_) {
+    persistent_[buffer_idx].release(reqs_[buffer_idx]);
+  }
+}
+
+size_t artdaq::SHandles::findAvailable(size_t dest, bool use_credit)
+{
+  size_t const index = dest - dest_start_;
+  if (use_credits_ && use_credit && ! credits_closed_[index]) {
+    if (credits_[index] == 0) {
+      TRACE( 5, "findAvailable waiting for credit dest=%lu", dest );
+      auto credit_start = std::chrono::steady_clock::now();
+      receiveCredits_(dest);
+      slot_wait_[index] +=
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - credit_start).count();
+    }
+    if (! credits_closed_[index]) { --credits_[index]; }
+  }
+  auto start = std::chrono::steady_clock::now();
   size_t use_me = 0;
+  size_t const max_tests = spin_rounds_ * buffer_count_;
+  size_t tests = 0;
   int flag;
   do {
     use_me = pos_;
     MPI_Test(&reqs_[use_me], &flag, MPI_STATUS_IGNORE);
     pos_ = (pos_ + 1) % buffer_count_;
   }
-  while (!flag);
+  while (!flag && (++tests < max_tests || max_tests == 0));
+  if (!flag) {
+    // Every slot is still busy: block until one of them completes.
+    int completed;
+    TRACE( 5, "findAvailable blocking in MPI_Waitany dest=%lu", dest );
+    MPI_Waitany(buffer_count_, &reqs_[0], &completed, MPI_STATUS_IGNORE);
+    use_me = completed;
+    pos_ = (use_me + 1) % buffer_count_;
+  }
   // pos_ is pointing at the next slot to check
   // use_me is pointing at the slot to use
+  if (tests != 0) {
+    // The wait was for the send occupying use_me, not for this one.
+    slot_wait_[slot_dest_[use_me]] +=
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  slot_dest_[use_me] = index;
   return use_me;
 }
 
@@ -74,10 +367,12 @@ sendFragment(Fragment && frag)
   size_t dest;
   if (broadcast_sends_) {
     size_t dest_end = dest_start_ + dest_count_;
+    // Every destination is sent the same buffer; each in-flight send
+    // holds a reference to it, so no per-destination copy is needed.
+    auto shared = std::make_shared<Fragment>(std::move(frag));
     for (dest = dest_start_; dest != dest_end; ++dest) {
-      // Gross, we have to copy.
-      Fragment fragCopy(frag);
-      sendFragTo(std::move(fragCopy), dest);
+      if (! active_dest_[dest - dest_start_]) { continue; }
+      sendSharedTo_(shared, dest);
       sent_frag_count_.incSlot(dest);
     }
   } else {
@@ -89,6 +384,53 @@ sendFragment(Fragment && frag)
   return dest;
 }
 
+void
+artdaq::SHandles::
+sendFragments(FragmentPtrs && frags)
+{
+  if (broadcast_sends_ || dest_count_ == 0) {
+    for (auto & fragPtr : frags) {
+      sendFragment(std::move(*fragPtr));
+    }
+    return;
+  }
+  // A batch must fit in a single receive buffer.
+  size_t const max_batch_words =
+    max_payload_size_ + detail::RawFragmentHeader::num_words();
+  std::vector<Fragments> batches(dest_count_);
+  std::vector<size_t> batch_words(dest_count_, 0);
+  auto flush = [this, &batches, &batch_words](size_t index) {
+    Fragments & batch = batches[index];
+    size_t dest = index + dest_start_;
+    size_t nFrags = batch.size();
+    if (nFrags == 1) {
+      sendFragTo(std::move(batch.front()), dest);
+    }
+    else if (nFrags > 1) {
+      sendBatchTo_(std::move(batch), dest);
+    }
+    sent_frag_count_.incSlot(dest, nFrags);
+    batch.clear();
+    batch_words[index] = 0;
+  };
+  for (auto & fragPtr : frags) {
+    if (fragPtr->type() == Fragment::EndOfDataFragmentType) {
+      throw cet::exception("LogicError")
+          << "EOD fragments should not be sent on as received: "
+          << "use sendEODFrag() instead.";
+    }
+    size_t index = calcDest(fragPtr->sequenceID()) - dest_start_;
+    if (batch_words[index] + fragPtr->size() > max_batch_words) {
+      flush(index);
+    }
+    batch_words[index] += fragPtr->size();
+    batches[index].emplace_back(std::move(*fragPtr));
+  }
+  for (size_t index = 0; index < dest_count_; ++index) {
+    flush(index);
+  }
+}
+
 void
 artdaq::SHandles::
 sendEODFrag(size_t dest, size_t nFragments)
@@ -106,6 +448,9 @@ sendEODFrag(size_t dest, size_t nFragments)
 
 void artdaq::SHandles::waitAll()
 {
+  if (tcp_sender_) {
+    return; // TCP sends complete before they return.
+  }
   MPI_Waitall(buffer_count_, &reqs_[0], MPI_STATUSES_IGNORE);
 }
 
@@ -113,20 +458,152 @@ void
 artdaq::SHandles::
 sendFragTo(Fragment && frag, size_t dest)
 {
+  if (tcp_sender_) {
+    tcp_sender_->send(dest, frag);
+    Debug << "send (TCP) COMPLETE: "
+          << " send_size=" << frag.size()
+          << " dest=" << dest
+          << " sequenceID=" << frag.sequenceID()
+          << flusher;
+    return;
+  }
+  if (SharedMemoryRing * ring = ringFor_(dest)) {
+    ring->write(frag);
+    Debug << "send (shared memory) COMPLETE: "
+          << " send_size=" << frag.size()
+          << " dest=" << dest
+          << " sequenceID=" << frag.sequenceID()
+          << flusher;
+    return;
+  }
+  if (RMAChannel * channel = channelFor_(dest)) {
+    putTo_(*channel, frag, dest);
+    Debug << "send (one-sided) COMPLETE: "
+          << " send_size=" << frag.size()
+          << " dest=" << dest
+          << " sequenceID=" << frag.sequenceID()
+          << flusher;
+    return;
+  }
   if (frag.dataSize() > max_payload_size_) {
-    throw cet::exception("Unimplemented")
-        << "Currently unable to deal with overlarge fragment payload ("
-        << frag.dataSize()
-        << " words > "
-        << max_payload_size_
-        << ").";
+    sendChunked_(std::make_shared<Fragment>(std::move(frag)), dest);
+    return;
   }
   SendMeas sm;
-  size_t buffer_idx = findAvailable();
+  size_t buffer_idx =
+    findAvailable(dest, frag.type() != Fragment::EndOfDataFragmentType);
   sm.found(frag.sequenceID(), buffer_idx, dest);
   Fragment & curfrag = payload_[buffer_idx];
-  curfrag = std::move(frag);
-  TRACE( 5, "sendFragTo before send dest=%lu seqID=%lu", dest, curfrag.sequenceID() );
+  batch_payload_[buffer_idx].clear();
+  shared_payload_[buffer_idx].reset();
+  if (persistent_requests_) {
+    // Copy into the buffer's existing storage, which stays where it is
+    // unless it has to grow.
+    curfrag.resize(frag.dataSize());
+    std::copy(frag.headerBegin(), frag.headerBegin() + frag.size(),
+              curfrag.headerBegin());
+  }
+  else {
+    curfrag = std::move(frag);
+  }
+  detail::RawFragmentHeader const & sent =
+    *reinterpret_cast<detail::RawFragmentHeader const *>(&*curfrag.headerBegin());
+  if (persistent_requests_) {
+    TRACE( 5, "sendFragTo before persistent send dest=%lu seqID=%lu", dest, (unsigned long)sent.sequence_id );
+    startPersistent_(buffer_idx, dest);
+    if (synchronous_sends_) {
+      MPI_Wait(&reqs_[buffer_idx], MPI_STATUS_IGNORE);
+    }
+    return;
+  }
+  TRACE( 5, "sendFragTo before send dest=%lu seqID=%lu", dest, (unsigned long)sent.sequence_id );
+  sendPayload_(buffer_idx, dest);
+  TRACE( 5, "sendFragTo COMPLETE" );
+  Debug << "send COMPLETE: "
+        << " buffer_idx=" << buffer_idx
+        << " send_size=" << sent.word_count
+        << " dest=" << dest
+        << " sequenceID=" << sent.sequence_id
+        << " fragID=" << sent.fragment_id
+        << flusher;
+}
+
+void
+artdaq::SHandles::
+sendPayload_(size_t buffer_idx, size_t dest)
+{
+  RawDataType * data = &*payload_[buffer_idx].headerBegin();
+  size_t const words = payload_[buffer_idx].size();
+  int bytes = words * sizeof(Fragment::value_type);
+  if (stamp_latency_ &&
+      words < max_payload_size_ + detail::RawFragmentHeader::num_words()) {
+    // The receiver finds the stamp just past the end of the Fragment.
+    send_stamps_[buffer_idx] = steadyClockNanoseconds();
+    int lengths[2] = { bytes, static_cast<int>(sizeof(int64_t)) };
+    MPI_Aint displacements[2];
+    MPI_Get_address(data, &displacements[0]);
+    MPI_Get_address(&send_stamps_[buffer_idx], &displacements[1]);
+    MPI_Datatype stamped_type;
+    MPI_Type_create_hindexed(2, lengths, displacements, MPI_BYTE, &stamped_type);
+    MPI_Type_commit(&stamped_type);
+    if (! synchronous_sends_) {
+      MPI_Isend(MPI_BOTTOM, 1, stamped_type, dest, MPITag::FINAL,
+                MPI_COMM_WORLD, &reqs_[buffer_idx]);
+    }
+    else {
+      MPI_Send(MPI_BOTTOM, 1, stamped_type, dest, MPITag::FINAL,
+               MPI_COMM_WORLD);
+    }
+    MPI_Type_free(&stamped_type);
+    return;
+  }
+  if (! synchronous_sends_) {
+    MPI_Isend(data,
+              bytes,
+              MPI_BYTE,
+              dest,
+              MPITag::FINAL,
+              MPI_COMM_WORLD,
+              &reqs_[buffer_idx]);
+  }
+  else {
+    MPI_Send(data,
+             bytes,
+             MPI_BYTE,
+             dest,
+             MPITag::FINAL,
+             MPI_COMM_WORLD );
+  }
+}
+
+void
+artdaq::SHandles::
+sendSharedTo_(std::shared_ptr<Fragment> const & frag, size_t dest)
+{
+  if (tcp_sender_) {
+    tcp_sender_->send(dest, *frag);
+    return;
+  }
+  if (SharedMemoryRing * ring = ringFor_(dest)) {
+    ring->write(*frag);
+    return;
+  }
+  if (RMAChannel * channel = channelFor_(dest)) {
+    putTo_(*channel, *frag, dest);
+    return;
+  }
+  if (frag->dataSize() > max_payload_size_) {
+    sendChunked_(frag, dest);
+    return;
+  }
+  SendMeas sm;
+  size_t buffer_idx = findAvailable(dest);
+  sm.found(frag->sequenceID(), buffer_idx, dest);
+  releasePersistent_(buffer_idx);
+  shared_payload_[buffer_idx] = frag;
+  batch_payload_[buffer_idx].clear();
+  Fragment & curfrag = *frag;
+  TRACE( 5, "sendSharedTo_ before send dest=%lu seqID=%lu", dest, curfrag.sequenceID() );
   if (! synchronous_sends_) {
     MPI_Isend(&*curfrag.headerBegin(),
               curfrag.size() * sizeof(Fragment::value_type),
@@ -144,8 +621,8 @@ sendFragTo(Fragment && frag, size_t dest)
              MPITag::FINAL,
              MPI_COMM_WORLD );
   }
-  TRACE( 5, "sendFragTo COMPLETE" );
-  Debug << "send COMPLETE: "
+  TRACE( 5, "sendSharedTo_ COMPLETE" );
+  Debug << "send (shared) COMPLETE: "
         << " buffer_idx=" << buffer_idx
         << " send_size=" << curfrag.size()
         << " dest=" << dest
@@ -153,3 +630,122 @@ sendFragTo(Fragment && frag, size_t dest)
         << " fragID=" << curfrag.fragmentID()
         << flusher;
 }
+
+void
+artdaq::SHandles::
+sendChunked_(std::shared_ptr<Fragment> const & frag, size_t dest)
+{
+  // Each chunk, with its ChunkHeader, must fit in a receive buffer.
+  size_t const chunk_words = max_payload_size_ +
+    detail::RawFragmentHeader::num_words() - detail::ChunkHeader::num_words();
+  size_t const total_words = frag->size();
+  uint64_t const stream_id = next_chunk_stream_++;
+  size_t nChunks = 0;
+  for (size_t offset = 0; offset < total_words; offset += chunk_words) {
+    size_t const words = std::min(chunk_words, total_words - offset);
+    SendMeas sm;
+    size_t buffer_idx = findAvailable(dest);
+    sm.found(frag->sequenceID(), buffer_idx, dest);
+    releasePersistent_(buffer_idx);
+    // Every chunk's slot holds a reference, so the Fragment outlives
+    // the last of the sends.
+    shared_payload_[buffer_idx] = frag;
+    batch_payload_[buffer_idx].clear();
+    detail::ChunkHeader & header = chunk_headers_[buffer_idx];
+    header.stream_id = stream_id;
+    header.offset_words = offset;
+    header.total_words = total_words;
+    int lengths[2] = {
+      static_cast<int>(sizeof(header)),
+      static_cast<int>(words * sizeof(Fragment::value_type)) };
+    MPI_Aint displacements[2];
+    MPI_Get_address(&header, &displacements[0]);
+    MPI_Get_address(&*frag->headerBegin() + offset, &displacements[1]);
+    MPI_Datatype chunk_type;
+    MPI_Type_create_hindexed(2, lengths, displacements, MPI_BYTE, &chunk_type);
+    MPI_Type_commit(&chunk_type);
+    if (! synchronous_sends_) {
+      MPI_Isend(MPI_BOTTOM, 1, chunk_type, dest, MPITag::INCOMPLETE,
+                MPI_COMM_WORLD, &reqs_[buffer_idx]);
+    }
+    else {
+      MPI_Send(MPI_BOTTOM, 1, chunk_type, dest, MPITag::INCOMPLETE,
+               MPI_COMM_WORLD);
+    }
+    MPI_Type_free(&chunk_type);
+    ++nChunks;
+  }
+  TRACE( 5, "sendChunked_ COMPLETE dest=%lu chunks=%lu", dest, nChunks );
+  Debug << "send (chunked) COMPLETE: "
+        << " chunks=" << nChunks
+        << " send_size=" << total_words
+        << " dest=" << dest
+        << " sequenceID=" << frag->sequenceID()
+        << flusher;
+}
+
+void
+artdaq::SHandles::
+sendBatchTo_(Fragments && batch, size_t dest)
+{
+  if (tcp_sender_) {
+    // One gathered write of all the Fragments, back to back.
+    tcp_sender_->send(dest, batch);
+    return;
+  }
+  if (SharedMemoryRing * ring = ringFor_(dest)) {
+    // Fragments in a ring are already back to back; no batch needed.
+    for (auto const & frag : batch) {
+      ring->write(frag);
+    }
+    return;
+  }
+  if (RMAChannel * channel = channelFor_(dest)) {
+    // Likewise, each Fragment takes a slot of its own.
+    for (auto const & frag : batch) {
+      putTo_(*channel, frag, dest);
+    }
+    return;
+  }
+  SendMeas sm;
+  size_t buffer_idx = findAvailable(dest);
+  sm.found(batch.front().sequenceID(), buffer_idx, dest);
+  releasePersistent_(buffer_idx);
+  Fragments & curbatch = batch_payload_[buffer_idx];
+  curbatch = std::move(batch);
+  payload_[buffer_idx] = Fragment();
+  shared_payload_[buffer_idx].reset();
+  // Describe the Fragments where they lie, so MPI gathers them
+  // directly instead of us packing them into a contiguous buffer.
+  // (MPI copies the description, so it can be reused straight away.)
+  int nFrags = curbatch.size();
+  batch_lengths_.resize(nFrags);
+  batch_displacements_.resize(nFrags);
+  for (int i = 0; i < nFrags; ++i) {
+    batch_lengths_[i] = curbatch[i].size() * sizeof(Fragment::value_type);
+    MPI_Get_address(&*curbatch[i].headerBegin(), &batch_displacements_[i]);
+  }
+  MPI_Datatype batch_type;
+  MPI_Type_create_hindexed(nFrags, &batch_lengths_[0], &batch_displacements_[0],
+                           MPI_BYTE, &batch_type);
+  MPI_Type_commit(&batch_type);
+  TRACE( 5, "sendBatchTo_ before send dest=%lu nFrags=%d", dest, nFrags );
+  if (! synchronous_sends_) {
+    MPI_Isend(MPI_BOTTOM, 1, batch_type, dest, MPITag::BATCH,
+              MPI_COMM_WORLD, &reqs_[buffer_idx]);
+  }
+  else {
+    MPI_Send(MPI_BOTTOM, 1, batch_type, dest, MPITag::BATCH,
+             MPI_COMM_WORLD);
+  }
+  // Freeing only marks the type for deallocation; a pending send
+  // that uses it still completes normally.
+  MPI_Type_free(&batch_type);
+  TRACE( 5, "sendBatchTo_ COMPLETE" );
+  Debug << "send batch COMPLETE: "
+        << " buffer_idx=" << buffer_idx
+        << " nFrags=" << nFrags
+        << " dest=" << dest
+        << " first sequenceID=" << curbatch.front().sequenceID()
+        << flusher;
+}
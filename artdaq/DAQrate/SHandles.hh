@@ -4,14 +4,24 @@
 #include "artdaq-core/Data/Fragment.hh"
 #include "artdaq-core/Data/Fragments.hh"
 #include "artdaq/DAQrate/MPITag.hh"
+#include "artdaq/DAQrate/RMAChannel.hh"
+#include "artdaq/DAQrate/RoutingPolicy.hh"
+#include "artdaq/DAQrate/SharedMemoryRing.hh"
+#include "artdaq/DAQrate/TCPTransport.hh"
+#include "artdaq/DAQrate/detail/ChunkHeader.hh"
 #include "artdaq/DAQrate/detail/FragCounter.hh"
+#include "artdaq/DAQrate/detail/PersistentRequest.hh"
 
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "artdaq/DAQrate/quiet_mpi.hh"
 
 // SHandles handles the transmission of Fragments to one or more receivers in a
 // round-robin fashion. Multiple receivers must have consecutive rank numbers.
+// The receiver for each sequence ID is chosen by a RoutingPolicy, which
+// defaults to sequence_id % dest_count.
 
 namespace artdaq {
   class SHandles;
@@ -22,17 +32,30 @@ public:
   typedef std::vector<MPI_Request> Requests;
 
   // buffer_count is the number of MPI_Request objects that will be used.
-  // Fragments with dataSize() greater than max_payload_size will not be sent.
+  // Fragments with dataSize() greater than max_payload_size are sent over
+  // MPI in several chunks, which the receiver reassembles; through
+  // shared memory or an RMAChannel they cannot be sent at all.
   // dest_count is the number of receivers used in the round-robin algorithm
   // dest_start is the rank of the first receiver
   // broadcast_sends determines whether fragments will be sent to all
   // destinations or will use the round-robin algorithm
+  // shared_memory sends to destinations on the same node (see
+  // Locality.hh) through a SharedMemoryRing instead of MPI; the
+  // receivers must have been created with shared_memory as well.
+  // persistent_requests sends single Fragments with a persistent request
+  // per buffer (MPI_Send_init, then MPI_Start for each message) instead
+  // of a new MPI_Isend each time. Each Fragment is copied into its
+  // buffer, which stays in place, so the request can be restarted as
+  // long as the size and destination are unchanged; this pays off for
+  // small Fragments of steady size.
   SHandles(size_t buffer_count,
            uint64_t max_payload_size,
            size_t dest_count,
            size_t dest_start,
            bool broadcast_sends = false,
-           bool synchronous_sends = true);
+           bool synchronous_sends = true,
+           bool shared_memory = false,
+           bool persistent_requests = false);
 
   // Make sure we clean up and wait for in-flight sends.
   ~SHandles();
@@ -41,6 +64,70 @@ public:
   // the Fragment was sent.
   size_t sendFragment(Fragment &&);
 
+  // Send all the given Fragments. Fragments going to the same
+  // destination are combined into as few MPI messages as possible
+  // (each no larger than a single max-size Fragment) using a derived
+  // datatype, so no packing copy is made. With broadcast_sends, this
+  // is equivalent to calling sendFragment() for each Fragment.
+  void sendFragments(FragmentPtrs && frags);
+
+  // Replace the RoutingPolicy used to choose destinations. The policy
+  // must cover the same destination ranks as this SHandles.
+  void setRoutingPolicy(std::unique_ptr<RoutingPolicy> && policy);
+
+  // Send only to the destinations marked in active (one entry each, in
+  // rank order; see receiveMembership() in RoutingPolicy.hh). The rest
+  // get no Fragments, broadcast or routed (the routing policy, now or
+  // set later, is wrapped in an ActiveSetRoutingPolicy), and no EOD
+  // Fragment, and take no part in useOneSided(), enableLatencyStamps()
+  // or useCredits(). Must be called before any of those and before the
+  // first send.
+  void setActiveDestinations(std::vector<bool> const & active);
+
+  // Send to every destination over TCP instead of MPI, identifying
+  // ourselves as source_rank; dest_endpoints holds the "host:port" of
+  // each destination, in rank order. The receivers must have been
+  // created with a tcp_port. Must be called before the first send.
+  void useTCP(int source_rank,
+              std::vector<std::string> const & dest_endpoints);
+
+  // Put Fragments for the destinations not reached through shared
+  // memory directly into their memory, through an RMAChannel each,
+  // instead of sending messages. The receivers must have been created
+  // with one_sided. This is collective over sender_comm, which must
+  // contain exactly the sending ranks, and over the receivers; it must
+  // be called before the first send.
+  void useOneSided(MPI_Comm sender_comm);
+
+  // Stamp each Fragment sent through two-sided MPI with the time of
+  // sending, as an extra word after it, for the receivers to measure
+  // latency with; first answer clock_rounds clock pings from each
+  // destination (see ClockOffset.hh), which must have been created with
+  // the same clock_sync_rounds. Persistent, batched and chunked sends,
+  // and Fragments of the maximum size, go unstamped; so does everything
+  // over TCP, for which this does nothing. Must be called before the
+  // first send, after useOneSided() if that is used.
+  void enableLatencyStamps(size_t clock_rounds);
+
+  // Send to each destination reached through two-sided MPI only while
+  // holding credits granted by it (see RHandles::useCredits()). Every
+  // message takes one, whether a single Fragment, a batch or a chunk;
+  // with none left we wait for a grant, which counts as slot wait time.
+  // EOD Fragments need no credit. The destructor waits for each such
+  // destination to close its grants. Does nothing over TCP. Must be
+  // called before the first send.
+  void useCredits();
+
+  // Limit the search for a free send slot to spin_rounds passes of
+  // MPI_Test over all slots, after which we block in MPI_Waitany
+  // instead of burning the CPU. Zero (the default) spins until a slot
+  // frees up.
+  void setSpinRounds(size_t spin_rounds);
+
+  // Total time, in seconds, spent waiting for credits from, or for a
+  // send slot to be freed by a send to, the destination of the given rank.
+  double slotWaitTime(size_t rank) const;
+
   // How many fragments have been sent using this SHandles object?
   size_t count() const;
 
@@ -58,15 +145,61 @@ private:
   void sendEODFrag(size_t dest, size_t numFragmentsSent);
 
   // Calculate where the fragment with this sequenceID should go.
-  size_t calcDest(Fragment::sequence_id_t) const;
+  size_t calcDest(Fragment::sequence_id_t);
+
+  // Identify an available buffer for a send to dest. Time spent waiting
+  // for a slot is recorded against the destination of the send that was
+  // occupying it. With credits in use, first take one for the message
+  // unless use_credit is false, recording any wait against dest.
+  size_t findAvailable(size_t dest, bool use_credit = true);
 
-  // Identify an available buffer.
-  size_t findAvailable();
+  // Receive the next grant of credits from dest, waiting for it; false
+  // if dest has closed its grants instead.
+  bool receiveCredits_(size_t dest);
 
   // Send the fragment to the specified destination.
   void sendFragTo(Fragment && frag,
                   size_t dest);
 
+  // Send a Fragment shared with other destinations (broadcast mode); the
+  // slot keeps a reference until the send has completed.
+  void sendSharedTo_(std::shared_ptr<Fragment> const & frag,
+                     size_t dest);
+
+  // Send a Fragment too large for one receive buffer as a series of
+  // MPITag::INCOMPLETE messages, each a ChunkHeader and a slice of the
+  // Fragment; every slot used keeps a reference until its send is done.
+  void sendChunked_(std::shared_ptr<Fragment> const & frag,
+                    size_t dest);
+
+  // Send several Fragments to the specified destination as one message.
+  void sendBatchTo_(Fragments && batch,
+                    size_t dest);
+
+  // The ring to use for dest, attaching to it on first use, or null if
+  // dest is reached through MPI.
+  SharedMemoryRing * ringFor_(size_t dest);
+
+  // Start the persistent request of buffer buffer_idx sending its
+  // Fragment to dest, first (re)creating it if it does not match.
+  void startPersistent_(size_t buffer_idx, size_t dest);
+
+  // Free any persistent request held by the buffer, before it is used
+  // for a non-persistent send.
+  void releasePersistent_(size_t buffer_idx);
+
+  // Send buffer buffer_idx's Fragment to dest, followed by its send
+  // time if stamping (and there is room for it at the receiver).
+  void sendPayload_(size_t buffer_idx, size_t dest);
+
+
+  // The one-sided channel to dest, or null if there is none.
+  RMAChannel * channelFor_(size_t dest);
+
+  // Put the Fragment into the channel to dest, waiting for a free slot
+  // (and recording the wait) if need be.
+  void putTo_(RMAChannel & channel, Fragment const & frag, size_t dest);
+
   size_t const buffer_count_;
   uint64_t const max_payload_size_;
   size_t const dest_count_;
@@ -75,9 +208,34 @@ private:
   detail::FragCounter sent_frag_count_;
   bool broadcast_sends_;
   bool synchronous_sends_;
+  std::unique_ptr<RoutingPolicy> routing_policy_;
+  size_t spin_rounds_;
+  std::vector<double> slot_wait_; // Seconds waited, per destination.
+  int my_rank_;
+  std::vector<bool> local_dest_; // Destinations reached via shared memory.
+  std::vector<bool> active_dest_; // Destinations taking part.
+  std::vector<std::unique_ptr<SharedMemoryRing>> shm_rings_;
+  std::vector<std::unique_ptr<RMAChannel>> rma_channels_; // By destination index.
+  std::unique_ptr<TCPSender> tcp_sender_; // Null unless sending over TCP.
 
   Requests reqs_;
+  std::vector<size_t> slot_dest_; // Destination index of each slot's latest send.
+  bool const persistent_requests_;
+  // What each buffer's persistent request was made for (if in use).
+  std::vector<detail::PersistentRequest> persistent_;
   Fragments payload_;
+  std::vector<Fragments> batch_payload_; // Fragments of in-flight batches.
+  // Describing a batch to MPI; reused from one batch to the next.
+  std::vector<int> batch_lengths_;
+  std::vector<MPI_Aint> batch_displacements_;
+  std::vector<std::shared_ptr<Fragment>> shared_payload_; // Broadcast or chunked Fragments.
+  std::vector<detail::ChunkHeader> chunk_headers_; // Of in-flight chunks.
+  uint64_t next_chunk_stream_; // See ChunkHeader.hh.
+  bool stamp_latency_;
+  std::vector<int64_t> send_stamps_; // Of in-flight stamped sends.
+  bool use_credits_;
+  std::vector<size_t> credits_; // Unused credits, per destination.
+  std::vector<bool> credits_closed_; // Per destination.
 };
 
 inline
@@ -88,6 +246,14 @@ count() const
   return sent_frag_count_.count();
 }
 
+inline
+double
+artdaq::SHandles::
+slotWaitTime(size_t rank) const
+{
+  return slot_wait_[rank - dest_start_];
+}
+
 inline
 size_t
 artdaq::SHandles::
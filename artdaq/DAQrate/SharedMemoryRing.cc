@@ -0,0 +1,253 @@
+#include "artdaq/DAQrate/SharedMemoryRing.hh"
+
+#include "artdaq/DAQrate/Locality.hh"
+#include "cetlib/exception.h"
+#include "trace.h"		// TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+  // Written where a Fragment would not fit before the end of the ring;
+  // the reader skips to the start. No Fragment header has this value.
+  artdaq::RawDataType const WRAP_MARKER = ~artdaq::RawDataType(0);
+  uint64_t const RING_MAGIC = 0x6172746471726e67; // "artdqrng"
+
+  enum : uint64_t { RING_CREATING = 0, RING_READY = 1, RING_CLOSED = 2 };
+}
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "SharedMemoryRing needs lock-free 64-bit atomics.");
+
+// The control block at the start of the segment. head and tail count
+// words ever read and written; they are kept on separate cache lines
+// since each is written by a different process.
+struct artdaq::SharedMemoryRing::Header {
+  uint64_t magic;
+  uint64_t capacity;
+  std::atomic<uint64_t> state;
+  char pad0[64 - 3 * sizeof(uint64_t)];
+  std::atomic<uint64_t> head;
+  char pad1[64 - sizeof(uint64_t)];
+  std::atomic<uint64_t> tail;
+  char pad2[64 - sizeof(uint64_t)];
+};
+
+std::unique_ptr<artdaq::SharedMemoryRing>
+artdaq::SharedMemoryRing::
+create(int src, int dest, size_t capacity_words)
+{
+  std::unique_ptr<SharedMemoryRing> ring(new SharedMemoryRing(segmentName_(src, dest), true));
+  shm_unlink(ring->name_.c_str());
+  int fd = shm_open(ring->name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    throw cet::exception("SharedMemoryRing")
+      << "Unable to create shared memory segment " << ring->name_
+      << ": " << strerror(errno);
+  }
+  size_t bytes = sizeof(Header) + capacity_words * sizeof(RawDataType);
+  if (ftruncate(fd, bytes) != 0) {
+    close(fd);
+    shm_unlink(ring->name_.c_str());
+    throw cet::exception("SharedMemoryRing")
+      << "Unable to size shared memory segment " << ring->name_
+      << " to " << bytes << " bytes: " << strerror(errno);
+  }
+  ring->map_(fd, bytes);
+  close(fd);
+  Header * header = new (ring->segment_) Header;
+  header->magic = RING_MAGIC;
+  header->capacity = capacity_words;
+  header->head.store(0);
+  header->tail.store(0);
+  ring->capacity_ = capacity_words;
+  header->state.store(RING_READY, std::memory_order_release);
+  return ring;
+}
+
+std::unique_ptr<artdaq::SharedMemoryRing>
+artdaq::SharedMemoryRing::
+attach(int src, int dest, double timeout_sec)
+{
+  std::unique_ptr<SharedMemoryRing> ring(new SharedMemoryRing(segmentName_(src, dest), false));
+  auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>
+    (std::chrono::duration<double>(timeout_sec));
+  while (true) {
+    int fd = shm_open(ring->name_.c_str(), O_RDWR, 0600);
+    if (fd >= 0) {
+      struct stat info;
+      if (fstat(fd, &info) == 0 &&
+          static_cast<size_t>(info.st_size) > sizeof(Header)) {
+        ring->map_(fd, info.st_size);
+        close(fd);
+        if (ring->header_->magic == RING_MAGIC &&
+            ring->header_->state.load(std::memory_order_acquire) == RING_READY) {
+          ring->capacity_ = ring->header_->capacity;
+          return ring;
+        }
+        // Still being set up, or left over from a previous reader.
+        munmap(ring->segment_, ring->segment_bytes_);
+        ring->segment_ = nullptr;
+      }
+      else {
+        close(fd);
+      }
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      throw cet::exception("SharedMemoryRing")
+        << "Timed out after " << timeout_sec
+        << " seconds waiting for the receiver to create " << ring->name_ << ".";
+    }
+    usleep(1000);
+  }
+}
+
+artdaq::SharedMemoryRing::
+SharedMemoryRing(std::string const & name, bool owner)
+  :
+  name_(name),
+  owner_(owner),
+  segment_(nullptr),
+  segment_bytes_(0),
+  header_(nullptr),
+  data_(nullptr),
+  capacity_(0)
+{
+}
+
+artdaq::SharedMemoryRing::
+~SharedMemoryRing()
+{
+  if (segment_ == nullptr) { return; }
+  if (owner_) {
+    header_->state.store(RING_CLOSED, std::memory_order_release);
+  }
+  munmap(segment_, segment_bytes_);
+  if (owner_) {
+    shm_unlink(name_.c_str());
+  }
+}
+
+void
+artdaq::SharedMemoryRing::
+map_(int fd, size_t bytes)
+{
+  void * segment = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+  if (segment == MAP_FAILED) {
+    throw cet::exception("SharedMemoryRing")
+      << "Unable to map shared memory segment " << name_
+      << ": " << strerror(errno);
+  }
+  segment_ = segment;
+  segment_bytes_ = bytes;
+  header_ = static_cast<Header *>(segment);
+  data_ = reinterpret_cast<RawDataType *>(static_cast<char *>(segment) + sizeof(Header));
+}
+
+std::string
+artdaq::SharedMemoryRing::
+segmentName_(int src, int dest)
+{
+  std::ostringstream name;
+  name << "/artdaq_" << std::hex << jobToken() << std::dec
+       << "_" << src << "_" << dest;
+  return name.str();
+}
+
+size_t
+artdaq::SharedMemoryRing::
+maxFragmentWords() const
+{
+  // At worst a Fragment must skip the tail end of the ring before it,
+  // so only half the ring is guaranteed to be usable by one Fragment.
+  return capacity_ / 2;
+}
+
+void
+artdaq::SharedMemoryRing::
+write(Fragment const & frag)
+{
+  size_t words = frag.size();
+  if (words > maxFragmentWords()) {
+    throw cet::exception("SharedMemoryRing")
+      << "Fragment of " << words << " words does not fit in ring "
+      << name_ << " (at most " << maxFragmentWords() << " words).";
+  }
+  uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+  size_t offset = tail % capacity_;
+  size_t skip = (offset + words > capacity_) ? capacity_ - offset : 0;
+
+  // Wait for the reader to free enough room.
+  size_t spins = 0;
+  while (tail + skip + words -
+         header_->head.load(std::memory_order_acquire) > capacity_) {
+    if (header_->state.load(std::memory_order_acquire) != RING_READY) {
+      throw cet::exception("SharedMemoryRing")
+        << "The receiver closed ring " << name_ << " while data was still being sent.";
+    }
+    if (++spins < 1000) {
+      std::this_thread::yield();
+    }
+    else {
+      usleep(10);
+    }
+  }
+
+  if (skip != 0) {
+    data_[offset] = WRAP_MARKER;
+    tail += skip;
+    offset = 0;
+  }
+  std::memcpy(data_ + offset, &*frag.headerBegin(), words * sizeof(RawDataType));
+  header_->tail.store(tail + words, std::memory_order_release);
+  TRACE( 5, "SharedMemoryRing::write words=%lu tail=%lu", words, tail + words );
+}
+
+bool
+artdaq::SharedMemoryRing::
+empty() const
+{
+  // A wrap marker is only ever published together with the Fragment
+  // after it, so any unread words mean a Fragment.
+  return header_->head.load(std::memory_order_relaxed) ==
+    header_->tail.load(std::memory_order_acquire);
+}
+
+bool
+artdaq::SharedMemoryRing::
+read(Fragment & frag)
+{
+  uint64_t head = header_->head.load(std::memory_order_relaxed);
+  size_t offset;
+  while (true) {
+    if (head == header_->tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    offset = head % capacity_;
+    if (data_[offset] != WRAP_MARKER) { break; }
+    head += capacity_ - offset;
+    header_->head.store(head, std::memory_order_release);
+  }
+  size_t const header_words = detail::RawFragmentHeader::num_words();
+  size_t words =
+    reinterpret_cast<detail::RawFragmentHeader const *>(data_ + offset)->word_count;
+  if (words < header_words || offset + words > capacity_) {
+    throw cet::exception("SharedMemoryRing")
+      << "Corrupt Fragment of " << words << " words at word "
+      << offset << " of ring " << name_ << ".";
+  }
+  frag.resize(words - header_words);
+  std::memcpy(&*frag.headerBegin(), data_ + offset, words * sizeof(RawDataType));
+  header_->head.store(head + words, std::memory_order_release);
+  return true;
+}
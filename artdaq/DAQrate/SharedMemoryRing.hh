@@ -0,0 +1,72 @@
+#ifndef artdaq_DAQrate_SharedMemoryRing_hh
+#define artdaq_DAQrate_SharedMemoryRing_hh
+
+#include "artdaq-core/Data/Fragment.hh"
+
+#include <memory>
+#include <string>
+
+// SharedMemoryRing passes Fragments from one process to another on the
+// same node through a POSIX shared-memory segment, without going through
+// MPI. Each ring has exactly one writer and one reader. The writer copies
+// each Fragment straight into the ring and the reader copies it out into
+// its own Fragment, so a transfer costs two memcpys and no MPI matching
+// or progress overhead.
+//
+// The reader creates the ring and destroys it; the writer attaches to
+// an existing ring, waiting for the reader to create it if necessary.
+
+namespace artdaq {
+  class SharedMemoryRing;
+}
+
+class artdaq::SharedMemoryRing {
+public:
+  // Create the ring carrying Fragments from rank src to rank dest, able
+  // to hold capacity_words words of Fragments. The segment name includes
+  // jobToken() (see Locality.hh), so concurrent jobs, or processes, do
+  // not collide; any stale segment of the same name is replaced.
+  static std::unique_ptr<SharedMemoryRing>
+  create(int src, int dest, size_t capacity_words);
+
+  // Attach to the ring from rank src to rank dest, waiting up to
+  // timeout_sec for it to be created.
+  static std::unique_ptr<SharedMemoryRing>
+  attach(int src, int dest, double timeout_sec);
+
+  ~SharedMemoryRing();
+
+  SharedMemoryRing(SharedMemoryRing const &) = delete;
+  SharedMemoryRing & operator=(SharedMemoryRing const &) = delete;
+
+  // Writer side: copy the Fragment into the ring, waiting for room if
+  // the reader has fallen behind.
+  void write(Fragment const & frag);
+
+  // Reader side: move the next Fragment into frag, if there is one.
+  bool read(Fragment & frag);
+
+  // Reader side: whether read() would find nothing.
+  bool empty() const;
+
+  // The largest Fragment, in words including its header, that fits.
+  size_t maxFragmentWords() const;
+
+private:
+  struct Header;
+
+  SharedMemoryRing(std::string const & name, bool owner);
+
+  static std::string segmentName_(int src, int dest);
+  void map_(int fd, size_t bytes);
+
+  std::string const name_;
+  bool const owner_;
+  void * segment_;
+  size_t segment_bytes_;
+  Header * header_;
+  RawDataType * data_;
+  size_t capacity_; // In words.
+};
+
+#endif /* artdaq_DAQrate_SharedMemoryRing_hh */
@@ -0,0 +1,435 @@
+#include "artdaq/DAQrate/TCPTransport.hh"
+
+#include "cetlib/exception.h"
+#include "messagefacility/MessageLogger/MessageLogger.h"
+#include "trace.h"		// TRACE
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+  // First thing on every connection: TCP_HELLO_MAGIC, then the
+  // sender's source rank.
+  uint32_t const TCP_HELLO_MAGIC = 0x41525444; // "ARTD"
+  int const MAX_EPOLL_EVENTS = 16;
+
+  void writeAll(int fd, struct iovec * iov, int iov_count)
+  {
+    while (iov_count > 0) {
+      ssize_t written = writev(fd, iov, std::min(iov_count, IOV_MAX));
+      if (written < 0) {
+        if (errno == EINTR) { continue; }
+        throw cet::exception("TCPTransport")
+          << "Error writing to socket: " << strerror(errno);
+      }
+      // Skip what has gone, and adjust a partially written entry.
+      while (iov_count > 0 && static_cast<size_t>(written) >= iov->iov_len) {
+        written -= iov->iov_len;
+        ++iov;
+        --iov_count;
+      }
+      if (iov_count > 0) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+        iov->iov_len -= written;
+      }
+    }
+  }
+}
+
+artdaq::TCPSender::
+TCPSender(int source_rank,
+          size_t dest_start,
+          std::vector<std::string> const & endpoints,
+          double connect_timeout_sec)
+  :
+  source_rank_(source_rank),
+  dest_start_(dest_start),
+  endpoints_(endpoints),
+  connect_timeout_sec_(connect_timeout_sec),
+  sockets_(endpoints.size(), -1),
+  iov_()
+{
+}
+
+artdaq::TCPSender::
+~TCPSender()
+{
+  for (int fd : sockets_) {
+    if (fd >= 0) { close(fd); }
+  }
+}
+
+int
+artdaq::TCPSender::
+connect_(size_t index)
+{
+  std::string const & endpoint = endpoints_[index];
+  size_t colon = endpoint.rfind(':');
+  if (colon == std::string::npos) {
+    throw cet::exception("TCPTransport")
+      << "Endpoint \"" << endpoint << "\" is not of the form host:port.";
+  }
+  std::string host = endpoint.substr(0, colon);
+  std::string port = endpoint.substr(colon + 1);
+  struct addrinfo hints;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>
+    (std::chrono::duration<double>(connect_timeout_sec_));
+  while (true) {
+    struct addrinfo * addresses = nullptr;
+    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (rc != 0) {
+      throw cet::exception("TCPTransport")
+        << "Unable to resolve \"" << endpoint << "\": " << gai_strerror(rc);
+    }
+    int fd = -1;
+    for (struct addrinfo * ai = addresses; ai != nullptr; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0) { continue; }
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) { break; }
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      uint32_t hello[2] = { TCP_HELLO_MAGIC, static_cast<uint32_t>(source_rank_) };
+      struct iovec iov = { hello, sizeof(hello) };
+      writeAll(fd, &iov, 1);
+      TRACE( 5, "TCPSender connected to %s", endpoint.c_str() );
+      return fd;
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      throw cet::exception("TCPTransport")
+        << "Unable to connect to " << endpoint << " within "
+        << connect_timeout_sec_ << " seconds.";
+    }
+    usleep(100000);
+  }
+}
+
+void
+artdaq::TCPSender::
+send(size_t dest, std::vector<Fragment const *> const & frags)
+{
+  for (Fragment const * frag : frags) {
+    gather_(*frag);
+  }
+  write_(dest);
+}
+
+void
+artdaq::TCPSender::
+send(size_t dest, Fragments const & frags)
+{
+  for (Fragment const & frag : frags) {
+    gather_(frag);
+  }
+  write_(dest);
+}
+
+void
+artdaq::TCPSender::
+send(size_t dest, Fragment const & frag)
+{
+  gather_(frag);
+  write_(dest);
+}
+
+void
+artdaq::TCPSender::
+gather_(Fragment const & frag)
+{
+  // Each Fragment's header and payload are contiguous, so one entry
+  // per Fragment; writev gathers them into as few segments as it can.
+  struct iovec entry;
+  entry.iov_base = const_cast<RawDataType *>(&*frag.headerBegin());
+  entry.iov_len = frag.size() * sizeof(RawDataType);
+  iov_.push_back(entry);
+}
+
+void
+artdaq::TCPSender::
+write_(size_t dest)
+{
+  if (iov_.empty()) { return; }
+  size_t index = dest - dest_start_;
+  try {
+    if (sockets_[index] < 0) {
+      sockets_[index] = connect_(index);
+    }
+    writeAll(sockets_[index], &iov_[0], iov_.size());
+  }
+  catch (...) {
+    iov_.clear();
+    throw;
+  }
+  iov_.clear(); // Keeps its capacity for the next send.
+}
+
+// The read state of one incoming connection. Each Fragment's header is
+// read first, to learn its size; the rest is then read directly into
+// the Fragment's storage.
+struct artdaq::TCPReceiver::Connection {
+  Connection(int fd_in)
+    :
+    fd(fd_in),
+    src(-1),
+    hello_bytes(0),
+    header(detail::RawFragmentHeader::num_words()),
+    header_bytes(0),
+    in_fragment(false),
+    frag(),
+    frag_bytes(0),
+    frag_total(0)
+  { }
+
+  int fd;
+  int src; // -1 until the sender has introduced itself.
+  uint32_t hello[2];
+  size_t hello_bytes;
+  std::vector<RawDataType> header;
+  size_t header_bytes;
+  bool in_fragment;
+  Fragment frag;
+  size_t frag_bytes;
+  size_t frag_total;
+};
+
+artdaq::TCPReceiver::
+TCPReceiver(int port, size_t src_count, size_t src_start,
+            size_t max_ready)
+  :
+  src_count_(src_count),
+  src_start_(src_start),
+  max_ready_(std::max<size_t>(max_ready, 1)),
+  listen_fd_(-1),
+  epoll_fd_(-1),
+  port_(port),
+  connections_(),
+  ready_()
+{
+  listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listen_fd_ < 0) {
+    throw cet::exception("TCPTransport")
+      << "Unable to create a socket: " << strerror(errno);
+  }
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in address;
+  std::memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) != 0 ||
+      listen(listen_fd_, src_count + 1) != 0) {
+    int error = errno;
+    close(listen_fd_);
+    throw cet::exception("TCPTransport")
+      << "Unable to listen on port " << port << ": " << strerror(error);
+  }
+  socklen_t length = sizeof(address);
+  getsockname(listen_fd_, reinterpret_cast<struct sockaddr *>(&address), &length);
+  port_ = ntohs(address.sin_port);
+
+  epoll_fd_ = epoll_create1(0);
+  if (epoll_fd_ < 0) {
+    int error = errno;
+    close(listen_fd_);
+    throw cet::exception("TCPTransport")
+      << "Unable to create an epoll instance: " << strerror(error);
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr; // The listening socket.
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event) != 0) {
+    int error = errno;
+    close(epoll_fd_);
+    close(listen_fd_);
+    throw cet::exception("TCPTransport")
+      << "Unable to watch the socket listening on port " << port_
+      << ": " << strerror(error);
+  }
+}
+
+artdaq::TCPReceiver::
+~TCPReceiver()
+{
+  for (auto & conn : connections_) {
+    if (conn->fd >= 0) { close(conn->fd); }
+  }
+  close(epoll_fd_);
+  close(listen_fd_);
+}
+
+int
+artdaq::TCPReceiver::
+receive(Fragment & frag, size_t timeout_usec)
+{
+  typedef std::chrono::steady_clock clock;
+  auto const deadline = clock::now() + std::chrono::microseconds(timeout_usec);
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  while (ready_.empty()) {
+    int wait_ms = -1;
+    if (timeout_usec > 0) {
+      auto remaining = std::chrono::duration_cast<std::chrono::microseconds>
+        (deadline - clock::now()).count();
+      if (remaining <= 0) { return -1; }
+      wait_ms = (remaining + 999) / 1000;
+    }
+    int count = epoll_wait(epoll_fd_, events, MAX_EPOLL_EVENTS, wait_ms);
+    if (count < 0) {
+      if (errno == EINTR) { continue; }
+      throw cet::exception("TCPTransport")
+        << "epoll_wait failed: " << strerror(errno);
+    }
+    for (int i = 0; i < count; ++i) {
+      Connection * conn = static_cast<Connection *>(events[i].data.ptr);
+      if (conn == nullptr) {
+        accept_();
+      }
+      else if (! readFrom_(*conn)) {
+        close_(*conn);
+      }
+    }
+  }
+  frag.swap(ready_.front().second);
+  int src = ready_.front().first;
+  ready_.pop_front();
+  return src;
+}
+
+void
+artdaq::TCPReceiver::
+accept_()
+{
+  while (true) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == EINTR) { continue; }
+      return; // EAGAIN: no more pending connections.
+    }
+    std::unique_ptr<Connection> conn(new Connection(fd));
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = conn.get();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+      mf::LogError("TCPTransport")
+        << "Unable to watch a new connection; closing it: " << strerror(errno);
+      close(fd);
+      continue;
+    }
+    connections_.emplace_back(std::move(conn));
+  }
+}
+
+bool
+artdaq::TCPReceiver::
+readFrom_(Connection & conn)
+{
+  size_t const header_total = conn.header.size() * sizeof(RawDataType);
+  while (true) {
+    if (ready_.size() >= max_ready_) {
+      // Leave the rest in the socket until receive() catches up; the
+      // connection stays readable, so epoll reports it again.
+      return true;
+    }
+    char * dest;
+    size_t wanted;
+    if (conn.src < 0) {
+      dest = reinterpret_cast<char *>(conn.hello) + conn.hello_bytes;
+      wanted = sizeof(conn.hello) - conn.hello_bytes;
+    }
+    else if (! conn.in_fragment) {
+      dest = reinterpret_cast<char *>(&conn.header[0]) + conn.header_bytes;
+      wanted = header_total - conn.header_bytes;
+    }
+    else {
+      dest = reinterpret_cast<char *>(&*conn.frag.headerBegin()) + conn.frag_bytes;
+      wanted = conn.frag_total - conn.frag_bytes;
+    }
+    ssize_t got = read(conn.fd, dest, wanted);
+    if (got == 0) {
+      return false; // Closed by the sender.
+    }
+    if (got < 0) {
+      if (errno == EINTR) { continue; }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) { return true; }
+      throw cet::exception("TCPTransport")
+        << "Error reading from source " << conn.src << ": " << strerror(errno);
+    }
+
+    if (conn.src < 0) {
+      conn.hello_bytes += got;
+      if (conn.hello_bytes < sizeof(conn.hello)) { continue; }
+      if (conn.hello[0] != TCP_HELLO_MAGIC ||
+          conn.hello[1] < src_start_ || conn.hello[1] >= src_start_ + src_count_) {
+        // Not one of our senders; the others are unaffected.
+        mf::LogWarning("TCPTransport")
+          << "Closing a connection from an unexpected sender (magic 0x"
+          << std::hex << conn.hello[0] << std::dec << ", rank "
+          << conn.hello[1] << ").";
+        return false;
+      }
+      conn.src = conn.hello[1];
+      TRACE( 6, "TCPReceiver accepted source %d", conn.src );
+    }
+    else if (! conn.in_fragment) {
+      conn.header_bytes += got;
+      if (conn.header_bytes < header_total) { continue; }
+      size_t words =
+        reinterpret_cast<detail::RawFragmentHeader const *>(&conn.header[0])->word_count;
+      if (words < conn.header.size()) {
+        throw cet::exception("TCPTransport")
+          << "Corrupt Fragment header (" << words << " words) from source "
+          << conn.src << ".";
+      }
+      conn.frag.resize(words - conn.header.size());
+      std::copy(conn.header.begin(), conn.header.end(), conn.frag.headerBegin());
+      conn.frag_bytes = header_total;
+      conn.frag_total = words * sizeof(RawDataType);
+      conn.in_fragment = true;
+    }
+    else {
+      conn.frag_bytes += got;
+    }
+
+    if (conn.in_fragment && conn.frag_bytes == conn.frag_total) {
+      ready_.emplace_back(conn.src, std::move(conn.frag));
+      conn.frag = Fragment();
+      conn.in_fragment = false;
+      conn.header_bytes = 0;
+    }
+  }
+}
+
+void
+artdaq::TCPReceiver::
+close_(Connection & conn)
+{
+  if (conn.in_fragment || conn.header_bytes != 0) {
+    mf::LogWarning("TCPTransport")
+      << "Source " << conn.src << " closed its connection in the middle of a Fragment.";
+  }
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd, nullptr);
+  close(conn.fd);
+  conn.fd = -1;
+}
@@ -0,0 +1,103 @@
+#ifndef artdaq_DAQrate_TCPTransport_hh
+#define artdaq_DAQrate_TCPTransport_hh
+
+#include "artdaq-core/Data/Fragment.hh"
+#include "artdaq-core/Data/Fragments.hh"
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/uio.h>
+
+// TCPSender and TCPReceiver carry Fragments over TCP sockets, as an
+// alternative to MPI for SHandles and RHandles. Each sender opens one
+// connection per destination and introduces itself with its source
+// rank; after that the stream is simply Fragments back to back, each
+// delimited by the word count in its header. The ranks are only
+// identifiers here: no MPI is needed to use these classes.
+
+namespace artdaq {
+  class TCPSender;
+  class TCPReceiver;
+}
+
+class artdaq::TCPSender {
+public:
+  // endpoints[i] is the "host:port" of the receiver for destination
+  // dest_start + i. Connections are made on first use, retrying for up
+  // to connect_timeout_sec while the receiver starts up.
+  TCPSender(int source_rank,
+            size_t dest_start,
+            std::vector<std::string> const & endpoints,
+            double connect_timeout_sec = 30.0);
+  ~TCPSender();
+
+  TCPSender(TCPSender const &) = delete;
+  TCPSender & operator=(TCPSender const &) = delete;
+
+  // Send the Fragments to dest with as few scatter-gather writes as
+  // possible. Blocks until everything has been handed to the kernel.
+  void send(size_t dest, std::vector<Fragment const *> const & frags);
+  void send(size_t dest, Fragments const & frags);
+  void send(size_t dest, Fragment const & frag);
+
+private:
+  int connect_(size_t index);
+  // Add the Fragment to iov_, for the next write_().
+  void gather_(Fragment const & frag);
+  // Write out what has been gathered in iov_, and clear it.
+  void write_(size_t dest);
+
+  int const source_rank_;
+  size_t const dest_start_;
+  std::vector<std::string> const endpoints_;
+  double const connect_timeout_sec_;
+  std::vector<int> sockets_; // -1 until connected.
+  std::vector<struct iovec> iov_; // Reused from one send to the next.
+};
+
+class artdaq::TCPReceiver {
+public:
+  // Listen on port for connections from the sources src_start to
+  // src_start + src_count - 1. A port of 0 picks a free port. A
+  // connection that does not introduce itself as one of those sources
+  // is logged and closed. Once max_ready Fragments are waiting for
+  // receive(), no more are read, so the senders are held back by TCP
+  // flow control.
+  TCPReceiver(int port, size_t src_count, size_t src_start,
+              size_t max_ready = 64);
+  ~TCPReceiver();
+
+  TCPReceiver(TCPReceiver const &) = delete;
+  TCPReceiver & operator=(TCPReceiver const &) = delete;
+
+  // Put the next received Fragment in frag and return its source rank,
+  // waiting up to timeout_usec (forever if 0); -1 if none arrived.
+  int receive(Fragment & frag, size_t timeout_usec = 0);
+
+  // The port actually listened on.
+  int port() const { return port_; }
+
+private:
+  struct Connection;
+
+  void accept_();
+  // Read whatever is available, up to max_ready_ Fragments in ready_;
+  // false once the connection should be closed.
+  bool readFrom_(Connection & conn);
+  void close_(Connection & conn);
+
+  size_t const src_count_;
+  size_t const src_start_;
+  size_t const max_ready_; // Fragments read ahead of receive(), at most.
+  int listen_fd_;
+  int epoll_fd_;
+  int port_;
+  std::vector<std::unique_ptr<Connection>> connections_;
+  std::deque<std::pair<int, Fragment>> ready_; // With source rank.
+};
+
+#endif /* artdaq_DAQrate_TCPTransport_hh */
@@ -0,0 +1,30 @@
+#ifndef artdaq_DAQrate_detail_ChunkHeader_hh
+#define artdaq_DAQrate_detail_ChunkHeader_hh
+
+// A Fragment too large for a receive buffer is sent as several
+// MPITag::INCOMPLETE messages, each a ChunkHeader followed by a slice of
+// the Fragment's words (header included). The sender numbers the
+// Fragments it sends this way, so the receiver can tell the chunks of
+// one from those of the next even when their completions interleave.
+// It places each slice at its offset, whatever order the chunks
+// complete in, and has the whole Fragment once total_words words of
+// that stream have arrived.
+
+#include <cstddef>
+#include <cstdint>
+
+namespace artdaq {
+  namespace detail {
+    struct ChunkHeader;
+  }
+}
+
+struct artdaq::detail::ChunkHeader {
+  uint64_t stream_id;    // Which of the sender's chunked Fragments.
+  uint64_t offset_words; // Where this slice starts in the Fragment.
+  uint64_t total_words;  // Size of the whole Fragment.
+
+  static constexpr size_t num_words() { return 3; }
+};
+
+#endif /* artdaq_DAQrate_detail_ChunkHeader_hh */
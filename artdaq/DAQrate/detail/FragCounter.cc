@@ -14,3 +14,30 @@ computedSlot_(size_t slot) const
   }
   return slot - offset_;
 }
+
+std::vector<size_t>
+artdaq::detail::FragCounter::
+snapshot() const
+{
+  std::vector<size_t> counts;
+  std::vector<size_t> previous;
+  collect_(previous);
+  for (size_t tries = 1; tries < SNAPSHOT_TRIES; ++tries) {
+    collect_(counts);
+    if (counts == previous) {
+      break;
+    }
+    counts.swap(previous);
+  }
+  return previous;
+}
+
+void
+artdaq::detail::FragCounter::
+collect_(std::vector<size_t> & counts) const
+{
+  counts.resize(receipts_.size());
+  for (size_t i = 0; i < receipts_.size(); ++i) {
+    counts[i] = receipts_[i].value.load(std::memory_order_seq_cst);
+  }
+}
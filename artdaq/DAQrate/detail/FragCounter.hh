@@ -1,11 +1,17 @@
 #ifndef artdaq_DAQrate_detail_FragCounter_hh
 #define artdaq_DAQrate_detail_FragCounter_hh
 
-#include <algorithm>
-#include <condition_variable>
-#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <numeric>
 #include <vector>
 
+// FragCounter keeps a count per slot without locks: each slot is an
+// atomic counter padded to a cache line of its own, so threads counting
+// into different slots do not contend. count() and slotCount() read the
+// current values; snapshot() returns all the slots as they stood at one
+// instant, for reporting.
+
 namespace artdaq {
   namespace detail {
     class FragCounter;
@@ -22,31 +28,30 @@ public:
   size_t count() const;
   size_t slotCount(size_t slot) const;
 
+  // The count of every slot, in slot order, all as of the same moment.
+  // Since counts only grow, two passes reading the same values show
+  // those values held together in between; if counting never pauses
+  // long enough for that (after SNAPSHOT_TRIES passes), the last pass
+  // is returned, each value exact but not necessarily simultaneous.
+  std::vector<size_t> snapshot() const;
+
 private:
-  size_t computedSlot_(size_t slot) const;
+  static const size_t CACHE_LINE_BYTES = 64;
+  static const size_t SNAPSHOT_TRIES = 100;
 
-  typedef std::lock_guard<std::mutex> lock_t;
-  class SlotLock;
+  // Whatever the alignment of the storage, the padding keeps the
+  // counters of neighbouring slots on different cache lines.
+  struct Slot {
+    Slot() : value(0) { }
+    std::atomic<size_t> value;
+    char padding[CACHE_LINE_BYTES - sizeof(std::atomic<size_t>)];
+  };
 
-  size_t offset_;
-  std::vector<size_t> receipts_;
-  mutable std::mutex protectTotal_;
-  mutable std::vector<std::mutex> protectSlots_;
-};
+  size_t computedSlot_(size_t slot) const;
+  void collect_(std::vector<size_t> & counts) const;
 
-class artdaq::detail::FragCounter::SlotLock {
-public:
-  SlotLock(size_t computed_slot,
-           std::mutex & protectTotal,
-           std::vector<std::mutex> & protectSlots)
-    :
-    total_lock_(protectTotal),
-    slot_lock_(protectSlots[computed_slot])
-    {
-    }
-private:
-  lock_t total_lock_;
-  lock_t slot_lock_;
+  size_t offset_;
+  std::vector<Slot> receipts_;
 };
 
 inline
@@ -54,9 +59,7 @@ artdaq::detail::FragCounter::
 FragCounter(size_t nSlots, size_t offset)
   :
   offset_(offset),
-  receipts_(nSlots, 0),
-  protectTotal_(),
-  protectSlots_(nSlots)
+  receipts_(nSlots)
 {
 }
 
@@ -65,9 +68,7 @@ void
 artdaq::detail::FragCounter::
 incSlot(size_t slot)
 {
-  size_t cs(computedSlot_(slot));
-  SlotLock slot_lock(cs, protectTotal_, protectSlots_);
-  ++receipts_[cs];
+  incSlot(slot, 1);
 }
 
 inline
@@ -75,9 +76,7 @@ void
 artdaq::detail::FragCounter::
 incSlot(size_t slot, size_t inc)
 {
-  size_t cs(computedSlot_(slot));
-  SlotLock slot_lock(cs, protectTotal_, protectSlots_);
-  receipts_[cs] += inc;
+  receipts_[computedSlot_(slot)].value.fetch_add(inc, std::memory_order_relaxed);
 }
 
 inline
@@ -93,11 +92,13 @@ size_t
 artdaq::detail::FragCounter::
 count() const
 {
-  lock_t total_lock(protectTotal_);
   return
     std::accumulate(receipts_.begin(),
                     receipts_.end(),
-                    0);
+                    size_t(0),
+                    [](size_t sum, Slot const & s)
+                    { return sum + s.value.load(std::memory_order_acquire); }
+                   );
 }
 
 inline
@@ -105,9 +106,7 @@ size_t
 artdaq::detail::FragCounter::
 slotCount(size_t slot) const
 {
-  size_t cs(computedSlot_(slot));
-  SlotLock slot_lock(cs, protectTotal_, protectSlots_);
-  return receipts_[cs];
+  return receipts_[computedSlot_(slot)].value.load(std::memory_order_acquire);
 }
 
 #endif /* artdaq_DAQrate_detail_FragCounter_hh */
@@ -0,0 +1,117 @@
+#ifndef artdaq_DAQrate_detail_LatencyHistogram_hh
+#define artdaq_DAQrate_detail_LatencyHistogram_hh
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+// LatencyHistogram counts latencies in bins doubling in width: bin 0
+// holds everything under a microsecond (including the negative values a
+// clock offset error can produce), bin i in [2^(i-1), 2^i) microseconds,
+// and the last bin everything longer. Percentiles are the upper edge of
+// the bin in which they fall, so within a factor of two.
+
+namespace artdaq {
+  namespace detail {
+    class LatencyHistogram;
+  }
+}
+
+class artdaq::detail::LatencyHistogram {
+public:
+  static const size_t BIN_COUNT = 32; // Up to about 18 minutes.
+
+  LatencyHistogram();
+
+  void add(double seconds);
+  void reset();
+
+  size_t count() const;
+  std::vector<size_t> const & bins() const;
+
+  // Upper edge, in seconds, of the bin holding the given fraction (0 to
+  // 1) of the latencies; zero if there are none.
+  double percentile(double fraction) const;
+
+  // Upper edge, in seconds, of the given bin.
+  static double binEdge(size_t bin);
+
+private:
+  std::vector<size_t> bins_;
+  size_t count_;
+};
+
+inline
+artdaq::detail::LatencyHistogram::
+LatencyHistogram()
+  :
+  bins_(BIN_COUNT, 0),
+  count_(0)
+{
+}
+
+inline
+void
+artdaq::detail::LatencyHistogram::
+add(double seconds)
+{
+  double usec = seconds * 1e6;
+  size_t bin = 0;
+  if (usec >= 1.0) {
+    bin = std::min<size_t>(static_cast<size_t>(std::log2(usec)) + 1,
+                           BIN_COUNT - 1);
+  }
+  ++bins_[bin];
+  ++count_;
+}
+
+inline
+void
+artdaq::detail::LatencyHistogram::
+reset()
+{
+  bins_.assign(BIN_COUNT, 0);
+  count_ = 0;
+}
+
+inline
+size_t
+artdaq::detail::LatencyHistogram::
+count() const
+{
+  return count_;
+}
+
+inline
+std::vector<size_t> const &
+artdaq::detail::LatencyHistogram::
+bins() const
+{
+  return bins_;
+}
+
+inline
+double
+artdaq::detail::LatencyHistogram::
+binEdge(size_t bin)
+{
+  return std::ldexp(1.0, bin) * 1e-6;
+}
+
+inline
+double
+artdaq::detail::LatencyHistogram::
+percentile(double fraction) const
+{
+  if (count_ == 0) { return 0.0; }
+  size_t target = static_cast<size_t>(std::ceil(fraction * count_));
+  size_t seen = 0;
+  for (size_t bin = 0; bin < BIN_COUNT; ++bin) {
+    seen += bins_[bin];
+    if (seen >= target && seen > 0) { return binEdge(bin); }
+  }
+  return binEdge(BIN_COUNT - 1);
+}
+
+#endif /* artdaq_DAQrate_detail_LatencyHistogram_hh */
@@ -0,0 +1,47 @@
+#ifndef artdaq_DAQrate_detail_PersistentRequest_hh
+#define artdaq_DAQrate_detail_PersistentRequest_hh
+
+// PersistentRequest remembers what the persistent MPI request held in
+// one buffer slot was created for (buffer, size and peer), so that the
+// slot can simply MPI_Start it again while those stay the same, and
+// only pays for a new MPI_Send_init/MPI_Recv_init when they change.
+
+#include "artdaq/DAQrate/quiet_mpi.hh"
+
+namespace artdaq {
+  namespace detail {
+    struct PersistentRequest;
+  }
+}
+
+struct artdaq::detail::PersistentRequest {
+  PersistentRequest() : buffer(nullptr), bytes(0), peer(-1) { }
+
+  bool matches(void const * b, int n, int p) const
+  {
+    return b == buffer && n == bytes && p == peer;
+  }
+
+  void set(void const * b, int n, int p)
+  {
+    buffer = b;
+    bytes = n;
+    peer = p;
+  }
+
+  // Free the persistent request held in req, if there is one, so that
+  // req can be reused; an active request completes first.
+  void release(MPI_Request & req)
+  {
+    if (buffer != nullptr && req != MPI_REQUEST_NULL) {
+      MPI_Request_free(&req);
+    }
+    buffer = nullptr;
+  }
+
+  void const * buffer;
+  int bytes;
+  int peer;
+};
+
+#endif /* artdaq_DAQrate_detail_PersistentRequest_hh */
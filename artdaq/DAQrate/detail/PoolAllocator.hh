@@ -0,0 +1,93 @@
+#ifndef artdaq_DAQrate_detail_PoolAllocator_hh
+#define artdaq_DAQrate_detail_PoolAllocator_hh
+
+// PoolAllocator is a minimal standard allocator that keeps freed
+// single-object blocks on a per-type free list for reuse, instead of
+// returning them to the heap. It is intended for std::allocate_shared,
+// so that objects created and released at a steady rate (RawEvents, for
+// instance) stop hitting malloc once the pool has warmed up. Blocks may
+// be released from a different thread than the one that allocated them.
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace artdaq {
+  namespace detail {
+    template <typename T> class PoolAllocator;
+  }
+}
+
+template <typename T>
+class artdaq::detail::PoolAllocator {
+public:
+  typedef T value_type;
+
+  // Freed blocks beyond this many are returned to the heap.
+  static const size_t MAX_FREE_BLOCKS = 4096;
+
+  PoolAllocator() = default;
+  template <typename U>
+  PoolAllocator(PoolAllocator<U> const &) { }
+
+  T * allocate(size_t n)
+  {
+    if (n == 1) {
+      std::lock_guard<std::mutex> lock(mutex_());
+      std::vector<void *> & free_list = freeList_();
+      if (! free_list.empty()) {
+        void * p = free_list.back();
+        free_list.pop_back();
+        return static_cast<T *>(p);
+      }
+    }
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T * p, size_t n)
+  {
+    if (n == 1) {
+      std::lock_guard<std::mutex> lock(mutex_());
+      std::vector<void *> & free_list = freeList_();
+      if (free_list.size() < MAX_FREE_BLOCKS) {
+        free_list.push_back(p);
+        return;
+      }
+    }
+    ::operator delete(p);
+  }
+
+private:
+  static std::mutex & mutex_()
+  {
+    static std::mutex m;
+    return m;
+  }
+
+  static std::vector<void *> & freeList_()
+  {
+    static std::vector<void *> free_list;
+    return free_list;
+  }
+};
+
+template <typename T, typename U>
+inline
+bool
+operator==(artdaq::detail::PoolAllocator<T> const &,
+           artdaq::detail::PoolAllocator<U> const &)
+{
+  return true;
+}
+
+template <typename T, typename U>
+inline
+bool
+operator!=(artdaq::detail::PoolAllocator<T> const &,
+           artdaq::detail::PoolAllocator<U> const &)
+{
+  return false;
+}
+
+#endif /* artdaq_DAQrate_detail_PoolAllocator_hh */
@@ -0,0 +1,219 @@
+#ifndef artdaq_DAQrate_detail_SPSCQueue_hh
+#define artdaq_DAQrate_detail_SPSCQueue_hh
+
+// SPSCQueue is a bounded, lock-free queue for exactly one producer
+// thread and one consumer thread. The plain push() and pop() never
+// block; they return false when the queue is full or empty,
+// respectively. The timed overloads wait on a condition variable for
+// the other thread instead, which is only signalled while someone is
+// waiting, so the lock-free path stays lock-free.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace artdaq {
+  namespace detail {
+    template <typename T> class SPSCQueue;
+  }
+}
+
+template <typename T>
+class artdaq::detail::SPSCQueue {
+public:
+  // The queue holds at most capacity elements.
+  explicit SPSCQueue(size_t capacity);
+
+  SPSCQueue(SPSCQueue const &) = delete;
+  SPSCQueue & operator=(SPSCQueue const &) = delete;
+
+  // Producer side. If the queue is full, false is returned and item is
+  // left untouched.
+  bool push(T && item);
+
+  // Consumer side. If the queue is empty, false is returned.
+  bool pop(T & item);
+
+  // As above, but wait up to timeout for room or for an element first.
+  bool push(T && item, std::chrono::microseconds timeout);
+  bool pop(T & item, std::chrono::microseconds timeout);
+
+  // Approximate when called from a thread other than the two users.
+  bool empty() const;
+
+  // The number of elements queued; likewise approximate, e.g. for
+  // monitoring from another thread.
+  size_t size() const;
+
+private:
+  bool tryPush_(T & item);
+  bool tryPop_(T & item);
+  // Wait up to timeout for test() to return true.
+  template <typename TEST>
+  bool wait_(std::chrono::microseconds timeout, TEST test);
+  // Wake the other thread if it is waiting.
+  void wake_();
+
+  std::vector<T> slots_; // One more than the capacity.
+  // Written only by the consumer and producer, respectively; padded
+  // apart so the two threads do not contend for one cache line.
+  std::atomic<size_t> head_;
+  char pad_[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail_;
+  char pad2_[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> waiters_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+template <typename T>
+artdaq::detail::SPSCQueue<T>::
+SPSCQueue(size_t capacity)
+  :
+  slots_(capacity + 1),
+  head_(0),
+  pad_(),
+  tail_(0),
+  pad2_(),
+  waiters_(0),
+  mutex_(),
+  cond_()
+{
+}
+
+template <typename T>
+bool
+artdaq::detail::SPSCQueue<T>::
+push(T && item)
+{
+  if (! tryPush_(item)) {
+    return false;
+  }
+  wake_();
+  return true;
+}
+
+template <typename T>
+bool
+artdaq::detail::SPSCQueue<T>::
+pop(T & item)
+{
+  if (! tryPop_(item)) {
+    return false;
+  }
+  wake_();
+  return true;
+}
+
+template <typename T>
+bool
+artdaq::detail::SPSCQueue<T>::
+push(T && item, std::chrono::microseconds timeout)
+{
+  if (! tryPush_(item) &&
+      ! wait_(timeout, [&]() { return tryPush_(item); })) {
+    return false;
+  }
+  wake_();
+  return true;
+}
+
+template <typename T>
+bool
+artdaq::detail::SPSCQueue<T>::
+pop(T & item, std::chrono::microseconds timeout)
+{
+  if (! tryPop_(item) &&
+      ! wait_(timeout, [&]() { return tryPop_(item); })) {
+    return false;
+  }
+  wake_();
+  return true;
+}
+
+template <typename T>
+bool
+artdaq::detail::SPSCQueue<T>::
+tryPush_(T & item)
+{
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  size_t next = (tail + 1) % slots_.size();
+  if (next == head_.load(std::memory_order_acquire)) {
+    return false;
+  }
+  slots_[tail] = std::move(item);
+  tail_.store(next, std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+bool
+artdaq::detail::SPSCQueue<T>::
+tryPop_(T & item)
+{
+  size_t head = head_.load(std::memory_order_relaxed);
+  if (head == tail_.load(std::memory_order_acquire)) {
+    return false;
+  }
+  item = std::move(slots_[head]);
+  head_.store((head + 1) % slots_.size(), std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+template <typename TEST>
+bool
+artdaq::detail::SPSCQueue<T>::
+wait_(std::chrono::microseconds timeout, TEST test)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  waiters_.fetch_add(1);
+  // Pairs with the fence in wake_(): either the other thread sees us
+  // waiting, or the test below sees what it did.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  bool done = cond_.wait_for(lock, timeout, test);
+  waiters_.fetch_sub(1);
+  return done;
+}
+
+template <typename T>
+void
+artdaq::detail::SPSCQueue<T>::
+wake_()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiters_.load(std::memory_order_relaxed) != 0) {
+    // Taking the lock orders the notification after the waiter's test.
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+    }
+    cond_.notify_all();
+  }
+}
+
+template <typename T>
+inline
+bool
+artdaq::detail::SPSCQueue<T>::
+empty() const
+{
+  return head_.load(std::memory_order_acquire) ==
+    tail_.load(std::memory_order_acquire);
+}
+
+template <typename T>
+inline
+size_t
+artdaq::detail::SPSCQueue<T>::
+size() const
+{
+  size_t head = head_.load(std::memory_order_acquire);
+  size_t tail = tail_.load(std::memory_order_acquire);
+  return (tail + slots_.size() - head) % slots_.size();
+}
+
+#endif /* artdaq_DAQrate_detail_SPSCQueue_hh */
@@ -0,0 +1,63 @@
+#include "artdaq/Application/CommandableFragmentGenerator.hh"
+#include "artdaq/Application/GeneratorMacros.hh"
+#include "cetlib/exception.h"
+#include "fhiclcpp/ParameterSet.h"
+
+#include <chrono>
+#include <thread>
+
+namespace artdaqtest {
+  class CompositeDriverTestChild;
+}
+
+// A child for CompositeDriver_t: count Fragments with sequence IDs 1, 2,
+// ... and its fragment_id, each after delay_us, throwing in place of
+// the Fragment after throw_after of them (never if negative).
+class artdaqtest::CompositeDriverTestChild :
+  public artdaq::CommandableFragmentGenerator {
+public:
+  explicit CompositeDriverTestChild(fhicl::ParameterSet const & ps);
+
+private:
+  bool getNext_(artdaq::FragmentPtrs & frags) override;
+  void start() override;
+
+  size_t count_;
+  int throw_after_;
+  size_t delay_us_;
+  size_t sent_;
+};
+
+artdaqtest::CompositeDriverTestChild::
+CompositeDriverTestChild(fhicl::ParameterSet const & ps)
+  :
+  CommandableFragmentGenerator(ps),
+  count_(ps.get<size_t>("count")),
+  throw_after_(ps.get<int>("throw_after", -1)),
+  delay_us_(ps.get<size_t>("delay_us", 0)),
+  sent_(0)
+{
+}
+
+bool
+artdaqtest::CompositeDriverTestChild::getNext_(artdaq::FragmentPtrs & frags)
+{
+  if (should_stop() || sent_ == count_) { return false; }
+  if (throw_after_ >= 0 && sent_ == static_cast<size_t>(throw_after_)) {
+    throw cet::exception("CompositeDriverTestChild")
+      << "Failing after " << sent_ << " Fragments, as configured.";
+  }
+  if (delay_us_ > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(delay_us_));
+  }
+  frags.emplace_back(new artdaq::Fragment(++sent_, fragment_id()));
+  return true;
+}
+
+void
+artdaqtest::CompositeDriverTestChild::start()
+{
+  sent_ = 0;
+}
+
+DEFINE_ARTDAQ_COMMANDABLE_GENERATOR(artdaqtest::CompositeDriverTestChild)
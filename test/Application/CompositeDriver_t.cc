@@ -0,0 +1,102 @@
+#define BOOST_TEST_MODULE ( CompositeDriver_t )
+#include "boost/test/auto_unit_test.hpp"
+
+#include "artdaq-core/Data/Fragment.hh"
+#include "artdaq/Application/CommandableFragmentGenerator.hh"
+#include "artdaq/Application/makeCommandableFragmentGenerator.hh"
+#include "fhiclcpp/ParameterSet.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+  // The configuration of a CompositeDriverTestChild, as CompositeDriver
+  // expects to find it.
+  fhicl::ParameterSet child(int fragment_id, size_t count,
+                            size_t delay_us = 0, int throw_after = -1)
+  {
+    fhicl::ParameterSet fr_pset;
+    fr_pset.put<std::string>("generator", "CompositeDriverTestChild");
+    fr_pset.put<int>("board_id", fragment_id);
+    fr_pset.put<int>("fragment_id", fragment_id);
+    fr_pset.put<size_t>("count", count);
+    fr_pset.put<size_t>("delay_us", delay_us);
+    fr_pset.put<int>("throw_after", throw_after);
+    fhicl::ParameterSet daq_pset;
+    daq_pset.put<fhicl::ParameterSet>("fragment_receiver", fr_pset);
+    fhicl::ParameterSet pset;
+    pset.put<fhicl::ParameterSet>("daq", daq_pset);
+    return pset;
+  }
+
+  std::unique_ptr<artdaq::CommandableFragmentGenerator>
+  compositeDriver(std::vector<fhicl::ParameterSet> const & children,
+                  bool parallel, size_t max_queued_fragments = 1000)
+  {
+    fhicl::ParameterSet pset;
+    pset.put<int>("board_id", 99);
+    pset.put<std::vector<fhicl::ParameterSet>>("generator_config_list", children);
+    pset.put<bool>("parallel_child_polling", parallel);
+    pset.put<size_t>("max_queued_fragments", max_queued_fragments);
+    return artdaq::makeCommandableFragmentGenerator("CompositeDriver", pset);
+  }
+
+  // Read the driver out until it returns false, checking that each
+  // child's Fragments come in order; the number from each child.
+  std::map<artdaq::Fragment::fragment_id_t, size_t>
+  readOut(artdaq::CommandableFragmentGenerator & driver)
+  {
+    std::map<artdaq::Fragment::fragment_id_t, size_t> counts;
+    artdaq::FragmentPtrs frags;
+    while (driver.getNext(frags)) {
+      for (auto const & frag : frags) {
+        size_t & count = counts[frag->fragmentID()];
+        BOOST_REQUIRE_EQUAL(frag->sequenceID(), ++count);
+      }
+      frags.clear();
+    }
+    return counts;
+  }
+}
+
+BOOST_AUTO_TEST_SUITE(CompositeDriver_test)
+
+BOOST_AUTO_TEST_CASE(ParallelPolling)
+{
+  // A slow child does not hold up a fast one, and a queue of a few
+  // Fragments holds both back without losing any; twice, as over two
+  // runs.
+  auto driver = compositeDriver({ child(0, 200), child(1, 20, 1000) }, true, 4);
+  for (int run = 1; run <= 2; ++run) {
+    driver->StartCmd(run, 0, 0);
+    auto counts = readOut(*driver);
+    BOOST_REQUIRE_EQUAL(counts[0], 200ul);
+    BOOST_REQUIRE_EQUAL(counts[1], 20ul);
+    BOOST_REQUIRE(driver->ReportCmd() != "exception");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ParallelChildThrows)
+{
+  // A failing child ends the readout, with the others still going,
+  // instead of terminating the process.
+  auto driver = compositeDriver({ child(0, 1000000, 100), child(1, 100, 0, 5) }, true);
+  driver->StartCmd(1, 0, 0);
+  auto counts = readOut(*driver);
+  BOOST_REQUIRE(counts[0] < 1000000ul);
+  BOOST_REQUIRE(counts[1] <= 5ul);
+  BOOST_REQUIRE_EQUAL(driver->ReportCmd(), "exception");
+}
+
+BOOST_AUTO_TEST_CASE(SerialChildThrows)
+{
+  auto driver = compositeDriver({ child(0, 100), child(1, 100, 0, 5) }, false);
+  driver->StartCmd(1, 0, 0);
+  auto counts = readOut(*driver);
+  BOOST_REQUIRE_EQUAL(counts[1], 5ul);
+  BOOST_REQUIRE_EQUAL(driver->ReportCmd(), "exception");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
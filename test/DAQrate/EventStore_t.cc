@@ -1,5 +1,7 @@
 #include "artdaq/DAQrate/EventStore.hh"
 
+#include <atomic>
+#include <chrono>
 #include <thread>
 
 #define BOOST_TEST_MODULE(EventStore_t)
@@ -34,6 +36,27 @@ int bogusApp(int, char **)
   }
 }
 
+/* Takes no events off the GlobalQueue until released, so that the queue
+   fills up, and then counts the events it takes until the EndOfData
+   signal.
+*/
+std::atomic<bool> readerReleased(false);
+std::atomic<int> eventsRead(0);
+
+int blockedCountingApp(int, char **)
+{
+  while (! readerReleased.load()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  artdaq::RawEventQueue &queue(artdaq::getGlobalQueue());
+  artdaq::RawEvent_ptr incomingEvent;
+  while (true) {
+    queue.deqWait(incomingEvent);
+    artdaq::EventStore::notifyEventDequeued();
+    if (incomingEvent == nullptr) { return 0; }
+    ++eventsRead;
+  }
+}
 
 BOOST_AUTO_TEST_CASE(Trivial)
 {
@@ -122,4 +145,133 @@ BOOST_AUTO_TEST_CASE(SequenceMod)
   }
 }
 
+BOOST_AUTO_TEST_CASE(RingCollision)
+{
+  /* Events whose sequence IDs map to the same slot of the EventStore's
+     ring must still be built separately, and each completes when its own
+     last Fragment arrives.
+  */
+  std::unique_ptr<artdaq::EventStore> eventStore;
+  artdaq::EventStore::ART_CMDLINE_FCN *bogusReader = &bogusApp;
+  eventStore.reset(new artdaq::EventStore(2, 1, 0, 0, nullptr, bogusReader, false));
+
+  artdaq::Fragment::sequence_id_t farID = 1 + artdaq::EventStore::EVENT_RING_SIZE;
+  artdaq::Fragment::sequence_id_t sequenceID[4] = {1, farID, farID, 1};
+  int fragmentID[4] = {1, 1, 2, 2};
+  std::unique_ptr<artdaq::Fragment> testFragment;
+  for (int i = 0; i < 4; i++) {
+    testFragment.reset(new artdaq::Fragment(sequenceID[i], fragmentID[i]));
+    eventStore->insert(std::move(testFragment));
+  }
+  int readerReturnValue;
+  eventStore->endOfData(readerReturnValue);
+
+  artdaq::RawEventQueue &queue(artdaq::getGlobalQueue());
+
+  artdaq::RawEvent_ptr r1;
+  artdaq::RawEvent_ptr r2;
+  artdaq::RawEvent_ptr r3;
+  artdaq::RawEvent_ptr r4;
+
+  BOOST_REQUIRE_EQUAL(queue.deqNowait(r1), true);
+  BOOST_REQUIRE_EQUAL(queue.deqNowait(r2), true);
+  BOOST_REQUIRE_EQUAL(queue.deqNowait(r3), true);
+  BOOST_REQUIRE_EQUAL(queue.deqNowait(r4), false);
+
+  BOOST_REQUIRE_EQUAL(r1->numFragments(), (size_t) 2);
+  BOOST_REQUIRE_EQUAL(r2->numFragments(), (size_t) 2);
+  BOOST_REQUIRE_EQUAL(r1->sequenceID(), farID);
+  BOOST_REQUIRE_EQUAL(r2->sequenceID(), (artdaq::Fragment::sequence_id_t) 1);
+}
+
+BOOST_AUTO_TEST_CASE(Sharded)
+{
+  /* With several shards, events are assembled by worker threads; every
+     event must still be built, and endOfData must wait for the workers
+     to finish before the end-of-data marker is queued.
+  */
+  std::unique_ptr<artdaq::EventStore> eventStore;
+  artdaq::EventStore::ART_CMDLINE_FCN *bogusReader = &bogusApp;
+  eventStore.reset(new artdaq::EventStore(2, 1, 0, 0, nullptr, bogusReader, false));
+  eventStore->setShardCount(3);
+  BOOST_REQUIRE_EQUAL(eventStore->shardCount(), (size_t) 3);
+
+  const int eventCount = 10;
+  std::unique_ptr<artdaq::Fragment> testFragment;
+  for (int fragmentID = 1; fragmentID <= 2; ++fragmentID) {
+    for (int sequenceID = 1; sequenceID <= eventCount; ++sequenceID) {
+      testFragment.reset(new artdaq::Fragment(sequenceID, fragmentID));
+      eventStore->insert(std::move(testFragment));
+    }
+  }
+  int readerReturnValue;
+  eventStore->endOfData(readerReturnValue);
+
+  artdaq::RawEventQueue &queue(artdaq::getGlobalQueue());
+
+  std::vector<bool> seen(eventCount + 1, false);
+  artdaq::RawEvent_ptr r;
+  for (int i = 0; i < eventCount; ++i) {
+    BOOST_REQUIRE_EQUAL(queue.deqNowait(r), true);
+    BOOST_REQUIRE(r != nullptr);
+    BOOST_REQUIRE_EQUAL(r->numFragments(), (size_t) 2);
+    seen[r->sequenceID()] = true;
+  }
+  BOOST_REQUIRE_EQUAL(queue.deqNowait(r), true);
+  BOOST_REQUIRE(r == nullptr);
+  BOOST_REQUIRE_EQUAL(queue.deqNowait(r), false);
+  for (int sequenceID = 1; sequenceID <= eventCount; ++sequenceID) {
+    BOOST_REQUIRE(seen[sequenceID]);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ShardedBackpressure)
+{
+  /* When art stops taking events, the rejecting insert must hand
+     Fragments back to the caller rather than drop the events they
+     complete, also when a shard worker finds the queue full.
+  */
+  std::unique_ptr<artdaq::EventStore> eventStore;
+  artdaq::EventStore::ART_CMDLINE_FCN *reader = &blockedCountingApp;
+  const size_t queueSize = artdaq::getGlobalQueue().capacity();
+  eventStore.reset(new artdaq::EventStore(1, 1, 0, 0, nullptr, reader,
+                                          queueSize, 0.01, 1, false));
+  eventStore->setShardCount(2);
+
+  const int eventCount = queueSize + 20;
+  std::vector<artdaq::FragmentPtr> rejected;
+  auto insert = [&] (int sequenceID) {
+    artdaq::FragmentPtr testFragment(new artdaq::Fragment(sequenceID, 1));
+    artdaq::FragmentPtr rejectedFragment;
+    if (! eventStore->insert(std::move(testFragment), rejectedFragment)) {
+      rejected.emplace_back(std::move(rejectedFragment));
+    }
+  };
+  for (int sequenceID = 1; sequenceID <= eventCount; ++sequenceID) {
+    insert(sequenceID);
+  }
+  // Give the workers time to find the queue full, then insert once more
+  // to collect what they hand back.
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  insert(eventCount + 1);
+  readerReleased.store(true);
+  BOOST_REQUIRE(! rejected.empty());
+  for (auto const & fragment : rejected) {
+    BOOST_REQUIRE(fragment != nullptr);
+  }
+
+  // Retry once art is reading again, as EventBuilderCore does.
+  for (auto & fragment : rejected) {
+    artdaq::FragmentPtr rejectedFragment;
+    while (! eventStore->insert(std::move(fragment), rejectedFragment)) {
+      fragment = std::move(rejectedFragment);
+    }
+  }
+  // Anything a worker hands back after the last insert is inserted
+  // again before the end-of-data marker.
+  int readerReturnValue;
+  BOOST_REQUIRE(eventStore->endOfData(readerReturnValue));
+  BOOST_REQUIRE_EQUAL(eventsRead.load(), eventCount + 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,13 @@
 
 #include "art/Utilities/Exception.h"
 
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 using artdaq::detail::FragCounter;
 
 #define BOOST_TEST_MODULE(FragCounter_t)
@@ -70,4 +77,109 @@ BOOST_AUTO_TEST_CASE(ApplyWithOffset)
   BOOST_REQUIRE_EQUAL(f.count(), 8ul);
 }
 
+BOOST_AUTO_TEST_CASE(Snapshot)
+{
+  FragCounter f(3, 1);
+  f.incSlot(1, 2);
+  f.incSlot(3);
+  std::vector<size_t> expected { 2, 0, 1 };
+  BOOST_REQUIRE(f.snapshot() == expected);
+}
+
+BOOST_AUTO_TEST_CASE(ConcurrentSnapshot)
+{
+  // Each thread counts into its own slot and then the shared slot 0,
+  // while snapshots are taken. No slot may ever be seen to go down or
+  // past its final count, and once the threads are joined every count
+  // must be exact.
+  size_t const nThreads = 4;
+  size_t const nIncs = 100000;
+  FragCounter f(nThreads + 1);
+  std::vector<size_t> expected(nThreads + 1, nIncs);
+  expected[0] = nThreads * nIncs;
+  std::atomic<bool> done(false);
+  size_t bad_snapshots = 0; // (Boost.Test checks are not thread safe.)
+  size_t snapshots = 0;
+  std::thread reader([&]() {
+      std::vector<size_t> last(nThreads + 1, 0);
+      while (! done) {
+        std::vector<size_t> counts = f.snapshot();
+        for (size_t i = 0; i < counts.size(); ++i) {
+          if (counts[i] < last[i] || counts[i] > expected[i]) {
+            ++bad_snapshots;
+            break;
+          }
+        }
+        last = counts;
+        ++snapshots;
+        std::this_thread::yield();
+      }
+    });
+  std::vector<std::thread> writers;
+  for (size_t t = 0; t < nThreads; ++t) {
+    writers.emplace_back([&f, t, nIncs]() {
+        for (size_t i = 0; i < nIncs; ++i) {
+          f.incSlot(t + 1);
+          f.incSlot(0);
+        }
+      });
+  }
+  for (auto & w : writers) { w.join(); }
+  done = true;
+  reader.join();
+  BOOST_REQUIRE(snapshots > 0);
+  BOOST_REQUIRE_EQUAL(bad_snapshots, 0ul);
+  BOOST_REQUIRE(f.snapshot() == expected);
+  for (size_t i = 0; i <= nThreads; ++i) {
+    BOOST_REQUIRE_EQUAL(f.slotCount(i), expected[i]);
+  }
+  BOOST_REQUIRE_EQUAL(f.count(), 2 * nThreads * nIncs);
+}
+
+namespace {
+  // Increments per second by nThreads threads, each counting into slot
+  // (t % nSlots) through count(slot).
+  template <typename COUNT>
+  double incRate(size_t nThreads, size_t nSlots, size_t nIncs, COUNT count)
+  {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nThreads; ++t) {
+      threads.emplace_back([=]() {
+          for (size_t i = 0; i < nIncs; ++i) { count(t % nSlots); }
+        });
+    }
+    for (auto & t : threads) { t.join(); }
+    double elapsed = std::chrono::duration<double>
+      (std::chrono::steady_clock::now() - start).count();
+    return nThreads * nIncs / elapsed;
+  }
+}
+
+BOOST_AUTO_TEST_CASE(Contention)
+{
+  // Not a pass/fail test: compares the counter with the locking scheme
+  // it replaced (a global and a per-slot mutex), for threads counting
+  // into their own slots and into a single shared one.
+  size_t const nThreads = std::max(2u, std::thread::hardware_concurrency());
+  size_t const nIncs = 200000;
+  for (size_t nSlots : { nThreads, size_t(1) }) {
+    FragCounter f(nSlots);
+    double lock_free = incRate(nThreads, nSlots, nIncs,
+                               [&f](size_t slot) { f.incSlot(slot); });
+    BOOST_REQUIRE_EQUAL(f.count(), nThreads * nIncs);
+    std::mutex total_mutex;
+    std::vector<std::mutex> slot_mutexes(nSlots);
+    std::vector<size_t> counts(nSlots, 0);
+    double locked = incRate(nThreads, nSlots, nIncs, [&](size_t slot) {
+        std::lock_guard<std::mutex> total_lock(total_mutex);
+        std::lock_guard<std::mutex> slot_lock(slot_mutexes[slot]);
+        ++counts[slot];
+      });
+    std::cout << "FragCounter " << nThreads << " threads, " << nSlots
+              << " slots: " << lock_free / 1e6 << " M incs/s lock-free, "
+              << locked / 1e6 << " M incs/s locked\n";
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,46 @@
+#include "artdaq/DAQrate/detail/LatencyHistogram.hh"
+
+using artdaq::detail::LatencyHistogram;
+
+#define BOOST_TEST_MODULE(LatencyHistogram_t)
+#include "boost/test/auto_unit_test.hpp"
+
+BOOST_AUTO_TEST_SUITE(LatencyHistogram_test)
+
+BOOST_AUTO_TEST_CASE(Empty)
+{
+  LatencyHistogram h;
+  BOOST_REQUIRE_EQUAL(h.count(), 0ul);
+  BOOST_REQUIRE_EQUAL(h.percentile(0.5), 0.0);
+}
+
+BOOST_AUTO_TEST_CASE(Bins)
+{
+  LatencyHistogram h;
+  h.add(-1e-3);  // A clock offset error: counted as under 1 us.
+  h.add(0.5e-6);
+  h.add(1e-6);   // [1, 2) us
+  h.add(3e-6);   // [2, 4) us
+  h.add(1e4);    // Beyond the last edge, about 18 minutes.
+  BOOST_REQUIRE_EQUAL(h.count(), 5ul);
+  BOOST_REQUIRE_EQUAL(h.bins()[0], 2ul);
+  BOOST_REQUIRE_EQUAL(h.bins()[1], 1ul);
+  BOOST_REQUIRE_EQUAL(h.bins()[2], 1ul);
+  BOOST_REQUIRE_EQUAL(h.bins()[LatencyHistogram::BIN_COUNT - 1], 1ul);
+  h.reset();
+  BOOST_REQUIRE_EQUAL(h.count(), 0ul);
+  BOOST_REQUIRE_EQUAL(h.bins()[0], 0ul);
+}
+
+BOOST_AUTO_TEST_CASE(Percentiles)
+{
+  LatencyHistogram h;
+  for (int i = 0; i < 90; ++i) { h.add(50e-6); }  // [32, 64) us
+  for (int i = 0; i < 10; ++i) { h.add(3e-3); }   // [2048, 4096) us
+  BOOST_REQUIRE_CLOSE(h.percentile(0.5), 64e-6, 1e-6);
+  BOOST_REQUIRE_CLOSE(h.percentile(0.9), 64e-6, 1e-6);
+  BOOST_REQUIRE_CLOSE(h.percentile(0.99), 4096e-6, 1e-6);
+  BOOST_REQUIRE_CLOSE(h.percentile(1.0), 4096e-6, 1e-6);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
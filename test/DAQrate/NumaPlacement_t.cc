@@ -0,0 +1,77 @@
+#include "artdaq/DAQrate/NumaPlacement.hh"
+
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#define BOOST_TEST_MODULE(NumaPlacement_t)
+#include "boost/test/auto_unit_test.hpp"
+
+BOOST_AUTO_TEST_SUITE(NumaPlacement_test)
+
+BOOST_AUTO_TEST_CASE(ParseNumaMaps)
+{
+  std::istringstream maps
+    ("00400000 default file=/usr/bin/prog mapped=10 N0=10 kernelpagesize_kB=4\n"
+     "7f0000000000 bind:1 anon=512 dirty=512 N1=512 kernelpagesize_kB=4\n"
+     "7f1000000000 default huge anon=2 dirty=2 N0=1 N1=1 kernelpagesize_kB=2048\n"
+     "7fff00000000 default stack anon=3 dirty=3 active=0 N0=3 kernelpagesize_kB=4\n");
+  std::vector<size_t> bytes = artdaq::parseNumaMaps(maps);
+  BOOST_REQUIRE_EQUAL(bytes.size(), 2ul);
+  BOOST_REQUIRE_EQUAL(bytes[0], 13 * 4096ul + 2048 * 1024ul);
+  BOOST_REQUIRE_EQUAL(bytes[1], 512 * 4096ul + 2048 * 1024ul);
+}
+
+BOOST_AUTO_TEST_CASE(ParseEmpty)
+{
+  std::istringstream maps("");
+  BOOST_REQUIRE(artdaq::parseNumaMaps(maps).empty());
+}
+
+BOOST_AUTO_TEST_CASE(Cores)
+{
+  std::map<std::string, std::vector<int>> cores { { "art", { 0 } } };
+  artdaq::NumaPlacement placement(-1, cores);
+  BOOST_REQUIRE_EQUAL(placement.node(), -1);
+  BOOST_REQUIRE_EQUAL(placement.cores("art").size(), 1ul);
+  BOOST_REQUIRE(placement.cores("receive").empty());
+}
+
+BOOST_AUTO_TEST_CASE(ScopedRestores)
+{
+  cpu_set_t before;
+  BOOST_REQUIRE_EQUAL(pthread_getaffinity_np(pthread_self(), sizeof(before), &before), 0);
+  int core = 0;
+  while (! CPU_ISSET(core, &before)) { ++core; }
+  std::map<std::string, std::vector<int>> cores { { "art", { core } } };
+  artdaq::NumaPlacement placement(-1, cores);
+  {
+    artdaq::ScopedThreadPlacement scoped(placement, "art");
+    cpu_set_t during;
+    pthread_getaffinity_np(pthread_self(), sizeof(during), &during);
+    BOOST_REQUIRE_EQUAL(CPU_COUNT(&during), 1);
+    BOOST_REQUIRE(CPU_ISSET(core, &during));
+  }
+  cpu_set_t after;
+  pthread_getaffinity_np(pthread_self(), sizeof(after), &after);
+  BOOST_REQUIRE(CPU_EQUAL(&before, &after));
+}
+
+BOOST_AUTO_TEST_CASE(MemoryReportRateLimited)
+{
+  artdaq::NumaMemoryReport never;
+  BOOST_REQUIRE(! never.due());
+  artdaq::NumaMemoryReport hourly(std::chrono::hours(1));
+  BOOST_REQUIRE(hourly.due());
+  BOOST_REQUIRE(! hourly.due());
+  artdaq::NumaMemoryReport always(std::chrono::seconds(0));
+  BOOST_REQUIRE(always.due());
+  BOOST_REQUIRE(always.due());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
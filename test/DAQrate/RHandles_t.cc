@@ -0,0 +1,246 @@
+#include "artdaq/DAQrate/MPITag.hh"
+#include "artdaq/DAQrate/RHandles.hh"
+#include "artdaq/DAQrate/SHandles.hh"
+#include "artdaq/DAQrate/detail/ChunkHeader.hh"
+
+#include "art/Utilities/Exception.h"
+#include "artdaq-core/Data/Fragment.hh"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#define BOOST_TEST_MODULE(RHandles_t)
+#include "boost/test/auto_unit_test.hpp"
+
+// A single process sends to itself: it is both the only source and the
+// only destination.
+struct MPIFixture {
+  MPIFixture() { MPI_Init(nullptr, nullptr); }
+  ~MPIFixture() { MPI_Finalize(); }
+};
+
+BOOST_GLOBAL_FIXTURE(MPIFixture);
+
+namespace {
+  size_t const BUFFER_COUNT = 4;
+  size_t const MAX_PAYLOAD = 0x10000; // Words.
+  size_t const PAYLOAD = 1000;        // Words per Fragment sent.
+  size_t const SENDS = 50;
+
+  // Allocations of at least a Fragment's worth, and of at least a full
+  // receive buffer's, while counting.
+  std::atomic<bool> counting(false);
+  std::atomic<size_t> large_allocations(0);
+  std::atomic<size_t> full_allocations(0);
+}
+
+void * operator new(std::size_t size)
+{
+  if (counting && size >= PAYLOAD * sizeof(artdaq::RawDataType)) {
+    ++large_allocations;
+    if (size >= MAX_PAYLOAD * sizeof(artdaq::RawDataType)) {
+      ++full_allocations;
+    }
+  }
+  void * p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) { throw std::bad_alloc(); }
+  return p;
+}
+
+void operator delete(void * p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void * p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+namespace {
+  int myRank()
+  {
+    int rank = -1;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+  }
+
+  // Send SENDS Fragments of PAYLOAD words and receive each in a fresh
+  // Fragment. Once the receive buffers are posted, the only allocation
+  // a receive may make is that of the Fragment it copies out into: the
+  // buffer stays posted, so nothing of max_payload_size is allocated.
+  void checkCopyOut(bool persistent_requests)
+  {
+    int const rank = myRank();
+    artdaq::RHandlesOptions options;
+    options.persistent_requests = persistent_requests;
+    artdaq::RHandles receiver(BUFFER_COUNT, MAX_PAYLOAD, 1, rank, options);
+    {
+      artdaq::SHandles sender(BUFFER_COUNT, MAX_PAYLOAD, 1, rank,
+                              false, false, false, persistent_requests);
+      for (size_t i = 0; i < SENDS; ++i) {
+        artdaq::Fragment frag(PAYLOAD);
+        frag.setSequenceID(i + 1);
+        frag.dataBegin()[0] = i;
+        sender.sendFragment(std::move(frag));
+
+        artdaq::Fragment received;
+        large_allocations = 0;
+        full_allocations = 0;
+        counting = true;
+        receiver.recvFragment(received);
+        counting = false;
+        BOOST_REQUIRE_EQUAL(received.dataBegin()[0], i);
+        BOOST_REQUIRE_EQUAL(large_allocations, 1ul);
+        BOOST_REQUIRE_EQUAL(full_allocations, 0ul);
+      }
+    }
+    // Collect the end-of-data Fragment sent as the sender goes away.
+    while (receiver.sourcesActive() > 0) {
+      artdaq::Fragment eod;
+      receiver.recvFragment(eod);
+    }
+  }
+}
+
+namespace {
+  // Chunks as SHandles would send them: ChunkHeader, then the slice.
+  size_t const CHUNK_PAYLOAD = 16; // Words; the receiver's max_payload_size.
+  size_t const CHUNK_WORDS = CHUNK_PAYLOAD +
+    artdaq::detail::RawFragmentHeader::num_words() -
+    artdaq::detail::ChunkHeader::num_words();
+
+  artdaq::Fragment oversized(artdaq::Fragment::sequence_id_t seq, size_t words)
+  {
+    artdaq::Fragment frag(words);
+    frag.setSequenceID(seq);
+    for (size_t i = 0; i < words; ++i) {
+      frag.dataBegin()[i] = seq * 1000 + i;
+    }
+    return frag;
+  }
+
+  void sendChunk(artdaq::Fragment const & frag, uint64_t stream,
+                 size_t chunk, uint64_t total_words)
+  {
+    std::vector<artdaq::RawDataType> message(artdaq::detail::ChunkHeader::num_words());
+    auto & header = *reinterpret_cast<artdaq::detail::ChunkHeader *>(&message[0]);
+    header.stream_id = stream;
+    header.offset_words = chunk * CHUNK_WORDS;
+    header.total_words = total_words;
+    size_t const end = std::min(header.offset_words + CHUNK_WORDS, frag.size());
+    message.insert(message.end(), frag.headerBegin() + header.offset_words,
+                   frag.headerBegin() + end);
+    MPI_Send(&message[0], message.size() * sizeof(artdaq::RawDataType), MPI_BYTE,
+             myRank(), artdaq::MPITag::INCOMPLETE, MPI_COMM_WORLD);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE(RHandles_test)
+
+BOOST_AUTO_TEST_CASE(CopyOut)
+{
+  checkCopyOut(false);
+}
+
+BOOST_AUTO_TEST_CASE(CopyOutPersistent)
+{
+  checkCopyOut(true);
+}
+
+BOOST_AUTO_TEST_CASE(GrowingFragments)
+{
+  // Each Fragment is larger than the last one its buffer held; none may
+  // be cut short by a buffer posted at that size.
+  int const rank = myRank();
+  artdaq::RHandles receiver(BUFFER_COUNT, MAX_PAYLOAD, 1, rank);
+  {
+    artdaq::SHandles sender(BUFFER_COUNT, MAX_PAYLOAD, 1, rank, false, false);
+    for (size_t i = 0; i < SENDS; ++i) {
+      size_t const words = 8 + i * (MAX_PAYLOAD - 8) / SENDS;
+      artdaq::Fragment frag(words);
+      frag.setSequenceID(i + 1);
+      *(frag.dataEnd() - 1) = i;
+      sender.sendFragment(std::move(frag));
+      artdaq::Fragment received;
+      receiver.recvFragment(received);
+      BOOST_REQUIRE_EQUAL(received.dataSize(), words);
+      BOOST_REQUIRE_EQUAL(*(received.dataEnd() - 1), i);
+    }
+  }
+  while (receiver.sourcesActive() > 0) {
+    artdaq::Fragment eod;
+    receiver.recvFragment(eod);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(IdleBuffersReposted)
+{
+  // Buffers given up by a source that has reached its maximum are
+  // posted again as soon as it may have them.
+  int const rank = myRank();
+  artdaq::RHandles receiver(BUFFER_COUNT, MAX_PAYLOAD, 1, rank);
+  {
+    artdaq::SHandles sender(BUFFER_COUNT, MAX_PAYLOAD, 1, rank, false, false);
+    auto exchange = [&](size_t count) {
+      for (size_t i = 0; i < count; ++i) {
+        sender.sendFragment(artdaq::Fragment(PAYLOAD));
+        artdaq::Fragment received;
+        receiver.recvFragment(received);
+      }
+    };
+    BOOST_REQUIRE_EQUAL(receiver.postedBuffers(rank), BUFFER_COUNT);
+    receiver.setSourceQuotas(1, 2);
+    exchange(BUFFER_COUNT);
+    BOOST_REQUIRE_EQUAL(receiver.postedBuffers(rank), 2ul);
+    receiver.setSourceQuotas(1, 3);
+    BOOST_REQUIRE_EQUAL(receiver.postedBuffers(rank), 3ul);
+    exchange(BUFFER_COUNT);
+    BOOST_REQUIRE_EQUAL(receiver.postedBuffers(rank), 3ul);
+    receiver.setSourceQuotas(1, 0); // No maximum.
+    BOOST_REQUIRE_EQUAL(receiver.postedBuffers(rank), BUFFER_COUNT);
+    exchange(BUFFER_COUNT);
+    BOOST_REQUIRE_EQUAL(receiver.postedBuffers(rank), BUFFER_COUNT);
+  }
+  while (receiver.sourcesActive() > 0) {
+    artdaq::Fragment eod;
+    receiver.recvFragment(eod);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(InterleavedChunks)
+{
+  // The chunks of two oversized Fragments from one source, completing
+  // alternately, are each put back together with their own.
+  artdaq::RHandles receiver(BUFFER_COUNT, CHUNK_PAYLOAD, 1, myRank());
+  artdaq::Fragment first = oversized(1, 2 * CHUNK_WORDS - 5);
+  artdaq::Fragment second = oversized(2, 2 * CHUNK_WORDS - 7);
+  sendChunk(first, 7, 0, first.size());
+  sendChunk(second, 8, 0, second.size());
+  sendChunk(first, 7, 1, first.size());
+  sendChunk(second, 8, 1, second.size());
+  for (artdaq::Fragment const * sent : { &first, &second }) {
+    artdaq::Fragment received;
+    receiver.recvFragment(received);
+    BOOST_REQUIRE_EQUAL(received.sequenceID(), sent->sequenceID());
+    BOOST_REQUIRE_EQUAL(received.dataSize(), sent->dataSize());
+    BOOST_REQUIRE(std::equal(sent->dataBegin(), sent->dataEnd(),
+                             received.dataBegin()));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(MismatchedChunk)
+{
+  // A chunk that disagrees with the rest of its stream about the size
+  // of the Fragment is rejected.
+  artdaq::RHandles receiver(BUFFER_COUNT, CHUNK_PAYLOAD, 1, myRank());
+  artdaq::Fragment frag = oversized(1, 2 * CHUNK_WORDS - 5);
+  sendChunk(frag, 3, 0, frag.size());
+  sendChunk(frag, 3, 1, frag.size() + 1);
+  artdaq::Fragment received;
+  BOOST_REQUIRE_THROW(receiver.recvFragment(received), art::Exception);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,217 @@
+#include "artdaq/DAQrate/RoutingPolicy.hh"
+
+#include "art/Utilities/Exception.h"
+
+#include <memory>
+#include <vector>
+
+#define BOOST_TEST_MODULE(RoutingPolicy_t)
+#include "boost/test/auto_unit_test.hpp"
+
+// The token policy needs MPI; a single process is its own routing
+// master, sole sender and the rank its tokens come from.
+struct MPIFixture {
+  MPIFixture() { MPI_Init(nullptr, nullptr); }
+  ~MPIFixture() { MPI_Finalize(); }
+};
+
+BOOST_GLOBAL_FIXTURE(MPIFixture);
+
+namespace {
+  int myRank()
+  {
+    int rank = -1;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+  }
+
+  // Let the tokens sent to ourselves arrive before they are collected.
+  void settle()
+  {
+    MPI_Barrier(MPI_COMM_WORLD);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE(RoutingPolicy_test)
+
+BOOST_AUTO_TEST_CASE(Modulo)
+{
+  artdaq::ModuloRoutingPolicy p(3, 5);
+  BOOST_REQUIRE_EQUAL(p.calcDest(0), 5ul);
+  BOOST_REQUIRE_EQUAL(p.calcDest(1), 6ul);
+  BOOST_REQUIRE_EQUAL(p.calcDest(2), 7ul);
+  BOOST_REQUIRE_EQUAL(p.calcDest(3), 5ul);
+}
+
+BOOST_AUTO_TEST_CASE(Weighted)
+{
+  std::vector<size_t> weights { 2, 1, 0 };
+  artdaq::WeightedRoutingPolicy p(3, 4, weights);
+  std::vector<size_t> counts(3, 0);
+  for (size_t seq = 0; seq < 300; ++seq) {
+    size_t dest = p.calcDest(seq);
+    BOOST_REQUIRE(dest >= 4 && dest < 7);
+    ++counts[dest - 4];
+    // The same sequence ID must always go to the same place.
+    BOOST_REQUIRE_EQUAL(p.calcDest(seq), dest);
+  }
+  BOOST_REQUIRE_EQUAL(counts[0], 200ul);
+  BOOST_REQUIRE_EQUAL(counts[1], 100ul);
+  BOOST_REQUIRE_EQUAL(counts[2], 0ul);
+}
+
+BOOST_AUTO_TEST_CASE(WeightedMismatch)
+{
+  std::vector<size_t> weights { 1, 1 };
+  try
+  {
+    artdaq::WeightedRoutingPolicy p(3, 0, weights);
+    BOOST_REQUIRE(0 && "Should have thrown exception");
+  } catch (art::Exception const & e)
+  {
+    BOOST_REQUIRE_EQUAL(e.categoryCode(), art::errors::Configuration);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ActiveSet)
+{
+  // Rank 6 of 5..8 stands by: its share is spread over the other three.
+  std::vector<bool> active { true, false, true, true };
+  artdaq::ActiveSetRoutingPolicy p(std::unique_ptr<artdaq::RoutingPolicy>
+                                   (new artdaq::ModuloRoutingPolicy(4, 5)),
+                                   active);
+  std::vector<size_t> counts(4, 0);
+  for (size_t seq = 0; seq < 1200; ++seq) {
+    size_t dest = p.calcDest(seq);
+    BOOST_REQUIRE(dest >= 5 && dest < 9);
+    ++counts[dest - 5];
+    BOOST_REQUIRE_EQUAL(p.calcDest(seq), dest);
+    if (seq % 4 != 1) {
+      BOOST_REQUIRE_EQUAL(dest, seq % 4 + 5); // Unchanged.
+    }
+  }
+  BOOST_REQUIRE_EQUAL(counts[0], 400ul);
+  BOOST_REQUIRE_EQUAL(counts[1], 0ul);
+  BOOST_REQUIRE_EQUAL(counts[2], 400ul);
+  BOOST_REQUIRE_EQUAL(counts[3], 400ul);
+}
+
+BOOST_AUTO_TEST_CASE(ActiveSetNoneActive)
+{
+  std::vector<bool> active(3, false);
+  try
+  {
+    artdaq::ActiveSetRoutingPolicy p(std::unique_ptr<artdaq::RoutingPolicy>
+                                     (new artdaq::ModuloRoutingPolicy(3, 0)),
+                                     active);
+    BOOST_REQUIRE(0 && "Should have thrown exception");
+  } catch (art::Exception const & e)
+  {
+    BOOST_REQUIRE_EQUAL(e.categoryCode(), art::errors::Configuration);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(TokenWithoutTokens)
+{
+  // No capacity advertised: modulo over the positions in the table,
+  // which never changes, so it is broadcast once while the leases grow.
+  artdaq::TokenRoutingPolicy p(3, 5, MPI_COMM_SELF, 10, 4);
+  for (size_t seq = 0; seq < 200; ++seq) {
+    BOOST_REQUIRE_EQUAL(p.calcDest(seq), seq % 10 % 3 + 5);
+  }
+  BOOST_REQUIRE_EQUAL(p.tableBroadcasts(), 1ul);
+}
+
+BOOST_AUTO_TEST_CASE(TokenFollowsCapacity)
+{
+  // Two destinations starting at our own rank: we advertise capacity
+  // for the first only, so it gets every sequence ID until the table
+  // runs out of that capacity, and the modulo rule after that.
+  int const rank = myRank();
+  artdaq::TokenRoutingPolicy p(2, rank, MPI_COMM_SELF, 10, 4);
+  {
+    artdaq::RoutingTokenSender tokens(rank);
+    tokens.send(6);
+    settle();
+    std::vector<size_t> first_block;
+    for (size_t seq = 0; seq < 10; ++seq) {
+      size_t expected = seq < 6 ? rank : seq % 2 + rank;
+      BOOST_REQUIRE_EQUAL(p.calcDest(seq), expected);
+      first_block.push_back(expected);
+    }
+    BOOST_REQUIRE_EQUAL(p.tableBroadcasts(), 1ul);
+    // The same sequence ID always goes to the same place.
+    BOOST_REQUIRE_EQUAL(p.calcDest(3), static_cast<size_t>(rank));
+
+    // Unchanged capacity: the table is not broadcast again.
+    for (size_t seq = 10; seq < 100; ++seq) {
+      BOOST_REQUIRE_EQUAL(p.calcDest(seq), first_block[seq % 10]);
+    }
+    BOOST_REQUIRE_EQUAL(p.tableBroadcasts(), 1ul);
+
+    // New capacity is picked up by the next lease sent out, which
+    // routes once the one already out runs out: at most 4 blocks on.
+    tokens.send(10);
+    settle();
+    size_t seq = 100;
+    while (p.tableBroadcasts() == 1ul && seq < 1000) {
+      p.calcDest(seq);
+      seq += 10;
+    }
+    BOOST_REQUIRE_EQUAL(p.tableBroadcasts(), 2ul);
+    size_t new_blocks = 0;
+    for (size_t block = 0; block < 4 + 2; ++block, seq += 10) {
+      bool all_to_rank = true;
+      for (size_t pos = 0; pos < 10; ++pos) {
+        all_to_rank = all_to_rank && p.calcDest(seq + pos) == static_cast<size_t>(rank);
+      }
+      if (all_to_rank) { ++new_blocks; }
+      else { BOOST_REQUIRE_EQUAL(new_blocks, 0ul); } // The old table, before.
+    }
+    BOOST_REQUIRE(new_blocks >= 2);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(TokenSkippedBlocks)
+{
+  // A jump ahead is a lease or two, not one for each block skipped;
+  // the lease before routes those.
+  artdaq::TokenRoutingPolicy p(3, 0, MPI_COMM_SELF, 10, 4);
+  p.calcDest(0);
+  size_t far = p.calcDest(1000000);
+  BOOST_REQUIRE_EQUAL(p.calcDest(1000000), far);
+  BOOST_REQUIRE_EQUAL(p.calcDest(1000000 - 1), 9ul % 3);
+  BOOST_REQUIRE_EQUAL(p.tableBroadcasts(), 1ul);
+}
+
+BOOST_AUTO_TEST_CASE(TokenPreviousLease)
+{
+  artdaq::TokenRoutingPolicy p(2, 0, MPI_COMM_SELF, 10, 1);
+  size_t first = p.calcDest(5);
+  p.calcDest(15);
+  // A straggler from the block before is routed as it was.
+  BOOST_REQUIRE_EQUAL(p.calcDest(5), first);
+  p.calcDest(25);
+  try
+  {
+    p.calcDest(5);
+    BOOST_REQUIRE(0 && "Should have thrown exception");
+  } catch (art::Exception const & e)
+  {
+    BOOST_REQUIRE_EQUAL(e.categoryCode(), art::errors::LogicError);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(TokenBadConfiguration)
+{
+  try
+  {
+    artdaq::TokenRoutingPolicy p(2, 0, MPI_COMM_SELF, 10, 0);
+    BOOST_REQUIRE(0 && "Should have thrown exception");
+  } catch (art::Exception const & e)
+  {
+    BOOST_REQUIRE_EQUAL(e.categoryCode(), art::errors::Configuration);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,112 @@
+#include "artdaq/DAQrate/detail/SPSCQueue.hh"
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+using artdaq::detail::SPSCQueue;
+
+#define BOOST_TEST_MODULE(SPSCQueue_t)
+#include "boost/test/auto_unit_test.hpp"
+
+BOOST_AUTO_TEST_SUITE(SPSCQueue_test)
+
+BOOST_AUTO_TEST_CASE(FullAndEmpty)
+{
+  SPSCQueue<std::unique_ptr<int>> q(2);
+  BOOST_REQUIRE(q.empty());
+  BOOST_REQUIRE_EQUAL(q.size(), 0ul);
+  std::unique_ptr<int> item(new int(1));
+  BOOST_REQUIRE(q.push(std::move(item)));
+  item.reset(new int(2));
+  BOOST_REQUIRE(q.push(std::move(item)));
+  BOOST_REQUIRE_EQUAL(q.size(), 2ul);
+  // A failed push leaves the item with the caller.
+  item.reset(new int(3));
+  BOOST_REQUIRE(! q.push(std::move(item)));
+  BOOST_REQUIRE(item);
+  BOOST_REQUIRE(q.pop(item));
+  BOOST_REQUIRE_EQUAL(*item, 1);
+  BOOST_REQUIRE_EQUAL(q.size(), 1ul);
+  BOOST_REQUIRE(q.pop(item));
+  BOOST_REQUIRE_EQUAL(*item, 2);
+  BOOST_REQUIRE(! q.pop(item));
+  BOOST_REQUIRE(q.empty());
+}
+
+BOOST_AUTO_TEST_CASE(Wraparound)
+{
+  SPSCQueue<int> q(3);
+  for (int i = 0; i < 10; ++i) {
+    int in = i;
+    BOOST_REQUIRE(q.push(std::move(in)));
+    BOOST_REQUIRE_EQUAL(q.size(), 1ul);
+    int out = -1;
+    BOOST_REQUIRE(q.pop(out));
+    BOOST_REQUIRE_EQUAL(out, i);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(TwoThreads)
+{
+  const int count = 100000;
+  SPSCQueue<int> q(16);
+  std::thread producer([&q] () {
+      for (int i = 0; i < count; ++i) {
+        int in = i;
+        while (! q.push(std::move(in))) { std::this_thread::yield(); }
+      }
+    });
+  int expected = 0;
+  while (expected < count) {
+    int out;
+    if (q.pop(out)) {
+      BOOST_REQUIRE_EQUAL(out, expected);
+      ++expected;
+    }
+  }
+  producer.join();
+  BOOST_REQUIRE(q.empty());
+}
+
+BOOST_AUTO_TEST_CASE(TimedWaitsExpire)
+{
+  SPSCQueue<int> q(1);
+  int out = -1;
+  auto start = std::chrono::steady_clock::now();
+  BOOST_REQUIRE(! q.pop(out, std::chrono::microseconds(20000)));
+  BOOST_REQUIRE(std::chrono::steady_clock::now() - start >=
+                std::chrono::microseconds(20000));
+  BOOST_REQUIRE(q.push(1, std::chrono::microseconds(0)));
+  int in = 2;
+  BOOST_REQUIRE(! q.push(std::move(in), std::chrono::microseconds(20000)));
+  BOOST_REQUIRE_EQUAL(in, 2);
+  BOOST_REQUIRE(q.pop(out, std::chrono::microseconds(0)));
+  BOOST_REQUIRE_EQUAL(out, 1);
+}
+
+BOOST_AUTO_TEST_CASE(TwoThreadsWaiting)
+{
+  // Both sides block rather than spin: the small queue fills and
+  // empties constantly, so each side waits on the other many times.
+  const int count = 100000;
+  const std::chrono::microseconds forever(std::chrono::seconds(10));
+  SPSCQueue<int> q(2);
+  bool pushed_all = true;
+  std::thread producer([&] () {
+      for (int i = 0; i < count && pushed_all; ++i) {
+        int in = i;
+        pushed_all = q.push(std::move(in), forever);
+      }
+    });
+  for (int expected = 0; expected < count; ++expected) {
+    int out;
+    BOOST_REQUIRE(q.pop(out, forever));
+    BOOST_REQUIRE_EQUAL(out, expected);
+  }
+  producer.join();
+  BOOST_REQUIRE(pushed_all);
+  BOOST_REQUIRE(q.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
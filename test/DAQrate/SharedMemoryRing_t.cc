@@ -0,0 +1,64 @@
+#include "artdaq/DAQrate/SharedMemoryRing.hh"
+
+#include "cetlib/exception.h"
+
+#define BOOST_TEST_MODULE(SharedMemoryRing_t)
+#include "boost/test/auto_unit_test.hpp"
+
+BOOST_AUTO_TEST_SUITE(SharedMemoryRing_test)
+
+BOOST_AUTO_TEST_CASE(WriteRead)
+{
+  auto reader = artdaq::SharedMemoryRing::create(1, 2, 64);
+  auto writer = artdaq::SharedMemoryRing::attach(1, 2, 1.0);
+  artdaq::Fragment received;
+  BOOST_REQUIRE(reader->empty());
+  BOOST_REQUIRE(! reader->read(received));
+
+  artdaq::Fragment frag(5);
+  frag.setSequenceID(7);
+  frag.setFragmentID(3);
+  *frag.dataBegin() = 42;
+  writer->write(frag);
+  BOOST_REQUIRE(! reader->empty());
+  BOOST_REQUIRE(reader->read(received));
+  BOOST_REQUIRE_EQUAL(received.sequenceID(), 7u);
+  BOOST_REQUIRE_EQUAL(received.fragmentID(), 3u);
+  BOOST_REQUIRE_EQUAL(received.dataSize(), 5u);
+  BOOST_REQUIRE_EQUAL(*received.dataBegin(), 42u);
+  BOOST_REQUIRE(reader->empty());
+  BOOST_REQUIRE(! reader->read(received));
+}
+
+BOOST_AUTO_TEST_CASE(Wrap)
+{
+  // Fragments of varying size must come out intact and in order when
+  // they run past the end of the ring.
+  auto reader = artdaq::SharedMemoryRing::create(1, 2, 64);
+  auto writer = artdaq::SharedMemoryRing::attach(1, 2, 1.0);
+  artdaq::Fragment received;
+  for (size_t seq = 1; seq < 100; ++seq) {
+    artdaq::Fragment frag(seq % 20);
+    frag.setSequenceID(seq);
+    writer->write(frag);
+    BOOST_REQUIRE(reader->read(received));
+    BOOST_REQUIRE_EQUAL(received.sequenceID(), seq);
+    BOOST_REQUIRE_EQUAL(received.dataSize(), seq % 20);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(TooLarge)
+{
+  auto reader = artdaq::SharedMemoryRing::create(1, 2, 64);
+  auto writer = artdaq::SharedMemoryRing::attach(1, 2, 1.0);
+  artdaq::Fragment frag(writer->maxFragmentWords());
+  BOOST_REQUIRE_THROW(writer->write(frag), cet::exception);
+}
+
+BOOST_AUTO_TEST_CASE(AttachTimeout)
+{
+  BOOST_REQUIRE_THROW(artdaq::SharedMemoryRing::attach(3, 4, 0.01),
+                      cet::exception);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,150 @@
+#include "artdaq/DAQrate/TCPTransport.hh"
+
+#include "cetlib/exception.h"
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BOOST_TEST_MODULE(TCPTransport_t)
+#include "boost/test/auto_unit_test.hpp"
+
+namespace {
+  std::vector<std::string> localEndpoint(artdaq::TCPReceiver const & receiver)
+  {
+    return std::vector<std::string>(1, "localhost:" + std::to_string(receiver.port()));
+  }
+}
+
+BOOST_AUTO_TEST_SUITE(TCPTransport_test)
+
+BOOST_AUTO_TEST_CASE(SendReceive)
+{
+  artdaq::TCPReceiver receiver(0, 1, 3);
+  artdaq::TCPSender sender(3, 5, localEndpoint(receiver));
+  artdaq::Fragment frag(5);
+  frag.setSequenceID(7);
+  frag.setFragmentID(3);
+  *frag.dataBegin() = 42;
+  sender.send(5, frag);
+
+  artdaq::Fragment received;
+  BOOST_REQUIRE_EQUAL(receiver.receive(received, 1000000), 3);
+  BOOST_REQUIRE_EQUAL(received.sequenceID(), 7u);
+  BOOST_REQUIRE_EQUAL(received.fragmentID(), 3u);
+  BOOST_REQUIRE_EQUAL(received.dataSize(), 5u);
+  BOOST_REQUIRE_EQUAL(*received.dataBegin(), 42u);
+  BOOST_REQUIRE_EQUAL(receiver.receive(received, 1000), -1);
+}
+
+BOOST_AUTO_TEST_CASE(Streams)
+{
+  // Large and batched Fragments from two senders must arrive intact and
+  // in order per source, however the stream happens to be split up.
+  size_t const count = 200;
+  artdaq::TCPReceiver receiver(0, 2, 0);
+  auto send = [&receiver, count](int rank) {
+    artdaq::TCPSender sender(rank, 0, localEndpoint(receiver));
+    for (size_t seq = 0; seq < count; seq += 2) {
+      artdaq::Fragment first(seq * 1000);
+      first.setSequenceID(seq);
+      artdaq::Fragment second(seq % 7);
+      second.setSequenceID(seq + 1);
+      sender.send(0, std::vector<artdaq::Fragment const *>{ &first, &second });
+    }
+  };
+  std::thread sender0(send, 0);
+  std::thread sender1(send, 1);
+
+  std::vector<size_t> next(2, 0);
+  artdaq::Fragment received;
+  for (size_t n = 0; n < 2 * count; ++n) {
+    int src = receiver.receive(received, 10000000);
+    BOOST_REQUIRE(src == 0 || src == 1);
+    size_t seq = next[src]++;
+    BOOST_REQUIRE_EQUAL(received.sequenceID(), seq);
+    BOOST_REQUIRE_EQUAL(received.dataSize(), seq % 2 ? (seq - 1) % 7 : seq * 1000);
+  }
+  sender0.join();
+  sender1.join();
+}
+
+BOOST_AUTO_TEST_CASE(BoundedReadAhead)
+{
+  // Only two Fragments are read ahead at a time; the rest wait in the
+  // socket, and all still arrive, in order.
+  size_t const count = 20;
+  artdaq::TCPReceiver receiver(0, 1, 0, 2);
+  artdaq::TCPSender sender(0, 0, localEndpoint(receiver));
+  artdaq::Fragments batch;
+  for (size_t seq = 0; seq < count; ++seq) {
+    batch.emplace_back(seq);
+    batch.back().setSequenceID(seq);
+  }
+  sender.send(0, batch);
+
+  artdaq::Fragment received;
+  for (size_t seq = 0; seq < count; ++seq) {
+    BOOST_REQUIRE_EQUAL(receiver.receive(received, 1000000), 0);
+    BOOST_REQUIRE_EQUAL(received.sequenceID(), seq);
+    BOOST_REQUIRE_EQUAL(received.dataSize(), seq);
+  }
+  BOOST_REQUIRE_EQUAL(receiver.receive(received, 1000), -1);
+}
+
+BOOST_AUTO_TEST_CASE(UnexpectedSenders)
+{
+  // Connections that do not introduce themselves as one of our sources
+  // are closed, without disturbing the others.
+  artdaq::TCPReceiver receiver(0, 1, 3);
+  auto connectRaw = [&receiver](uint32_t magic, uint32_t rank) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(receiver.port());
+    BOOST_REQUIRE(connect(fd, reinterpret_cast<struct sockaddr *>(&address),
+                          sizeof(address)) == 0);
+    uint32_t hello[2] = { magic, rank };
+    BOOST_REQUIRE(write(fd, hello, sizeof(hello)) == sizeof(hello));
+    return fd;
+  };
+  int bad_magic = connectRaw(0x12345678, 3);
+  int bad_rank = connectRaw(0x41525444, 9);
+
+  artdaq::TCPSender sender(3, 3, localEndpoint(receiver));
+  artdaq::Fragment frag(1);
+  frag.setSequenceID(5);
+  sender.send(3, frag);
+  artdaq::Fragment received;
+  BOOST_REQUIRE_EQUAL(receiver.receive(received, 1000000), 3);
+  BOOST_REQUIRE_EQUAL(received.sequenceID(), 5u);
+  BOOST_REQUIRE_EQUAL(receiver.receive(received, 100000), -1);
+
+  for (int fd : { bad_magic, bad_rank }) {
+    struct pollfd closed = { fd, POLLIN, 0 };
+    BOOST_REQUIRE_EQUAL(poll(&closed, 1, 1000), 1);
+    char byte;
+    BOOST_REQUIRE_EQUAL(read(fd, &byte, 1), 0); // End of stream.
+    close(fd);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ConnectTimeout)
+{
+  int port;
+  {
+    artdaq::TCPReceiver receiver(0, 1, 0);
+    port = receiver.port();
+  } // Closed again: nobody listens on port now.
+  artdaq::TCPSender sender(0, 0, std::vector<std::string>(1, "localhost:" + std::to_string(port)), 0.2);
+  BOOST_REQUIRE_THROW(sender.send(0, artdaq::Fragment(1)), cet::exception);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,122 @@
+// recv_latency: measure the delivery latency of RHandles::recvFragment
+// with a receive timeout (the way the EventBuilder calls it) at several
+// send rates. Rank 0 sends, rank 1 receives; both must be on the same
+// host so that MPI_Wtime() gives comparable times.
+//
+// Usage: mpirun -np 2 recv_latency [sends_per_rate]
+
+#include "artdaq-core/Data/Fragment.hh"
+#include "artdaq/DAQrate/RHandles.hh"
+#include "artdaq/DAQrate/SHandles.hh"
+#include "artdaq/DAQdata/Debug.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define BUFFER_COUNT 10
+#define PAYLOAD_WORDS 16
+#define RECV_TIMEOUT_USEC 100000
+
+namespace {
+  // Sends per second for each measurement: a low and a high rate.
+  double const rates[] = { 100.0, 20000.0 };
+  size_t const n_rates = sizeof(rates) / sizeof(rates[0]);
+
+  void do_sending(int sends_per_rate)
+  {
+    artdaq::SHandles sender(BUFFER_COUNT, PAYLOAD_WORDS, 1, 1, false, false);
+    artdaq::Fragment::sequence_id_t seq = 0;
+    for (size_t r = 0; r < n_rates; ++r) {
+      double const interval = 1.0 / rates[r];
+      double next = MPI_Wtime();
+      for (int ii = 0; ii < sends_per_rate; ++ii) {
+        while (MPI_Wtime() < next) { }
+        next += interval;
+        artdaq::Fragment frag(PAYLOAD_WORDS);
+        frag.setSequenceID(++seq);
+        frag.setFragmentID(0);
+        double now = MPI_Wtime();
+        memcpy(&*frag.dataBegin(), &now, sizeof(now));
+        sender.sendFragment(std::move(frag));
+      }
+      MPI_Barrier(MPI_COMM_WORLD);
+    }
+  }
+
+  void report(double rate, std::vector<double> & latencies)
+  {
+    std::sort(latencies.begin(), latencies.end());
+    auto pct = [&latencies](double p) {
+      size_t idx = static_cast<size_t>(p * (latencies.size() - 1));
+      return latencies[idx] * 1e6;
+    };
+    std::cout << std::fixed << std::setprecision(1)
+              << "rate=" << rate << "/s n=" << latencies.size()
+              << " latency_us p50=" << pct(0.50)
+              << " p90=" << pct(0.90)
+              << " p99=" << pct(0.99)
+              << " max=" << pct(1.0) << std::endl;
+  }
+
+  void do_receiving(int sends_per_rate)
+  {
+    artdaq::RHandles receiver(BUFFER_COUNT, PAYLOAD_WORDS, 1, 0);
+    for (size_t r = 0; r < n_rates; ++r) {
+      std::vector<double> latencies;
+      latencies.reserve(sends_per_rate);
+      while (static_cast<int>(latencies.size()) < sends_per_rate) {
+        artdaq::Fragment frag;
+        size_t src = receiver.recvFragment(frag, RECV_TIMEOUT_USEC);
+        if (src == artdaq::RHandles::RECV_TIMEOUT) { continue; }
+        double now = MPI_Wtime();
+        double sent;
+        memcpy(&sent, &*frag.dataBegin(), sizeof(sent));
+        latencies.push_back(now - sent);
+      }
+      report(rates[r], latencies);
+      MPI_Barrier(MPI_COMM_WORLD);
+    }
+    // Collect the EOD sent when the sender shuts down.
+    while (receiver.anySourceActive()) {
+      artdaq::Fragment frag;
+      receiver.recvFragment(frag, RECV_TIMEOUT_USEC);
+    }
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  auto const requested_threading = MPI_THREAD_SERIALIZED;
+  int provided_threading = -1;
+  auto rc = MPI_Init_thread(&argc, &argv, requested_threading, &provided_threading);
+  assert(rc == 0);
+  int my_rank = -1;
+  int total_ranks = -1;
+  MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &total_ranks);
+  if (total_ranks != 2) {
+    if (my_rank == 0) {
+      std::cerr << argv[0] << " requires exactly 2 ranks, "
+                << total_ranks << " provided\n";
+    }
+    MPI_Finalize();
+    return 1;
+  }
+  int sends_per_rate = (argc > 1) ? atoi(argv[1]) : 2000;
+  configureDebugStream(my_rank, 0);
+  if (my_rank == 0) {
+    do_sending(sends_per_rate);
+  }
+  else {
+    do_receiving(sends_per_rate);
+  }
+  rc = MPI_Finalize();
+  assert(rc == 0);
+  return 0;
+}
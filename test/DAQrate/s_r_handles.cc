@@ -1,34 +1,106 @@
 #include "artdaq-core/Data/Fragments.hh"
+#include "artdaq/DAQrate/ClockOffset.hh"
 #include "artdaq/DAQrate/RHandles.hh"
+#include "artdaq/DAQrate/RoutingPolicy.hh"
 #include "artdaq/DAQrate/SHandles.hh"
+#include "artdaq/DAQrate/detail/LatencyHistogram.hh"
 
 #include "artdaq/DAQdata/Debug.hh"
 #include "artdaq-core/Data/Fragment.hh"
 #include "trace.h"
 
+#include <chrono>
 #include <iostream>
+#include <memory>
 #include <mpi.h>
 #include <stdlib.h> // for putenv
+#include <string>
+#include <vector>
 
 #define SND_BUFFER_COUNT 10
 #define RCV_BUFFER_COUNT SND_BUFFER_COUNT /* snd/rcv may be different */
 #define MAX_PAYLOAD_SIZE 0x100000-artdaq::detail::RawFragmentHeader::num_words()
+#define TCP_BASE_PORT 35000 /* with "tcp", receiver rank r listens on TCP_BASE_PORT+r */
+#define CLOCK_SYNC_ROUNDS 5 /* with "stamped" */
+#define CREDIT_WINDOW 2 /* with "credit" */
+#define THROTTLE_USEC 200000 /* with "credit"s: wait this long for stragglers */
+#define TOKEN_TABLE_SIZE 10 /* with "token" */
+#define TOKEN_MAX_LEASE_BLOCKS 4 /* with "token" */
+
+// Transports: "mpi" (the default), "persistent" (MPI with persistent
+// requests), "fair" (MPI with receive buffers shared out by need; see
+// RHandles::setSourceQuotas), "fair-persistent" (both), "stamped" (MPI with latency stamps),
+// "credit" (MPI with credit-based flow control, briefly withholding all
+// credit to check that the senders stop), "credit-posted" (the same,
+// with credit following the receives posted), "elastic" (MPI with the last
+// receiver standing by, if there is more than one), "token" (MPI with
+// the token routing policy; every sender but the first skips some
+// sequence IDs and stops early), "tcp" and "rma" (one-sided MPI).
+// With "elastic", the receiver of the highest rank takes no part.
+bool standsBy(int my_rank, int num_senders, std::string const & transport)
+{
+  int total_ranks = -1;
+  MPI_Comm_size(MPI_COMM_WORLD, &total_ranks);
+  return transport == "elastic" && total_ranks - num_senders > 1 &&
+    my_rank == total_ranks - 1;
+}
 
 void do_sending(  int my_rank, int num_senders, int num_receivers
-		, int sends_each_sender )
+		, int sends_each_sender, unsigned payload_words
+		, std::string const & transport, MPI_Comm sender_comm )
 {
     TRACE( 7, "do_sending entered RawFragmentHeader::num_words()=%lu"
 	  , artdaq::detail::RawFragmentHeader::num_words() );
     artdaq::SHandles sender(  SND_BUFFER_COUNT, MAX_PAYLOAD_SIZE
 			    , num_receivers // dest_count
 			    , num_senders // dest_start
-			    , false ); // broadcast_sends
+			    , false // broadcast_sends
+			    , true  // synchronous_sends
+			    , false // shared_memory
+			    , transport == "persistent" ||
+			      transport == "fair-persistent" );
+    if (transport == "elastic") {
+      sender.setActiveDestinations(artdaq::receiveMembership(num_receivers, num_senders));
+    }
+    if (transport == "tcp") {
+      std::vector<std::string> endpoints;
+      for (int rr = 0; rr < num_receivers; ++rr) {
+        endpoints.push_back("localhost:" + std::to_string(TCP_BASE_PORT + num_senders + rr));
+      }
+      sender.useTCP(my_rank, endpoints);
+    }
+    if (transport == "rma") {
+      sender.useOneSided(sender_comm);
+    }
+    if (transport == "stamped") {
+      sender.enableLatencyStamps(CLOCK_SYNC_ROUNDS);
+    }
+    if (transport == "credit" || transport == "credit-posted") {
+      sender.useCredits();
+    }
+    int last_send = sends_each_sender;
+    if (transport == "token") {
+      sender.setRoutingPolicy(std::unique_ptr<artdaq::RoutingPolicy>
+                              (new artdaq::TokenRoutingPolicy(num_receivers, num_senders,
+                                                              sender_comm, TOKEN_TABLE_SIZE,
+                                                              TOKEN_MAX_LEASE_BLOCKS)));
+      last_send = sends_each_sender / (my_rank + 1);
+    }
   
     std::vector<artdaq::Fragment> frags(SND_BUFFER_COUNT,artdaq::Fragment());
 
-    for (int ii=0; ii<sends_each_sender; ++ii)
+    for (int ii=0; ii<last_send; ++ii)
     {
-	unsigned data_size = MAX_PAYLOAD_SIZE;
+	if (transport == "token" && my_rank > 0 &&
+	    ii / (2 * TOKEN_TABLE_SIZE + 5) % (my_rank + 2) == 1) {
+	  continue; // Not every sender has every sequence ID, or block.
+	}
+	unsigned data_size = payload_words;
+	if (transport == "stamped") {
+	  // Vary the size, so that a receive buffer sized by the last
+	  // Fragment it held would truncate the next, larger, one.
+	  data_size = payload_words / 4 * (ii % 5);
+	}
 	if (data_size < 8) data_size=8;  // min size
 	TRACE( 6, "sender rank %d #%u resize datsz=%u",my_rank,ii,data_size );
 	frags[ii%SND_BUFFER_COUNT].resize(data_size);
@@ -42,6 +114,7 @@ void do_sending(  int my_rank, int num_senders, int num_receivers
 	*it   = my_rank;
 	*++it = ii;
 	*++it = sndDatSz;
+	*(frags[ii%SND_BUFFER_COUNT].dataEnd()-1) = ii; // last word, for checking
 
 	sender.sendFragment( std::move(frags[ii%SND_BUFFER_COUNT]) );
 	//usleep( (data_size*sizeof(artdaq::RawDataType))/233 );
@@ -53,17 +126,128 @@ void do_sending(  int my_rank, int num_senders, int num_receivers
 
 } // do_sending
 
-void do_receiving(int /*my_rank*/, int num_senders)
+void do_receiving(int my_rank, int num_senders, int sends_each_sender,
+                  std::string const & transport, MPI_Comm receiver_comm)
 {
   TRACE( 7, "do_receiving entered" );
+  if (transport == "elastic") {
+    bool const active = ! standsBy(my_rank, num_senders, transport);
+    artdaq::announceMembership(active, num_senders, 0);
+    if (! active) {
+      std::cout << "Receiver rank " << my_rank << " (" << transport
+                << "): standing by\n";
+      return;
+    }
+  }
+  artdaq::RHandlesOptions options;
+  options.tcp_port = transport == "tcp" ? TCP_BASE_PORT + my_rank : -1;
+  options.one_sided = transport == "rma";
+  options.persistent_requests =
+    transport == "persistent" || transport == "fair-persistent";
+  options.clock_sync_rounds = transport == "stamped" ? CLOCK_SYNC_ROUNDS : 0;
   artdaq::RHandles receiver(RCV_BUFFER_COUNT,
                             MAX_PAYLOAD_SIZE,
                             num_senders, // src_count
-                            0);          // src_start
+                            0,           // src_start
+                            options);
+  artdaq::detail::LatencyHistogram latency;
+  if (transport == "fair" || transport == "fair-persistent") {
+    receiver.setSourceQuotas(1, RCV_BUFFER_COUNT / 2);
+  }
+  if (transport == "credit") {
+    receiver.useCredits(CREDIT_WINDOW);
+  }
+  else if (transport == "credit-posted") {
+    receiver.useCredits(0);
+  }
+  bool throttle = (transport == "credit" || transport == "credit-posted");
+  // Each sender holds at most its window, or its posted receives (or one).
+  size_t const max_stragglers = transport == "credit" ?
+    CREDIT_WINDOW * num_senders : RCV_BUFFER_COUNT + num_senders;
+  size_t frag_count = 0;
+  size_t byte_count = 0;
+  std::vector<int> routed_here(sends_each_sender, 0); // By sequence ID.
+  // With "token", advertise a varying capacity to the routing master
+  // (sender rank 0), so that the routing tables keep changing.
+  std::unique_ptr<artdaq::RoutingTokenSender> tokens;
+  if (transport == "token") {
+    tokens.reset(new artdaq::RoutingTokenSender(0));
+  }
+  auto start = std::chrono::steady_clock::now();
   while (receiver.sourcesActive() > 0) {
     artdaq::Fragment junkFrag;
     receiver.recvFragment(junkFrag);
+    if (junkFrag.type() != artdaq::Fragment::EndOfDataFragmentType &&
+        (junkFrag.dataBegin()[2] != junkFrag.dataSize() ||
+         *(junkFrag.dataEnd()-1) != junkFrag.dataBegin()[1])) {
+      std::cerr << "Receiver rank " << my_rank << ": corrupt Fragment of "
+                << junkFrag.dataSize() << " words from rank "
+                << junkFrag.dataBegin()[0] << "\n";
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (transport == "stamped" && junkFrag.dataSize() < MAX_PAYLOAD_SIZE) {
+      if (receiver.lastSendTime() < 0) {
+        std::cerr << "Receiver rank " << my_rank << ": unstamped Fragment\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+      latency.add((artdaq::steadyClockNanoseconds() - receiver.lastSendTime()) * 1e-9);
+    }
+    if (junkFrag.type() != artdaq::Fragment::EndOfDataFragmentType) {
+      routed_here[junkFrag.sequenceID()] = 1;
+    }
+    if (tokens) {
+      tokens->send(frag_count % (2 * TOKEN_TABLE_SIZE));
+    }
+    ++frag_count;
+    byte_count += junkFrag.size() * sizeof(artdaq::RawDataType);
+    if (throttle) {
+      // Grant nothing more: only what the senders already hold may come.
+      throttle = false;
+      receiver.setCreditLimit(0);
+      size_t straggler_count = 0;
+      while (receiver.sourcesActive() > 0) {
+        artdaq::Fragment straggler;
+        if (receiver.recvFragment(straggler, THROTTLE_USEC) ==
+            artdaq::RHandles::RECV_TIMEOUT) { break; }
+        if (straggler.type() != artdaq::Fragment::EndOfDataFragmentType) {
+          ++straggler_count;
+        }
+        ++frag_count;
+        byte_count += straggler.size() * sizeof(artdaq::RawDataType);
+      }
+      if (straggler_count > max_stragglers) {
+        std::cerr << "Receiver rank " << my_rank << ": " << straggler_count
+                  << " Fragments arrived after credit was withheld\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+      receiver.setCreditLimit(transport == "credit" ? CREDIT_WINDOW : RCV_BUFFER_COUNT);
+    }
   }
+  double elapsed = std::chrono::duration<double>
+    (std::chrono::steady_clock::now() - start).count();
+  if (transport == "token") {
+    // Every sender must have routed each sequence ID to the same place.
+    std::vector<int> routed(sends_each_sender, 0);
+    MPI_Allreduce(&routed_here[0], &routed[0], sends_each_sender, MPI_INT,
+                  MPI_SUM, receiver_comm);
+    for (int seq = 0; seq < sends_each_sender; ++seq) {
+      if (routed[seq] > 1) {
+        std::cerr << "Receiver rank " << my_rank << ": sequence ID " << seq
+                  << " went to " << routed[seq] << " receivers\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+    }
+  }
+  std::cout << "Receiver rank " << my_rank << " (" << transport
+            << "): " << frag_count << " fragments, " << byte_count
+            << " bytes in " << elapsed << " s = "
+            << (elapsed > 0 ? frag_count / elapsed : 0) << " fragments/s, "
+            << (elapsed > 0 ? byte_count / elapsed / 1e6 : 0) << " MB/s";
+  if (latency.count() > 0) {
+    std::cout << ", latency p50 < " << latency.percentile(0.5) * 1e6
+              << " us, p99 < " << latency.percentile(0.99) * 1e6 << " us";
+  }
+  std::cout << "\n";
 }
 
 int main(int argc, char * argv[])
@@ -86,13 +270,30 @@ int main(int argc, char * argv[])
       std::cout << "argv[" << i << "]: " << argv[i] << std::endl;
     }
   }
-  if (argc < 2 || 3 < argc) {
-    std::cerr << argv[0] << " requires 2 or 3 arguments, " << argc << " provided\n";
+  if (argc < 2 || 5 < argc) {
+    std::cerr << argv[0] << " requires 2 to 5 arguments, " << argc << " provided\n";
     return 1;
   }
   auto num_sending_ranks = atoi(argv[1]);
   int sends_each_sender=0; // besides "EOD" sends
-  if (argc == 3) sends_each_sender = atoi(argv[2]);
+  if (argc >= 3) sends_each_sender = atoi(argv[2]);
+  // Then optionally the transport (see do_sending), to compare them, and
+  // the payload size in words, e.g. small to measure the message rate.
+  std::string transport = "mpi";
+  if (argc >= 4) transport = argv[3];
+  if (transport != "mpi" && transport != "persistent" && transport != "fair" &&
+      transport != "fair-persistent" && transport != "stamped" &&
+      transport != "credit" && transport != "credit-posted" &&
+      transport != "elastic" && transport != "token" &&
+      transport != "tcp" && transport != "rma") {
+    std::cerr << argv[0] << ": unknown transport \"" << transport << "\"\n";
+    return 1;
+  }
+  unsigned payload_words = MAX_PAYLOAD_SIZE;
+  if (argc == 5) payload_words = atoi(argv[4]);
+  if (payload_words < 8) payload_words = 8;  // min size
+  // Larger Fragments are sent in chunks, which one-sided puts can't do.
+  if (payload_words > MAX_PAYLOAD_SIZE && transport == "rma") payload_words = MAX_PAYLOAD_SIZE;
   int total_ranks = -1;
   rc = MPI_Comm_size(MPI_COMM_WORLD, &total_ranks);
   auto num_receiving_ranks = total_ranks - num_sending_ranks;
@@ -101,14 +302,35 @@ int main(int argc, char * argv[])
     std::cout << "Number of sending ranks:     " << num_sending_ranks <<"\n";
     std::cout << "Number of receiving ranks:   " << num_receiving_ranks <<"\n";
     std::cout << "Number of sends_each_sender: " << sends_each_sender <<"\n";
+    std::cout << "Transport:                   " << transport <<"\n";
+    std::cout << "Payload words:               " << payload_words <<"\n";
   }
   configureDebugStream(my_rank, 0);
+  // The senders' own communicator, for setting up one-sided transfers and
+  // token routing; the receivers have one too.
+  MPI_Comm sender_comm;
+  MPI_Comm_split(MPI_COMM_WORLD, my_rank < num_sending_ranks, my_rank, &sender_comm);
   if (my_rank < num_sending_ranks) {
-    do_sending(my_rank,num_sending_ranks,num_receiving_ranks,sends_each_sender);
+    do_sending(my_rank,num_sending_ranks,num_receiving_ranks,sends_each_sender,
+               payload_words,transport,sender_comm);
   }
   else {
-    do_receiving(my_rank, num_sending_ranks);
+    do_receiving(my_rank, num_sending_ranks, sends_each_sender, transport, sender_comm);
+  }
+  if (transport == "elastic") {
+    // Everything has been sent; none of it may be waiting for a receiver
+    // that stood by.
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (standsBy(my_rank, num_sending_ranks, transport)) {
+      int flag = 0;
+      MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
+      if (flag) {
+        std::cerr << "Receiver rank " << my_rank << ": sent to while standing by\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+    }
   }
+  MPI_Comm_free(&sender_comm);
   rc = MPI_Finalize();
   assert(rc == 0);
   TRACE( 11, "s_r_handles main return" );
@@ -0,0 +1,260 @@
+// transfer_bench: measure SHandles -> RHandles transfers over a sweep of
+// Fragment sizes, buffer counts, sender and receiver counts, and
+// synchronous and asynchronous sends, and report the message rate,
+// bandwidth and one-way latency percentiles of each configuration as
+// JSON. Each configuration uses the first senders + receivers ranks
+// (senders first), the rest waiting; it is skipped if there are not
+// enough ranks. All ranks must be on the same host, so that their
+// steady clocks agree for the latencies (MPI_Wtime() need not agree
+// between processes).
+//
+// Usage: mpirun -np N transfer_bench [--sizes w,...] [--buffers n,...]
+//          [--senders n,...] [--receivers n,...] [--modes sync,async]
+//          [--sends n] [--output file]
+// where sizes are payload words and sends is per sender.
+
+#include "artdaq-core/Data/Fragment.hh"
+#include "artdaq/DAQrate/RHandles.hh"
+#include "artdaq/DAQrate/SHandles.hh"
+#include "artdaq/DAQdata/Debug.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+namespace {
+  // Host-wide clock, in seconds, for stamping Fragments.
+  double now()
+  {
+    return std::chrono::duration<double>
+      (std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  struct Options {
+    std::vector<size_t> sizes { 8, 1024, 65536, 1048576 };
+    std::vector<size_t> buffers { 4, 10 };
+    std::vector<size_t> senders { 1, 2 };
+    std::vector<size_t> receivers { 1 };
+    std::vector<std::string> modes { "sync", "async" };
+    size_t sends = 1000;
+    std::string output; // Empty for stdout.
+  };
+
+  struct Config {
+    size_t payload_words;
+    size_t buffer_count;
+    size_t senders;
+    size_t receivers;
+    bool synchronous;
+  };
+
+  std::vector<std::string> split(std::string const & list)
+  {
+    std::vector<std::string> items;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+      if (! item.empty()) { items.push_back(item); }
+    }
+    return items;
+  }
+
+  std::vector<size_t> splitNumbers(std::string const & list)
+  {
+    std::vector<size_t> numbers;
+    for (auto const & item : split(list)) {
+      numbers.push_back(strtoul(item.c_str(), nullptr, 0));
+    }
+    return numbers;
+  }
+
+  bool parse(int argc, char * argv[], Options & opts)
+  {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (i + 1 == argc) { return false; } // Every option takes a value.
+      std::string value = argv[++i];
+      if (arg == "--sizes") { opts.sizes = splitNumbers(value); }
+      else if (arg == "--buffers") { opts.buffers = splitNumbers(value); }
+      else if (arg == "--senders") { opts.senders = splitNumbers(value); }
+      else if (arg == "--receivers") { opts.receivers = splitNumbers(value); }
+      else if (arg == "--modes") { opts.modes = split(value); }
+      else if (arg == "--sends") { opts.sends = strtoul(value.c_str(), nullptr, 0); }
+      else if (arg == "--output") { opts.output = value; }
+      else { return false; }
+    }
+    for (auto const & mode : opts.modes) {
+      if (mode != "sync" && mode != "async") { return false; }
+    }
+    return true;
+  }
+
+  // Send sends Fragments, each stamped with its send time; return the
+  // time taken from when every rank is ready.
+  double do_sending(Config const & cfg, int my_rank, size_t sends)
+  {
+    artdaq::SHandles sender(cfg.buffer_count, cfg.payload_words,
+                            cfg.receivers, cfg.senders,
+                            false, cfg.synchronous);
+    MPI_Barrier(MPI_COMM_WORLD); // Everyone is set up: start the clock.
+    double start = MPI_Wtime();
+    for (size_t ii = 0; ii < sends; ++ii) {
+      artdaq::Fragment frag(cfg.payload_words);
+      frag.setSequenceID(ii + 1);
+      frag.setFragmentID(my_rank);
+      double sent = now();
+      memcpy(&*frag.dataBegin(), &sent, sizeof(sent));
+      sender.sendFragment(std::move(frag));
+    }
+    sender.waitAll();
+    return MPI_Wtime() - start;
+  }
+
+  // Receive until every sender is done, collecting the one-way latency
+  // of each Fragment; return the time taken.
+  double do_receiving(Config const & cfg, std::vector<double> & latencies)
+  {
+    artdaq::RHandles receiver(cfg.buffer_count, cfg.payload_words,
+                              cfg.senders, 0);
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    double last = start;
+    while (receiver.anySourceActive()) {
+      artdaq::Fragment frag;
+      receiver.recvFragment(frag);
+      last = MPI_Wtime();
+      if (frag.type() != artdaq::Fragment::EndOfDataFragmentType) {
+        double sent;
+        memcpy(&sent, &*frag.dataBegin(), sizeof(sent));
+        latencies.push_back(now() - sent);
+      }
+    }
+    return last - start;
+  }
+
+  double percentile(std::vector<double> const & sorted, double p)
+  {
+    if (sorted.empty()) { return 0.0; }
+    return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+  }
+
+  // Run one configuration on every rank; rank 0 returns its JSON.
+  std::string run(Config const & cfg, int my_rank, size_t sends)
+  {
+    int const active = cfg.senders + cfg.receivers;
+    std::vector<double> latencies;
+    double elapsed = 0.0;
+    if (my_rank < static_cast<int>(cfg.senders)) {
+      elapsed = do_sending(cfg, my_rank, sends);
+    }
+    else if (my_rank < active) {
+      latencies.reserve(sends * cfg.senders);
+      elapsed = do_receiving(cfg, latencies);
+    }
+    else {
+      MPI_Barrier(MPI_COMM_WORLD); // Not taking part.
+    }
+    double max_elapsed = 0.0;
+    MPI_Reduce(&elapsed, &max_elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    // Bring every latency to rank 0.
+    int total_ranks;
+    MPI_Comm_size(MPI_COMM_WORLD, &total_ranks);
+    int my_count = latencies.size();
+    std::vector<int> counts(total_ranks, 0);
+    MPI_Gather(&my_count, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::vector<int> displacements(total_ranks, 0);
+    for (int r = 1; r < total_ranks; ++r) {
+      displacements[r] = displacements[r - 1] + counts[r - 1];
+    }
+    std::vector<double> all(displacements.back() + counts.back() + 1);
+    MPI_Gatherv(latencies.data(), my_count, MPI_DOUBLE, &all[0], &counts[0],
+                &displacements[0], MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if (my_rank != 0) { return std::string(); }
+    all.pop_back();
+    std::sort(all.begin(), all.end());
+    size_t const messages = all.size();
+    double const bytes = messages * (cfg.payload_words +
+      artdaq::detail::RawFragmentHeader::num_words()) * sizeof(artdaq::RawDataType);
+    std::ostringstream json;
+    json << "{\"payload_words\": " << cfg.payload_words
+         << ", \"buffer_count\": " << cfg.buffer_count
+         << ", \"senders\": " << cfg.senders
+         << ", \"receivers\": " << cfg.receivers
+         << ", \"mode\": \"" << (cfg.synchronous ? "sync" : "async") << "\""
+         << ", \"messages\": " << messages
+         << ", \"seconds\": " << max_elapsed
+         << ", \"messages_per_sec\": " << (max_elapsed > 0 ? messages / max_elapsed : 0)
+         << ", \"mb_per_sec\": " << (max_elapsed > 0 ? bytes / max_elapsed / 1e6 : 0)
+         << ", \"latency_us\": {\"p50\": " << percentile(all, 0.50) * 1e6
+         << ", \"p90\": " << percentile(all, 0.90) * 1e6
+         << ", \"p99\": " << percentile(all, 0.99) * 1e6
+         << ", \"max\": " << percentile(all, 1.0) * 1e6 << "}}";
+    return json.str();
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  auto const requested_threading = MPI_THREAD_SERIALIZED;
+  int provided_threading = -1;
+  auto rc = MPI_Init_thread(&argc, &argv, requested_threading, &provided_threading);
+  assert(rc == 0);
+  int my_rank = -1;
+  int total_ranks = -1;
+  MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &total_ranks);
+  Options opts;
+  if (! parse(argc, argv, opts)) {
+    if (my_rank == 0) {
+      std::cerr << "Usage: " << argv[0] << " [--sizes w,...] [--buffers n,...]"
+                << " [--senders n,...] [--receivers n,...] [--modes sync,async]"
+                << " [--sends n] [--output file]\n";
+    }
+    MPI_Finalize();
+    return 1;
+  }
+  configureDebugStream(my_rank, 0);
+  std::vector<std::string> results;
+  for (size_t senders : opts.senders) {
+    for (size_t receivers : opts.receivers) {
+      if (senders == 0 || receivers == 0 ||
+          senders + receivers > static_cast<size_t>(total_ranks)) {
+        continue; // Not enough ranks for this one.
+      }
+      for (size_t payload_words : opts.sizes) {
+        for (size_t buffer_count : opts.buffers) {
+          for (auto const & mode : opts.modes) {
+            Config cfg { std::max<size_t>(payload_words, 1), buffer_count,
+                         senders, receivers, mode == "sync" };
+            std::string json = run(cfg, my_rank, opts.sends);
+            if (my_rank == 0) {
+              results.push_back(json);
+              std::cerr << json << std::endl; // Progress.
+            }
+          }
+        }
+      }
+    }
+  }
+  if (my_rank == 0) {
+    std::ofstream file;
+    if (! opts.output.empty()) { file.open(opts.output); }
+    std::ostream & out = opts.output.empty() ? std::cout : file;
+    out << "{\"benchmark\": \"transfer_bench\", \"ranks\": " << total_ranks
+        << ", \"sends_per_sender\": " << opts.sends << ", \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+      out << "  " << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]}" << std::endl;
+  }
+  rc = MPI_Finalize();
+  assert(rc == 0);
+  return 0;
+}